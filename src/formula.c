@@ -37,18 +37,45 @@
 #include "maths_val.h"
 #include "maths_op.h"
 #include "maths_func.h"
+#include "maths_prog.h"
+#include "maths_jit.h"
+#include "maths_cgen.h"
+#include "maths_simplify.h"
 #include "char_masks.h"
 #include "plugin-intl.h"
 
 
-static GHashTable  *htab = NULL;
-static gchar       *key = NULL;
-static guint        running_formulas = 0;
 static gboolean     report_errors = TRUE;
+static MATHS_ARENA *arena = NULL;
 
 
-static MATHS_TREE_ELEMENT * mstr_eval ( gchar        *mstr,
-                                        const gulong  len );
+/* Number of compiled formulas kept by formula_get() */
+#define FORMULA_CACHE_SIZE 16
+
+/* Compiled formulas, the most recently used first */
+static GList *cache = NULL;
+static guint  cache_len = 0;
+
+/* The parser state and the cache are shared, the preview builds its
+   formulas on a thread of its own */
+static GMutex lock;
+
+
+/* Tokens of a formula */
+enum { TOKEN_END, TOKEN_OP, TOKEN_NAME, TOKEN_NUMBER, TOKEN_CALL, TOKEN_OPENING_P, TOKEN_CLOSING_P, TOKEN_ARG_DELIM };
+
+
+/* Parser state, the formula is read once from left to right */
+typedef struct formula_parser_t
+{
+  gchar  *next;   /* first character after the current token */
+  gint    token;
+  gchar  *text;   /* current token */
+  gulong  len;
+} FORMULA_PARSER ;
+
+
+static MATHS_TREE_ELEMENT * parse_sum ( FORMULA_PARSER *p );
 
 
 /*
@@ -116,162 +143,6 @@ is_op_non_prio ( gchar op )
 }
 
 
-/*
- * Returns a pointer to the next non prioritary operator.
- */
-static gchar *
-get_next_non_prio_op ( gchar        *mstr,
-                       const gulong  len )
-{
-  gchar *ptr;
-  gint k = 0;
-
-  if ( is_op_non_prio(*mstr) )
-    return mstr;
-  else if ( *mstr == '(' )
-    k = 1;
-
-  for ( ptr=mstr+1; ptr<(mstr+len); ++ptr )
-    {
-      if ( *ptr == '(' )
-        {
-          ++k;
-        }
-      else if ( *ptr == ')' )
-        --k;
-      else if ( k == 0 )
-        {
-          if ( *ptr == '+' )
-            return ptr;
-          else if ( ( *ptr == '-' ) && ( !is_op(*(ptr-1)) ) )
-            return ptr;
-        }
-    }
-
-  return NULL;
-}
-
-
-/*
- * Returns a pointer to the next next non prioritary operator.
- */
-static gchar *
-get_next_next_non_prio_op ( gchar        *mstr,
-                            const gulong  len )
-{
-  gchar *ptr;
-  gint k = 0;
-
-  for ( ptr=mstr+1; ptr<(mstr+len); ++ptr )
-    {
-      if ( *ptr == '(' )
-        ++k;
-      else if ( *ptr == ')' )
-        --k;
-      else if ( k == 0 )
-        {
-          if ( *ptr == '+' )
-            return ptr;
-          else if ( ( *ptr == '-' ) && ( !is_op(*(ptr-1)) ) )
-            return ptr;
-        }
-    }
-
-  return NULL;
-}
-
-
-/*
- * Returns a pointer to the prioritary operator.
- */
-static gchar *
-get_next_prio_op ( gchar        *mstr,
-                   const gulong  len )
-{
-  gchar *ptr;
-  gint k = 0;
-
-  for ( ptr=mstr; ptr<(mstr+len); ++ptr )
-    {
-      if ( *ptr == '(' )
-        ++k;
-      else if ( *ptr == ')' )
-        --k;
-      if ( ( is_op_prio(*ptr) ) && ( k == 0 ) )
-        return ptr;
-    }
-
-  return NULL;
-}
-
-
-/*
- * Returns the index of the closing parenthese.
- */
-static gchar *
-get_next_opening_p ( gchar        *mstr,
-                     const gulong  len )
-{
-  gchar *ptr;
-
-  for ( ptr=mstr; ptr<(mstr+len); ++ptr )
-    if ( *ptr == '(' )
-      return ptr;
-
-  return NULL;
-}
-
-
-/*
- * Returns the index of the next arg separator.
- */
-static gchar *
-get_next_arg_delim ( gchar        *mstr,
-                     const gulong  len )
-{
-  gchar *ptr;
-  gint k = 0;
-
-  for ( ptr=mstr; ptr<(mstr+len); ++ptr )
-    if ( *ptr == '(' )
-      ++k;
-    else if ( *ptr == ')' )
-      --k;
-    else if ( k == 0 )
-      if ( *ptr == ',' )
-        return ptr;
-
-  return NULL;
-}
-
-
-/*
- * Returns the index of the closing parenthese.
- */
-static gchar *
-get_next_closing_p ( gchar        *mstr,
-                     const gulong  len )
-{
-  gchar *ptr;
-  gint k = 0;
-
-  for ( ptr=mstr, k=0; ptr<=(mstr+len); ++ptr )
-    {
-      if ( *ptr == '(' )
-        ++k;
-      else if ( *ptr == ')' )
-        {
-          if ( k == 0 )
-            return ptr;
-
-          --k;
-        }
-    }
-
-  return ( mstr+len-1 );  /* we allow unclosed parentheses */
-}
-
-
 /*
  * Cleans up an expression (removes presentation chars)
  */
@@ -307,12 +178,11 @@ static MATHS_TREE_ELEMENT *
 build_new_elem ( void )
 {
   MATHS_TREE_ELEMENT *el;
-  el = (MATHS_TREE_ELEMENT *) g_malloc ( sizeof(MATHS_TREE_ELEMENT) );
+  el = (MATHS_TREE_ELEMENT *) maths_arena_alloc ( arena, sizeof(MATHS_TREE_ELEMENT) );
   el->data = NULL;
   el->exec = NULL;
   el->dump_xml = NULL;
   el->precalc = NULL;
-  el->free = NULL;
   return ( el );
 }
 
@@ -328,7 +198,7 @@ build_new_op_from_ref ( MATHS_OPERATOR *ref )
   if ( ref == NULL )
     return NULL;
 
-  op = ( MATHS_OPERATOR * ) g_malloc ( sizeof(MATHS_OPERATOR) );
+  op = ( MATHS_OPERATOR * ) maths_arena_alloc ( arena, sizeof(MATHS_OPERATOR) );
   memcpy ( op, ref, sizeof(MATHS_OPERATOR) );
 
   return ( op );
@@ -346,7 +216,7 @@ build_new_func_from_ref ( MATHS_FUNCTION *ref )
   if ( ref == NULL )
     return NULL;
 
-  func = ( MATHS_FUNCTION * ) g_malloc ( sizeof(MATHS_FUNCTION) );
+  func = ( MATHS_FUNCTION * ) maths_arena_alloc ( arena, sizeof(MATHS_FUNCTION) );
   memcpy ( func, ref, sizeof(MATHS_FUNCTION) );
 
   return ( func );
@@ -364,7 +234,7 @@ build_new_val_from_ref ( MATHS_VALUE *ref )
   if ( ref == NULL )
     return NULL;
 
-  val = ( MATHS_VALUE * ) g_malloc ( sizeof(MATHS_VALUE) );
+  val = ( MATHS_VALUE * ) maths_arena_alloc ( arena, sizeof(MATHS_VALUE) );
   memcpy ( val, ref, sizeof(MATHS_VALUE) );
 
   return ( val );
@@ -372,566 +242,746 @@ build_new_val_from_ref ( MATHS_VALUE *ref )
 
 
 /*
- * Builds a list of arguments (used for functions).
+ * Reads the next token of a formula.
+ * Characters which are neither operators, parentheses nor argument separators
+ * make up names and numbers. A name directly followed by '(' is a call.
  */
-static gint
-build_new_argv_list ( GPtrArray *argv, gchar *mstr, gulong len )
+static void
+next_token ( FORMULA_PARSER *p )
 {
-  MATHS_TREE_ELEMENT *mtree;
-  gchar *next_delim = NULL;
-  gchar *last_delim = mstr;
-  gint   argc = 0;
+  gchar *ptr = p->next;
 
-  if ( argv == NULL )
-    return -1;
+  p->text = ptr;
 
-  if ( len == 1 ) /* if there aren't any arg */
-    return argc;
-
-  while ( 1 )
+  if ( *ptr == '\0' )
     {
-      if ( len == 0 )
-        return argc;
+      p->token = TOKEN_END;
+      p->len = 0;
+      return;
+    }
 
-      next_delim = get_next_arg_delim ( ( last_delim+1), (len-1) );
+  if ( is_op ( *ptr ) )
+    p->token = TOKEN_OP;
+  else if ( *ptr == '(' )
+    p->token = TOKEN_OPENING_P;
+  else if ( *ptr == ')' )
+    p->token = TOKEN_CLOSING_P;
+  else if ( *ptr == ',' )
+    p->token = TOKEN_ARG_DELIM;
+  else
+    {
+      while ( ( *ptr != '\0' ) && !is_op ( *ptr ) && ( *ptr != '(' ) && ( *ptr != ')' ) && ( *ptr != ',' ) )
+        ++ptr;
 
-      if ( next_delim == NULL )
-        next_delim = last_delim + len;
+      p->len = ptr - p->text;
 
-      if ( ( mtree = mstr_eval((last_delim+1), (next_delim-(last_delim+1))) ) == NULL )
+      if ( *ptr == '(' )
         {
-#ifdef VERBOSE
-          error ( "mstr_eval", _("function\'s argument \'%s\' evaluation has failed"), last_delim+1 );
-#endif
-          return -1;
+          p->token = TOKEN_CALL;
+          p->next = ptr + 1;
+        }
+      else
+        {
+          p->token = ( is_letter ( *p->text ) ? TOKEN_NAME : TOKEN_NUMBER );
+          p->next = ptr;
         }
 
-      g_ptr_array_add ( argv, mtree );
-      ++argc;
-      len -= (next_delim-last_delim);
-      last_delim = next_delim;
+      return;
     }
 
-  return argc;
+  p->len = 1;
+  p->next = ptr + 1;
 }
 
 
 /*
- * Builds the father operation for substractions and negative numbers.
+ * Builds an operation.
  */
 static MATHS_TREE_ELEMENT *
-build_father ( MATHS_TREE_ELEMENT   *mtree,
-               gchar                *mstr,
-               gchar                *next_op,
-               gchar                *next_next_op,
-               const gulong          len )
+build_op ( const gchar         name,
+           MATHS_TREE_ELEMENT *l,
+           MATHS_TREE_ELEMENT *r )
 {
-  MATHS_TREE_ELEMENT *father_el;
-  MATHS_OPERATOR *father_op;
+  MATHS_TREE_ELEMENT *el;
+  MATHS_OPERATOR *op;
 
-  /* we finish building the mtree */
-  if ((((MATHS_OPERATOR *) mtree->data)->r = mstr_eval(next_op+1, next_next_op-next_op-1)) == NULL)
+  if ( ( op = build_new_op_from_ref(tokens_table_lookup(&name, 1)) ) == NULL )
     {
-#ifdef VERBOSE
-      error("build_father", _("right subtree creation failed"));
-#endif
+      error ( NULL, _("internal: operator \'%c\' not found"), name );
       return NULL;
     }
 
-  /* we build the daddy */
-  father_el = build_new_elem ( );
-
-  if ( is_op_non_prio(*next_next_op) )
-    {
-      if ( ( father_op = build_new_op_from_ref(g_hash_table_lookup(htab, "+")) ) == NULL )
-        {
-          error(NULL, _("internal: addition operator not found"));
-          return NULL;
-        }
-    }
-  else
-    {
-      g_strlcpy ( key, next_next_op, 1+MIN(1, MAX_KEY_LENGTH) );
-
-      if ( ( father_op = build_new_op_from_ref(g_hash_table_lookup(htab, key) ) ) == NULL )
-        {
-          if ( report_errors )
-            error ( NULL,  _("unknown operator: \'%c\'"), *next_next_op );
+  op->l = l;
+  op->r = r;
 
-          return NULL;
-        }
-    }
+  el = build_new_elem ( );
+  el->data = ( gpointer ) op;
+  el->exec = maths_op_exec;
+  el->dump_xml = maths_op_dump_xml;
+  el->precalc = maths_op_precalc;
 
-  father_el->data = ( gpointer ) father_op;
-  father_el->exec = maths_op_exec;
-  father_el->dump_xml = maths_op_dump_xml;
-  father_el->precalc = maths_op_precalc;
-  father_el->free = maths_op_free;
+  return ( el );
+}
 
-  father_op->l = mtree;
 
-  if ( *next_next_op == '-' )
+/*
+ * Reports a token found where an operand was expected.
+ */
+static void
+report_missing_operand ( FORMULA_PARSER *p )
+{
+  if ( p->token == TOKEN_OP )
     {
-      /* here, we send the '-' operator too so the number is understood as a negative one */
-      if ( ( father_op->r = mstr_eval(next_next_op, len-(next_next_op-mstr)) ) == NULL )
-        {
-#ifdef VERBOSE
-          error ( "build_father", _("father\'s right subtree creation failed") );
-#endif
-          return NULL;
-        }
+      if ( report_errors )
+        error ( NULL, _("got the operator \'%c\' without any lvalue"), *p->text );
     }
-  else if ( is_op_prio ( *next_next_op ) )
+  else if ( ( p->token == TOKEN_END ) || ( p->token == TOKEN_CLOSING_P ) || ( p->token == TOKEN_ARG_DELIM ) )
     {
-      gchar *next_next_next_prio_op = get_next_prio_op ( next_next_op+1, len-(next_next_op-mstr)-1 );
-
-      if ( next_next_next_prio_op != NULL )
-        {
-          father_el = build_father ( father_el, next_next_op+1, next_next_op, next_next_next_prio_op, len-(next_next_op-mstr)-1 );
-        }
-      else
-        {
-          if ( ( father_op->r = mstr_eval(next_next_op+1, len-(next_next_op-mstr)-1) ) == NULL )
-            {
 #ifdef VERBOSE
-              error ( "build_father", _("father\'s right subtree creation failed") );
+      error ( "parse_operand", _("missing operand") );
 #endif
-              return NULL;
-            }
-        }
     }
-  else
+  else if ( report_errors )
+    error ( NULL, _("unexpected \'%s\'"), p->text );
+}
+
+
+/*
+ * Checks the closing parenthese of a block, we allow unclosed parentheses at
+ * the end of the formula.
+ */
+static gboolean
+parse_closing_p ( FORMULA_PARSER *p )
+{
+  if ( p->token == TOKEN_CLOSING_P )
     {
-      if ( ( father_op->r = mstr_eval(next_next_op+1, len-(next_next_op-mstr)-1) ) == NULL )
-        {
-#ifdef VERBOSE
-          error ( "build_father", _("father\'s right subtree creation failed") );
-#endif
-          return NULL;
-        }
+      next_token ( p );
+      return TRUE;
     }
 
-  return ( father_el );
+  if ( p->token == TOKEN_END )
+    return TRUE;
+
+  if ( report_errors )
+    error ( NULL, _("unexpected \'%s\'"), p->text );
+
+  return FALSE;
 }
 
 
 /*
- * Evaluates a formule (recursive) and builds the math tree.
+ * Parses the arguments of a function and checks their count.
  */
-static MATHS_TREE_ELEMENT *
-mstr_eval ( gchar        *mstr,
-            const gulong  len )
+static gboolean
+parse_args ( FORMULA_PARSER *p,
+             MATHS_FUNCTION *func )
 {
-  MATHS_TREE_ELEMENT *mtree;
-  gchar *next_non_prio_op;
+  MATHS_TREE_ELEMENT *arg;
+  GPtrArray *args;
+  gint ref_argc = func->argc;
 
-#ifdef DEBUG
-  g_fprintf ( stderr, _("Analyzing \"%s\" with len=%d\n"), mstr, len );
-#endif
+  args = g_ptr_array_new ( );
 
-  if ( len == 0 )
-    return NULL;
+  if ( ( p->token != TOKEN_CLOSING_P ) && ( p->token != TOKEN_END ) )
+    while ( 1 )
+      {
+        if ( ( arg = parse_sum ( p ) ) == NULL )
+          {
+            g_ptr_array_free ( args, TRUE );
 
-  mtree = build_new_elem ( );
+            if ( report_errors )
+              error ( NULL, _("unable to build args list for function \'%s)\'"), func->name );
 
-  next_non_prio_op = get_next_non_prio_op ( mstr, len );
+            return FALSE;
+          }
 
-  /* if we don't have any non prioritary operator */
-  if ( next_non_prio_op == NULL )
-    {
-      gchar *next_prio_op = get_next_prio_op ( mstr, len );
+        g_ptr_array_add ( args, arg );
 
-      /* if we don't have any prioritary operator */
-      if ( next_prio_op == NULL )
-        {
-          /* we try to find an opening parenthese */
-          gchar *next_opening_p = get_next_opening_p ( mstr, len );
+        if ( p->token != TOKEN_ARG_DELIM )
+          break;
 
-          if ( next_opening_p == NULL )
-            {
-              /* we have a constant! */
-              MATHS_VALUE *mtree_val;
-
-              if ( is_letter ( *mstr ) )
-                {
-                  g_strlcpy ( key, mstr, 1+MIN(len, MAX_KEY_LENGTH) );
-
-                  if ( ( mtree_val = build_new_val_from_ref(g_hash_table_lookup(htab, key) ) ) == NULL )
-                    {
-                      if (report_errors)
-                        error(NULL, _("unknown constant: \'%s\'"), mstr);
-
-                      return NULL;
-                    }
-                }
-              else
-                {
-                  mtree_val = maths_val_alloc ( );
-                  mtree_val->value = (gdouble *) g_malloc ( sizeof(gdouble) );
-                  (*mtree_val->value) = atof(mstr);
-                }
-
-              mtree->data = ( gpointer ) mtree_val;
-              mtree->exec = maths_val_exec;
-              mtree->dump_xml = maths_val_dump_xml;
-              mtree->precalc = maths_val_precalc;
-              mtree->free = maths_val_free;
-            }
-          else
-            {
-              gchar *closing_p = get_next_closing_p ( next_opening_p+1, (len-(next_opening_p-mstr)) );
-
-              /* if we are not at the beginning of the math string then, it's a function */
-              if ( next_opening_p != mstr )
-                {
-                  MATHS_TREE_ELEMENT *dad_mtree;
-                  MATHS_FUNCTION *dad_mtree_func;
-                  gint ref_argc;
-
-                  dad_mtree = build_new_elem ( );
-
-                  g_strlcpy ( key, mstr, 1+MIN((1+(next_opening_p-mstr)),MAX_KEY_LENGTH) ); /* we add 1, because we want the '(' too */
-
-                  if ( ( dad_mtree_func = build_new_func_from_ref(g_hash_table_lookup(htab, key)) ) == NULL )
-                    {
-                      if ( report_errors )
-                        error ( NULL, _("unknown function: \'%s)\'"), key );
-
-                      return NULL;
-                    }
-
-                  ref_argc = dad_mtree_func->argc;
-
-                  /* args parsing */
-                  dad_mtree_func->argv = g_ptr_array_new ( );
-
-                  if ( ( dad_mtree_func->argc = build_new_argv_list(dad_mtree_func->argv,next_opening_p,(closing_p-next_opening_p))) == -1 )
-                    {
-                      if ( report_errors )
-                        error ( NULL, _("unable to build args list for function \'%s)\'"), dad_mtree_func->name );
-
-                      return NULL;
-                    }
-
-                  /* we check argc */
-                  if ( ref_argc == MATHS_FUNC_NO_ARG )
-                    {
-                      if ( dad_mtree_func->argc != 0 )
-                        {
-                          if ( report_errors )
-                            error ( NULL, _("function \'%s)\' should not have any argument"), dad_mtree_func->name );
-
-                          return NULL;
-                        }
-                    }
-                  else if ( ref_argc == MATHS_FUNC_ONE_ARG )
-                    {
-                      if ( dad_mtree_func->argc != 1 )
-                        {
-                          if ( report_errors )
-                            error ( NULL, _("function \'%s)\' should have only one argument"), dad_mtree_func->name );
-
-                          return NULL;
-                        }
-                    }
-                  else if ( ref_argc == MATHS_FUNC_TWO_ARG )
-                    {
-                      if ( dad_mtree_func->argc != 2 )
-                        {
-                          if ( report_errors )
-                            error ( NULL, _("function \'%s)\' should have only two arguments"), dad_mtree_func->name );
-
-                          return NULL;
-                        }
-                    }
-                  else if ( ref_argc == MATHS_FUNC_N_ARG )
-                    {
-                      if ( dad_mtree_func->argc == 0 )
-                        {
-                          if ( report_errors )
-                            error ( NULL, _("function \'%s)\' should have at least one argument"), dad_mtree_func->name );
-
-                          return NULL;
-                        }
-                    }
-
-                  dad_mtree->data = ( gpointer ) dad_mtree_func;
-                  dad_mtree->exec = maths_func_exec;
-                  dad_mtree->dump_xml = maths_func_dump_xml;
-                  dad_mtree->precalc = maths_func_precalc;
-                  dad_mtree->free = maths_func_free;
-
-                  mtree = dad_mtree;
-                }
-              else /* it's not a function, we evaluate the block */
-                {
-                  if ( ( mtree = mstr_eval(next_opening_p+1, ((closing_p-next_opening_p)-1)) ) == NULL )
-                    {
-#ifdef VERBOSE
-                      error ( "mstr_eval", _("inside parentheses evaluation has failed") );
-#endif
-                      return NULL;
-                    }
-                }
-            }
-        }
-      else if ( next_prio_op == mstr )
-        {
-          /* if the operator is at the beginning of the math string */
-          if ( report_errors )
-            error ( NULL, _("got the operator \'%c\' without any lvalue"), *next_prio_op );
+        next_token ( p );
+      }
 
-          return NULL;
-        }
-      else
-        {
-          MATHS_OPERATOR *mtree_op;
-          
-          /* if we do have a prioritary operator */
-          gchar *next_next_prio_op = get_next_prio_op ( next_prio_op+1, len-(next_prio_op-mstr) );
-          g_strlcpy ( key, next_prio_op, 1+MIN(1, MAX_KEY_LENGTH) );
+  func->argc = args->len;
+  func->argv = (MATHS_TREE_ELEMENT **) maths_arena_alloc ( arena, args->len * sizeof(MATHS_TREE_ELEMENT *) );
 
-          if ( ( mtree_op = build_new_op_from_ref(g_hash_table_lookup(htab, key)) ) == NULL )
-            {
-              if ( report_errors )
-                error ( NULL, _("unknown operator: \'%c\'"), *next_prio_op );
+  if ( args->len > 0 )
+    memcpy ( func->argv, args->pdata, args->len * sizeof(MATHS_TREE_ELEMENT *) );
 
-              return NULL;
-            }
+  g_ptr_array_free ( args, TRUE );
 
-          mtree->data = ( gpointer ) mtree_op;
-          mtree->exec = maths_op_exec;
-          mtree->dump_xml = maths_op_dump_xml;
-          mtree->precalc = maths_op_precalc;
-          mtree->free = maths_op_free;
+  if ( !parse_closing_p ( p ) )
+    return FALSE;
 
-          if ( ( mtree_op->l = mstr_eval(mstr, (next_prio_op-mstr)) ) == NULL )
-            {
-#ifdef VERBOSE
-              error ( "mstr_eval", _("left subtree creation failed") );
-#endif
-              return NULL;
-            }
+  /* we check argc */
+  if ( ( ref_argc == MATHS_FUNC_NO_ARG ) && ( func->argc != 0 ) )
+    {
+      if ( report_errors )
+        error ( NULL, _("function \'%s)\' should not have any argument"), func->name );
 
-          if ( next_next_prio_op == NULL )
-            {
-              if ( ( mtree_op->r = mstr_eval(next_prio_op+1, (len-1-(next_prio_op-mstr))) ) == NULL )
-                {
-#ifdef VERBOSE
-                  error ( "mstr_eval", _("right subtree creation failed") );
-#endif
-                  return NULL;
-                }
-            }
-          else
-            {
-              mtree = build_father ( mtree, mstr, next_prio_op, next_next_prio_op, len );
-            }
-        }
+      return FALSE;
     }
-  else if ( (next_non_prio_op == mstr) && (*next_non_prio_op != '-') )
+  else if ( ( ref_argc == MATHS_FUNC_ONE_ARG ) && ( func->argc != 1 ) )
     {
-      /* if the operator is at the beginning of the math string and isn't a '-' */
       if ( report_errors )
-        error ( NULL, _("got the operator \'%c\' without any lvalue"), *next_non_prio_op );
+        error ( NULL, _("function \'%s)\' should have only one argument"), func->name );
 
-      return NULL;
+      return FALSE;
     }
-  else
+  else if ( ( ref_argc == MATHS_FUNC_TWO_ARG ) && ( func->argc != 2 ) )
+    {
+      if ( report_errors )
+        error ( NULL, _("function \'%s)\' should have only two arguments"), func->name );
+
+      return FALSE;
+    }
+  else if ( ( ref_argc == MATHS_FUNC_N_ARG ) && ( func->argc == 0 ) )
     {
-      MATHS_OPERATOR *mtree_op;
+      if ( report_errors )
+        error ( NULL, _("function \'%s)\' should have at least one argument"), func->name );
+
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * Parses a constant, a variable, a function call or a block.
+ */
+static MATHS_TREE_ELEMENT *
+parse_operand ( FORMULA_PARSER *p )
+{
+  MATHS_TREE_ELEMENT *el;
+  MATHS_FUNCTION *func;
+  MATHS_VALUE *val;
+  gchar *name;
 
-      /* if we do have a non-prioritary operator */
-      g_strlcpy ( key, next_non_prio_op, 1+MIN(1, MAX_KEY_LENGTH) );
+  switch ( p->token )
+    {
+    case TOKEN_NUMBER:
+      el = maths_val_new_constant ( arena, atof ( p->text ) );
+      next_token ( p );
+      return el;
 
-      if ( ( mtree_op = build_new_op_from_ref(g_hash_table_lookup(htab, key)) ) == NULL )
+    case TOKEN_NAME:
+      if ( ( val = build_new_val_from_ref(tokens_table_lookup(p->text, p->len)) ) == NULL )
         {
           if ( report_errors )
-            error ( NULL, _("unknown operator: \'%c\'.\n"), *next_non_prio_op );
+            {
+              name = g_strndup ( p->text, p->len );
+              error ( NULL, _("unknown constant: \'%s\'"), name );
+              g_free ( name );
+            }
 
           return NULL;
         }
 
-      mtree->data = ( gpointer ) mtree_op;
-      mtree->exec = maths_op_exec;
-      mtree->dump_xml = maths_op_dump_xml;
-      mtree->precalc = maths_op_precalc;
-      mtree->free = maths_op_free;
+      el = build_new_elem ( );
+      el->data = ( gpointer ) val;
+      el->exec = maths_val_exec;
+      el->dump_xml = maths_val_dump_xml;
+      el->precalc = maths_val_precalc;
+      next_token ( p );
+      return el;
 
-      if ( next_non_prio_op != mstr ) /* if we don't have something like a "-x" */
+    case TOKEN_CALL:
+      if ( ( func = build_new_func_from_ref(tokens_table_lookup(p->text, p->len+1)) ) == NULL )
         {
-          if ( ( mtree_op->l = mstr_eval(mstr, (next_non_prio_op-mstr)) ) == NULL )
+          if ( report_errors )
             {
-#ifdef VERBOSE
-              error ( "mstr_eval", _("left subtree creation failed") );
-#endif
-              return NULL;
+              name = g_strndup ( p->text, p->len+1 );
+              error ( NULL, _("unknown function: \'%s)\'"), name );
+              g_free ( name );
             }
+
+          return NULL;
         }
-      else
-        {
-          MATHS_TREE_ELEMENT *elem;
-          MATHS_VALUE *mtree_val;
-          elem = build_new_elem ( );
-
-          
-          mtree_val = maths_val_alloc ( );
-          mtree_val->value = (gdouble *) g_malloc ( sizeof(gdouble) );
-          (*mtree_val->value) = 0.0;
-
-          elem->data = ( gpointer ) mtree_val;
-          elem->exec = maths_val_exec;
-          elem->dump_xml = maths_val_dump_xml;
-          elem->precalc = maths_val_precalc;
-          elem->free = maths_val_free;
-
-          mtree_op->l = elem;
-        }
 
-      if ( *next_non_prio_op == '+' )
+      next_token ( p );
+
+      if ( !parse_args ( p, func ) )
+        return NULL;
+
+      el = build_new_elem ( );
+      el->data = ( gpointer ) func;
+      el->exec = maths_func_exec;
+      el->dump_xml = maths_func_dump_xml;
+      el->precalc = maths_func_precalc;
+      return el;
+
+    case TOKEN_OPENING_P:
+      next_token ( p );
+
+      if ( ( el = parse_sum ( p ) ) == NULL )
         {
-          if ( ( mtree_op->r = mstr_eval(next_non_prio_op+1, len-(next_non_prio_op-mstr)-1) ) == NULL )
-            {
 #ifdef VERBOSE
-              error ( "mstr_eval", _("right subtree creation failed") );
+          error ( "parse_operand", _("inside parentheses evaluation has failed") );
 #endif
-              return NULL;
-            }
+          return NULL;
         }
-      else
-        {
-          /* we must use get_next_next_non_prio_op here, because we support --x syntax */
-          gchar *next_next_non_prio_op = get_next_next_non_prio_op ( next_non_prio_op, len-(next_non_prio_op-mstr) );
 
-          if ( next_next_non_prio_op == NULL ) /* if we don't have any non-prio operator, it's easy */
-            {
-              if ( ( mtree_op->r = mstr_eval(next_non_prio_op+1, len-(next_non_prio_op-mstr)-1) ) == NULL )
-                {
-#ifdef VERBOSE
-                  error ( "mstr_eval", _("right subtree creation failed") );
-#endif
-                  return NULL;
-                }
-            }
-          else
-            {
-              mtree = build_father ( mtree, mstr, next_non_prio_op, next_next_non_prio_op, len );
-            }
-        }
+      if ( !parse_closing_p ( p ) )
+        return NULL;
+
+      return el;
     }
 
-  return ( mtree );
+  report_missing_operand ( p );
+  return NULL;
 }
 
 
 /*
- * Frees the memory previously allocated to a formula.
+ * Parses an operand of a prioritary operator, which may be negated.
  */
-static void
-formula_free_mem ( FORMULA *f )
+static MATHS_TREE_ELEMENT *
+parse_factor ( FORMULA_PARSER *p )
 {
-  if ( f == NULL )
-    return;
+  MATHS_TREE_ELEMENT *r;
 
-  if ( running_formulas == 0 )
-  {
-    if ( htab != NULL )
-      {
-        tokens_table_destroy ( htab );
-        htab = NULL;
-      }
+  if ( ( p->token == TOKEN_OP ) && ( *p->text == '-' ) )
+    {
+      next_token ( p );
 
-    if ( key != NULL )
-      {
-        g_free ( key );
-        key = NULL;
-      }
-  }
+      if ( ( r = parse_factor ( p ) ) == NULL )
+        return NULL;
 
-  if ( f->str != NULL )
-    g_free ( f->str );
+      return build_op ( '-', maths_val_new_constant ( arena, 0.0 ), r );
+    }
+
+  return parse_operand ( p );
+}
+
+
+/*
+ * Parses a chain of prioritary operators, they are all evaluated from left
+ * to right.
+ */
+static MATHS_TREE_ELEMENT *
+parse_term ( FORMULA_PARSER *p )
+{
+  MATHS_TREE_ELEMENT *l, *r;
+  gchar name;
 
-  if ( f->head != NULL )
+  if ( ( l = parse_operand ( p ) ) == NULL )
+    return NULL;
+
+  while ( ( p->token == TOKEN_OP ) && is_op_prio ( *p->text ) )
     {
-      f->head->free ( f->head->data );
-      g_free ( f->head );
+      name = *p->text;
+      next_token ( p );
+
+      if ( ( r = parse_factor ( p ) ) == NULL )
+        {
+#ifdef VERBOSE
+          error ( "parse_term", _("right subtree creation failed") );
+#endif
+          return NULL;
+        }
+
+      if ( ( l = build_op ( name, l, r ) ) == NULL )
+        return NULL;
     }
 
-  g_free ( f );
+  return l;
 }
 
 
 /*
- * Creates a tree according to the expression.
+ * Parses the right operand of a substraction, which may be negated.
  */
-FORMULA *
-formula_new ( gchar    *str,
-              gboolean  want_report )
+static MATHS_TREE_ELEMENT *
+parse_negated_term ( FORMULA_PARSER *p )
 {
-  FORMULA *f;
-  report_errors = want_report;
+  MATHS_TREE_ELEMENT *r;
 
-  /* we allocate memory for the formula structure */
-  f = (FORMULA *) g_malloc ( sizeof(FORMULA) );
-  f->str = NULL;
-  f->head = NULL;
-
-  /* we create what we need if we have to */
-  if ( running_formulas == 0 )
+  if ( ( p->token == TOKEN_OP ) && ( *p->text == '-' ) )
     {
-      htab = tokens_table_build ( );
-      key = (gchar *) g_malloc(sizeof(gchar) * (MAX_KEY_LENGTH+1));
+      next_token ( p );
+
+      if ( ( r = parse_negated_term ( p ) ) == NULL )
+        return NULL;
+
+      return build_op ( '-', maths_val_new_constant ( arena, 0.0 ), r );
     }
 
-  /* we check everything's all right */
-  if ( htab == NULL )
+  return parse_term ( p );
+}
+
+
+/*
+ * Parses a chain of non-prioritary operators.
+ * The trees are those of the original recursive evaluation, so that the sums
+ * are computed in the same order:
+ *  - a + b + c gives a + (b + c)
+ *  - a - b - c gives (a - b) + (0 - c), a - b + c gives (a - b) + c
+ *  - a leading '-' substracts from 0
+ * The chain is built iteratively, 'hole' is where its tail goes.
+ */
+static MATHS_TREE_ELEMENT *
+parse_sum ( FORMULA_PARSER *p )
+{
+  MATHS_TREE_ELEMENT *head = NULL;
+  MATHS_TREE_ELEMENT **hole = &head;
+  MATHS_TREE_ELEMENT *l, *r;
+
+  while ( 1 )
     {
+      if ( ( p->token == TOKEN_OP ) && ( *p->text == '-' ) )
+        l = maths_val_new_constant ( arena, 0.0 );
+      else if ( ( l = parse_term ( p ) ) == NULL )
+        return NULL;
+
+      if ( ( p->token != TOKEN_OP ) || !is_op_non_prio ( *p->text ) )
+        {
+          *hole = l;
+          return head;
+        }
+
+      if ( *p->text == '-' )
+        {
+          next_token ( p );
+
+          if ( ( r = parse_negated_term ( p ) ) == NULL )
+            {
 #ifdef VERBOSE
-      error("formula_new", _("the expression table is invalid"));
+              error ( "parse_sum", _("right subtree creation failed") );
 #endif
-      formula_free_mem ( f );
+              return NULL;
+            }
+
+          if ( ( l = build_op ( '-', l, r ) ) == NULL )
+            return NULL;
+
+          if ( ( p->token != TOKEN_OP ) || !is_op_non_prio ( *p->text ) )
+            {
+              *hole = l;
+              return head;
+            }
+        }
+
+      /* a following '-' is left for the next term, which substracts from 0 */
+      if ( *p->text == '+' )
+        next_token ( p );
+
+      if ( ( l = build_op ( '+', l, NULL ) ) == NULL )
+        return NULL;
+
+      *hole = l;
+      hole = &((MATHS_OPERATOR *) l->data)->r;
+    }
+}
+
+
+/*
+ * Parses a whole formula and builds the math tree.
+ */
+static MATHS_TREE_ELEMENT *
+mstr_parse ( gchar *mstr )
+{
+  MATHS_TREE_ELEMENT *head;
+  FORMULA_PARSER p;
+
+  p.next = mstr;
+  next_token ( &p );
+
+  if ( ( head = parse_sum ( &p ) ) == NULL )
+    return NULL;
+
+  if ( p.token != TOKEN_END )
+    {
+      if ( report_errors )
+        error ( NULL, _("unexpected \'%s\'"), p.text );
+
       return NULL;
     }
 
-  if ( key == NULL )
+  return head;
+}
+
+
+/*
+ * Lowers the tree of a formula into a register program.
+ */
+static void
+formula_lower ( FORMULA *f )
+{
+  if ( f->prog != NULL )
+    {
+      maths_prog_free ( f->prog );
+      f->prog = NULL;
+    }
+
+  if ( f->native != NULL )
+    {
+      maths_cgen_free ( f->native );
+      f->native = NULL;
+    }
+
+  if ( f->backend == FORMULA_BACKEND_TREE )
+    return;
+
+  /* if lowering fails, we silently keep on walking the tree */
+  f->prog = maths_prog_compile ( f->head );
+
+  if ( f->prog == NULL )
+    return;
+
+  /* the kernel is built by the C compiler, if there is one */
+  if ( f->backend == FORMULA_BACKEND_NATIVE )
+    f->native = maths_cgen_compile ( f->head );
+
+  /* otherwise the program is jitted, and without native code, interpreted */
+  if ( ( f->backend != FORMULA_BACKEND_BYTECODE ) && ( f->native == NULL ) )
+    f->prog->jit = maths_jit_compile ( f->prog );
+}
+
+
+/*
+ * Frees the memory previously allocated to a formula.
+ */
+static void
+formula_free_mem ( FORMULA *f )
+{
+  if ( f == NULL )
+    return;
+
+  if ( f->str != NULL )
+    g_free ( f->str );
+
+  if ( f->prog != NULL )
+    maths_prog_free ( f->prog );
+
+  if ( f->native != NULL )
+    maths_cgen_free ( f->native );
+
+  /* the whole tree lives in the arena */
+  if ( f->arena != NULL )
+    maths_arena_free ( f->arena );
+
+  g_free ( f );
+}
+
+
+/*
+ * Builds the tree of a cleaned expression, which the formula keeps.
+ */
+static FORMULA *
+formula_parse ( gchar *str )
+{
+  FORMULA *f;
+
+  /* we allocate memory for the formula structure */
+  f = (FORMULA *) g_malloc ( sizeof(FORMULA) );
+  f->str = str;
+  f->head = NULL;
+  f->backend = FORMULA_BACKEND_JIT;
+  f->prog = NULL;
+  f->native = NULL;
+  f->refs = 1;
+  f->arena = maths_arena_new ( );
+  arena = f->arena;
+
+  if ( ( f->head = mstr_parse ( f->str ) ) == NULL )
     {
 #ifdef VERBOSE
-      error("formula_new", _("the key storage is invalid"));
+      error("formula_new", _("unable to build the tree"));
 #endif
-      formula_free_mem(f);
+      formula_free_mem ( f );
       return NULL;
     }
 
+  return ( f );
+}
+
+
+/*
+ * Creates a tree according to the expression.
+ */
+FORMULA *
+formula_new ( gchar    *str,
+              gboolean  want_report )
+{
+  FORMULA *f;
+  gchar *clean;
+
   /* we prepare the formula */
-  if ( ( f->str = mstr_clean(str, (1+strlen(str))) ) == NULL )
+  if ( ( clean = mstr_clean(str, (1+strlen(str))) ) == NULL )
     {
 #ifdef VERBOSE
       error("formula_new", _("unable to clean the formula"));
 #endif
-      formula_free_mem ( f );
       return NULL;
     }
 
-  if ( ( f->head = mstr_eval(((FORMULA *) f)->str, strlen(((FORMULA *) f)->str)) ) == NULL )
+  g_mutex_lock ( &lock );
+  report_errors = want_report;
+  f = formula_parse ( clean );
+  g_mutex_unlock ( &lock );
+
+  if ( f == NULL )
+    return NULL;
+
+  formula_lower ( f );
+
+  return ( f );
+}
+
+
+/*
+ * Looks a cleaned expression up in the cache, the formula found becomes the
+ * most recently used one and gets a new reference. The lock is held.
+ */
+static FORMULA *
+cache_find ( const gchar *clean,
+             const gint   backend )
+{
+  FORMULA *f;
+  GList *link;
+
+  for ( link=cache; link!=NULL; link=link->next )
+    {
+      f = (FORMULA *) link->data;
+
+      if ( ( f->backend == backend ) && ( strcmp ( f->str, clean ) == 0 ) )
+        {
+          cache = g_list_delete_link ( cache, link );
+          cache = g_list_prepend ( cache, f );
+          g_atomic_int_inc ( &f->refs );
+          return ( f );
+        }
+    }
+
+  return NULL;
+}
+
+
+/*
+ * Returns the precalculated formula of an expression for a backend, from the
+ * cache if it was compiled recently. The formula is shared, it must not be
+ * modified and is released with formula_destroy().
+ */
+FORMULA *
+formula_get ( gchar      *str,
+              const gint  backend,
+              gboolean    want_report )
+{
+  FORMULA *f, *other;
+  GList *link;
+  gchar *clean;
+
+  if ( ( clean = mstr_clean(str, (1+strlen(str))) ) == NULL )
     {
 #ifdef VERBOSE
-      error("formula_new", _("unable to build the tree"));
+      error("formula_get", _("unable to clean the formula"));
 #endif
-      formula_free_mem ( f );
       return NULL;
     }
 
-  ++running_formulas;
+  g_mutex_lock ( &lock );
+
+  /* presentation chars do not change the formula */
+  if ( ( f = cache_find ( clean, backend ) ) != NULL )
+    {
+      g_mutex_unlock ( &lock );
+      g_free ( clean );
+      return ( f );
+    }
+
+  report_errors = want_report;
+  f = formula_parse ( clean );
+  g_mutex_unlock ( &lock );
+
+  if ( f == NULL )
+    return NULL;
+
+  /* the compilation may take a while, the other threads go on meanwhile */
+  f->backend = backend;
+  formula_precalc ( f );
+
+  g_mutex_lock ( &lock );
+
+  /* another thread may have compiled the same formula */
+  if ( ( other = cache_find ( f->str, backend ) ) != NULL )
+    {
+      g_mutex_unlock ( &lock );
+      formula_destroy ( f );
+      return ( other );
+    }
+
+  /* the cache keeps a reference, the least recently used one is dropped */
+  cache = g_list_prepend ( cache, f );
+  g_atomic_int_inc ( &f->refs );
+
+  if ( ++cache_len > FORMULA_CACHE_SIZE )
+    {
+      link = g_list_last ( cache );
+      formula_destroy ( (FORMULA *) link->data );
+      cache = g_list_delete_link ( cache, link );
+      --cache_len;
+    }
+
+  g_mutex_unlock ( &lock );
   return ( f );
 }
 
 
+/*
+ * Returns the formula of an expression for a backend if formula_get() has
+ * it in its cache, NULL otherwise. Nothing is compiled.
+ */
+FORMULA *
+formula_lookup ( gchar      *str,
+                 const gint  backend )
+{
+  FORMULA *f;
+  gchar *clean;
+
+  if ( ( clean = mstr_clean(str, (1+strlen(str))) ) == NULL )
+    return NULL;
+
+  g_mutex_lock ( &lock );
+  f = cache_find ( clean, backend );
+  g_mutex_unlock ( &lock );
+
+  g_free ( clean );
+  return ( f );
+}
+
+
+/*
+ * Drops the formulas kept by formula_get().
+ */
+void
+formula_cache_clear ( void )
+{
+  GList *link;
+
+  g_mutex_lock ( &lock );
+
+  for ( link=cache; link!=NULL; link=link->next )
+    formula_destroy ( (FORMULA *) link->data );
+
+  g_list_free ( cache );
+  cache = NULL;
+  cache_len = 0;
+
+  g_mutex_unlock ( &lock );
+}
+
+
 /*
  * Executes a formula tree.
  */
 gdouble
 formula_execute ( FORMULA *f )
 {
+  gdouble small[64];
+  gdouble *regs, v;
+
   if ( f == NULL )
     return 0.0;
 
@@ -941,10 +991,215 @@ formula_execute ( FORMULA *f )
   if ( f->head->data == NULL )
     return 0.0;
 
+  /* each call has its own registers, several threads may execute f */
+  if ( f->prog != NULL )
+    {
+      regs = ( f->prog->nregs <= G_N_ELEMENTS ( small ) ) ? small : g_new ( gdouble, f->prog->nregs );
+      v = maths_prog_exec ( f->prog, regs );
+
+      if ( regs != small )
+        g_free ( regs );
+
+      return v;
+    }
+
   return f->head->exec ( f->head->data );
 }
 
 
+/*
+ * Executes a formula over a row of pixels.
+ */
+void
+formula_execute_row ( FORMULA   *f,
+                      MATHS_ROW *row,
+                      gdouble   *out )
+{
+  gint i;
+
+  if ( ( f == NULL ) || ( f->head == NULL ) || ( f->head->data == NULL ) )
+    {
+      memset ( out, 0, row->n * sizeof(gdouble) );
+      return;
+    }
+
+  if ( f->native != NULL )
+    {
+      maths_cgen_exec_row ( f->native, row, out );
+      return;
+    }
+
+  if ( f->prog != NULL )
+    {
+      maths_prog_exec_row ( f->prog, row, out );
+      return;
+    }
+
+  /* the tree walks one pixel at a time */
+  values_set_y ( row->y );
+
+  for ( i=0; i<row->n; ++i )
+    {
+      values_set_x ( row->x[i] );
+      values_set_r ( row->r[i] );
+      values_set_t ( row->t[i] );
+      out[i] = f->head->exec ( f->head->data );
+    }
+}
+
+
+/*
+ * Tells whether a formula can be executed by several threads at once: the
+ * tree reads the coordinates from global values, the program from the row.
+ */
+gboolean
+formula_is_reentrant ( FORMULA *f )
+{
+  if ( ( f == NULL ) || ( f->head == NULL ) || ( f->head->data == NULL ) )
+    return TRUE;
+
+  return ( f->prog != NULL );
+}
+
+
+/*
+ * Tells how a formula uses the source image and the polar coordinates,
+ * formulas without a program are assumed to use everything.
+ */
+gint
+formula_get_usage ( FORMULA *f )
+{
+  if ( ( f == NULL ) || ( f->head == NULL ) || ( f->head->data == NULL ) )
+    return 0;
+
+  if ( f->prog != NULL )
+    return f->prog->flags;
+
+  return ( MATHS_PROG_USES_SOURCE | MATHS_PROG_SAMPLES_AROUND
+           | MATHS_PROG_USES_R | MATHS_PROG_USES_T );
+}
+
+
+/*
+ * Lowers several formulas into a single program with one result per formula,
+ * so that what they have in common is computed once per pixel.
+ * Returns NULL unless every formula runs a program of its own, and none
+ * depends on the channel it renders.
+ */
+MATHS_PROGRAM *
+formula_fuse ( FORMULA    **fs,
+               const gint   n )
+{
+  MATHS_TREE_ELEMENT **heads;
+  MATHS_PROGRAM *prog;
+  gboolean jit = TRUE;
+  gint i;
+
+  for ( i=0; i<n; ++i )
+    {
+      if ( ( fs[i] == NULL ) || ( fs[i]->head == NULL ) || ( fs[i]->head->data == NULL )
+           || ( fs[i]->prog == NULL ) || ( fs[i]->native != NULL )
+           || ( fs[i]->prog->flags & MATHS_PROG_USES_CHAN ) )
+        return NULL;
+
+      jit = jit && ( fs[i]->backend == FORMULA_BACKEND_JIT );
+    }
+
+  heads = g_new ( MATHS_TREE_ELEMENT *, n );
+  for ( i=0; i<n; ++i )
+    heads[i] = fs[i]->head;
+
+  prog = maths_prog_compile_multi ( heads, n );
+  g_free ( heads );
+
+  if ( prog == NULL )
+    return NULL;
+
+  if ( jit )
+    prog->jit = maths_jit_compile ( prog );
+
+  return prog;
+}
+
+
+/*
+ * Walks a tree looking for what its value depends on (recursive).
+ * Returns FALSE as soon as something else than the pixel at (x,y) is read,
+ * the pixel functions reading that pixel are flagged in 'funcs'.
+ */
+static gboolean
+get_pointwise_funcs ( MATHS_TREE_ELEMENT *el,
+                      gint               *funcs )
+{
+  MATHS_VALUE *val;
+  MATHS_OPERATOR *op;
+  MATHS_FUNCTION *func;
+  gint i;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return FALSE;
+
+  if ( el->exec == maths_val_exec )
+    {
+      val = (MATHS_VALUE *) el->data;
+
+      /* w and h do not change during a rendering */
+      if ( val->precalc_code != PRECALC_NOT )
+        return TRUE;
+
+      return ( ( val->id == MATHS_VAL_ID_W ) || ( val->id == MATHS_VAL_ID_H ) );
+    }
+  else if ( el->exec == maths_op_exec )
+    {
+      op = (MATHS_OPERATOR *) el->data;
+
+      return ( get_pointwise_funcs ( op->l, funcs ) && get_pointwise_funcs ( op->r, funcs ) );
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      func = (MATHS_FUNCTION *) el->data;
+
+      if ( func->id == MATHS_FUNC_ID_RAND )
+        return FALSE;
+
+      if ( ( func->id >= 0 ) && ( func->id <= MATHS_FUNC_ID_RGB ) )
+        {
+          if ( !maths_func_reads_pixel ( func ) )
+            return FALSE;
+
+          *funcs |= 1 << func->id;
+          return TRUE;
+        }
+
+      for ( i=0; i<func->argc; ++i )
+        if ( !get_pointwise_funcs ( func->argv[i], funcs ) )
+          return FALSE;
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+
+/*
+ * Tells whether the value of a formula only depends on the pixel being
+ * rendered, 'funcs' receives the pixel functions it calls (1 << MATHS_FUNC_ID_*).
+ * Only formulas with a program are considered.
+ */
+gboolean
+formula_is_pointwise ( FORMULA *f,
+                       gint    *funcs )
+{
+  *funcs = 0;
+
+  if ( ( f == NULL ) || ( f->head == NULL ) || ( f->head->data == NULL ) || ( f->prog == NULL ) )
+    return FALSE;
+
+  return get_pointwise_funcs ( f->head, funcs );
+}
+
+
 /*
  * Dumps an XML description of a formula tree.
  */
@@ -972,8 +1227,6 @@ void
 formula_precalc ( FORMULA *f )
 {
   gint precalc_code;
-  MATHS_VALUE *val;
-  MATHS_TREE_ELEMENT *el;
 
   if ( f == NULL )
     return;
@@ -981,29 +1234,47 @@ formula_precalc ( FORMULA *f )
   if ( f->head == NULL )
     return;
 
-  precalc_code = f->head->precalc ( f->head->data );
+  /* constants spread over sums and products are gathered first */
+  f->head = maths_simplify ( f->head, f->arena );
+
+  precalc_code = f->head->precalc ( f->head->data, f->arena );
 
   if ( precalc_code == PRECALC_OK )
-    {
-      val = maths_val_alloc ( );
-      val->value = (gdouble *) g_malloc ( sizeof(gdouble) );
-      (*val->value) = f->head->exec ( f->head->data );
+    f->head = maths_val_new_constant ( f->arena, f->head->exec ( f->head->data ) );
 
-      el = (MATHS_TREE_ELEMENT *) g_malloc ( sizeof(MATHS_TREE_ELEMENT) );
-      el->data = ( gpointer ) val;
-      el->exec = maths_val_exec;
-      el->dump_xml = maths_val_dump_xml;
-      el->precalc = maths_val_precalc;
-      el->free = maths_val_free;
-      f->head->free ( f->head->data );
-      g_free ( f->head );
-      f->head = el;
-    }
+  /* the tree has changed, so does the program */
+  formula_lower ( f );
 }
 
 
 /*
- * Destroys a formula.
+ * Selects the backend used to execute a formula.
+ */
+void
+formula_set_backend ( FORMULA *f,
+                      gint     backend )
+{
+  if ( f == NULL )
+    return;
+
+  f->backend = backend;
+  formula_lower ( f );
+}
+
+
+/*
+ * Gets a new reference to a formula.
+ */
+FORMULA *
+formula_ref ( FORMULA *f )
+{
+  g_atomic_int_inc ( &f->refs );
+  return ( f );
+}
+
+
+/*
+ * Destroys a formula, once it is no longer used.
  */
 void
 formula_destroy ( FORMULA *f )
@@ -1011,7 +1282,10 @@ formula_destroy ( FORMULA *f )
   if (f == NULL)
     return;
 
-  --running_formulas;
+  /* the preview thread may hold the last reference */
+  if ( !g_atomic_int_dec_and_test ( &f->refs ) )
+    return;
+
   formula_free_mem ( f );
   return;
 }
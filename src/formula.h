@@ -28,28 +28,84 @@
 #include "maths_tree.h"
 #endif
 
+#ifndef __MATHS_PROG_H__
+#include "maths_prog.h"
+#endif
+
+#ifndef __MATHS_CGEN_H__
+#include "maths_cgen.h"
+#endif
+
+
+/* Execution backends
+   FORMULA_BACKEND_TREE:     recursive walk of the maths tree
+   FORMULA_BACKEND_BYTECODE: flat register program
+   FORMULA_BACKEND_JIT:      register program whose per-pixel instructions
+                             run as native code where supported (default)
+   FORMULA_BACKEND_NATIVE:   C kernel built by the system compiler, the
+                             register program is kept for the analyses and
+                             jitted when no kernel could be built */
+enum { FORMULA_BACKEND_TREE, FORMULA_BACKEND_BYTECODE, FORMULA_BACKEND_JIT, FORMULA_BACKEND_NATIVE };
+
 
 /* Formula Structure */
 typedef struct formula_t
 {
   MATHS_TREE_ELEMENT  *head;
   gchar               *str;
+  gint                 backend;
+  MATHS_PROGRAM       *prog;
+  MATHS_CGEN          *native;
+  MATHS_ARENA         *arena;     /* memory of the tree, freed at once */
+  gint                 refs;      /* users of the formula, the cache is one */
 } FORMULA ;
 
 
 /* Creates a new formula based on the provided string */
 FORMULA *formula_new ( gchar    *str, gboolean  want_report );
 
+/* Returns the shared precalculated formula of a string for a backend, the most
+   recently used ones are kept so that they are not compiled again */
+FORMULA *formula_get ( gchar *str, const gint backend, gboolean want_report );
+
+/* Returns the formula formula_get() would, if it is already compiled. NULL otherwise */
+FORMULA *formula_lookup ( gchar *str, const gint backend );
+
+/* Drops the formulas kept by formula_get() */
+void formula_cache_clear ( void );
+
 /* Evaluates a formula after it has been created with formula_new() */
 gdouble formula_execute ( FORMULA *f );
 
+/* Evaluates a formula for every pixel of a row */
+void formula_execute_row ( FORMULA *f, MATHS_ROW *row, gdouble *out );
+
+/* Lowers several formulas into one program computing all of them */
+MATHS_PROGRAM *formula_fuse ( FORMULA **fs, const gint n );
+
+/* Tells whether several threads may evaluate a formula at once */
+gboolean formula_is_reentrant ( FORMULA *f );
+
+/* Returns the MATHS_PROG_* usage flags of a formula */
+gint formula_get_usage ( FORMULA *f );
+
+/* Tells whether a formula only reads the pixel being rendered, and which pixel functions it calls */
+gboolean formula_is_pointwise ( FORMULA *f, gint *funcs );
+
 /* Dumps the xml description of the formula into an xml file */
 void formula_dump_xml_tree (  FORMULA *f, FILE *output );
 
 /* Pprecalculates/Optimizes a formula */
 void formula_precalc ( FORMULA *f );
 
-/* Destroys a formula */
+/* Selects the backend used by formula_execute(), for a formula created with
+   formula_new(): those of formula_get() are shared */
+void formula_set_backend ( FORMULA *f, gint backend );
+
+/* Gets a new reference to a formula, released with formula_destroy() */
+FORMULA *formula_ref ( FORMULA *f );
+
+/* Destroys a formula, shared ones once they are no longer used */
 void formula_destroy ( FORMULA *f );
 
 
@@ -35,6 +35,9 @@
 #define PREVIEW_WIDTH  128
 #define PREVIEW_HEIGHT 128
 
+/* Time without typing before the preview is rendered (ms) */
+#define PREVIEW_DELAY  150
+
 
 static gboolean   auto_update_preview = FALSE;
 static GtkWidget *text_red_chan;
@@ -43,13 +46,57 @@ static GtkWidget *text_green_chan;
 static GtkWidget *text_blue_chan;
 static GtkWidget *text_alpha_chan;
 static GtkWidget *preview;
+static GtkWidget *zoom_in_button;
+static GtkWidget *zoom_out_button;
 static GdkPixbuf *preview_pixbuf;
-static GdkPixbuf *original_small_pixbuf;
-static gdouble    aspect_ratio_w;
-static gdouble    aspect_ratio_h;
 static PlugInDrawableVals preview_dvals;
 
 
+/* Part of the drawable shown by the preview, dragged with the mouse */
+static RENDER_VIEW preview_view;
+static gint        preview_max_level;
+static gboolean    preview_dragged = FALSE;
+static gdouble     drag_x;             /* pointer and view where the */
+static gdouble     drag_y;             /* dragging started */
+static gint        drag_view_x;
+static gint        drag_view_y;
+
+
+/* Preview to render */
+typedef struct preview_job_t
+{
+  PlugInVals    vals;
+  gint          generation;     /* the job stops once a newer one is requested */
+  gboolean      report_errors;
+  RENDER_VIEW   view;
+  PIXEL_SOURCE *source;         /* fetched by the main thread */
+  guchar       *pixels;         /* RGB, owned by the preview thread */
+} PREVIEW_JOB ;
+
+
+/* Pixels rendered, to be copied into the preview pixbuf */
+typedef struct preview_rect_t
+{
+  gint     generation;
+  gint     x;
+  gint     y;
+  gint     width;
+  gint     height;
+  guchar  *pixels;
+} PREVIEW_RECT ;
+
+
+/* The preview is rendered by a thread of its own, the dialog only copies
+   the pixels it hands back */
+static GThread     *preview_thread = NULL;
+static GMutex       preview_lock;
+static GCond        preview_cond;
+static PREVIEW_JOB *preview_pending = NULL;   /* job not yet started */
+static gboolean     preview_quit = FALSE;
+static gint         preview_generation = 0;   /* generation of the last job */
+static guint        preview_timeout = 0;      /* pending update, 0 if none */
+
+
 /*
  * Reads formulas from text entries.
  */
@@ -57,19 +104,17 @@ static void
 get_formulas ( PlugInDrawableVals *dvals,
                PlugInVals         *vals )
 {
-  /* we can use g_stpscpy() safely, because we defined the maximum size of the text entry */
-
   if ( dvals->is_rgb )
     {
-      g_stpcpy ( vals->str_red_chan, gtk_entry_get_text(GTK_ENTRY(text_red_chan)) );
-      g_stpcpy ( vals->str_green_chan, gtk_entry_get_text(GTK_ENTRY(text_green_chan)) );
-      g_stpcpy ( vals->str_blue_chan, gtk_entry_get_text(GTK_ENTRY(text_blue_chan)) );
+      vals_set_formula ( &vals->str_red_chan, gtk_entry_get_text(GTK_ENTRY(text_red_chan)) );
+      vals_set_formula ( &vals->str_green_chan, gtk_entry_get_text(GTK_ENTRY(text_green_chan)) );
+      vals_set_formula ( &vals->str_blue_chan, gtk_entry_get_text(GTK_ENTRY(text_blue_chan)) );
     }
   else
-    g_stpcpy ( vals->str_gray_chan, gtk_entry_get_text(GTK_ENTRY(text_gray_chan)) );
+    vals_set_formula ( &vals->str_gray_chan, gtk_entry_get_text(GTK_ENTRY(text_gray_chan)) );
 
   if ( dvals->has_alpha )
-    g_stpcpy ( vals->str_alpha_chan, gtk_entry_get_text(GTK_ENTRY(text_alpha_chan)) );
+    vals_set_formula ( &vals->str_alpha_chan, gtk_entry_get_text(GTK_ENTRY(text_alpha_chan)) );
 }
 
 
@@ -82,9 +127,9 @@ reset_formulas ( PlugInDrawableVals *dvals,
 {
   if ( dvals->is_rgb )
     {
-      g_stpcpy ( vals->str_red_chan, default_vals.str_red_chan );
-      g_stpcpy ( vals->str_green_chan, default_vals.str_green_chan );
-      g_stpcpy ( vals->str_blue_chan, default_vals.str_blue_chan );
+      vals_set_formula ( &vals->str_red_chan, default_vals.str_red_chan );
+      vals_set_formula ( &vals->str_green_chan, default_vals.str_green_chan );
+      vals_set_formula ( &vals->str_blue_chan, default_vals.str_blue_chan );
 
       gtk_entry_set_text ( GTK_ENTRY(text_red_chan), vals->str_red_chan );
       gtk_entry_set_text ( GTK_ENTRY(text_green_chan), vals->str_green_chan );
@@ -92,13 +137,13 @@ reset_formulas ( PlugInDrawableVals *dvals,
     }
   else
     {
-      g_stpcpy ( vals->str_gray_chan, default_vals.str_gray_chan );
+      vals_set_formula ( &vals->str_gray_chan, default_vals.str_gray_chan );
       gtk_entry_set_text ( GTK_ENTRY(text_gray_chan), vals->str_gray_chan );
     }
 
   if ( dvals->has_alpha )
     {
-      g_stpcpy ( vals->str_alpha_chan, default_vals.str_alpha_chan );
+      vals_set_formula ( &vals->str_alpha_chan, default_vals.str_alpha_chan );
       gtk_entry_set_text ( GTK_ENTRY(text_alpha_chan), vals->str_alpha_chan );
     }
 }
@@ -122,80 +167,203 @@ make_preview_pixbuf ( PlugInDrawableVals *dvals )
 
 
 /*
- * Creates the pixel buffer of the original image.
+ * Frees a preview job.
  */
-static GdkPixbuf *
-make_original_small_pixbuf ( PlugInDrawableVals *dvals )
+static void
+free_job ( PREVIEW_JOB *job )
 {
-  GimpPixelRgn  in_pr;
-  GdkPixbuf    *pixbuf;
-  GdkPixbuf    *new_pixbuf;
-  guchar       *in_image, *in_ptr, *pixbuf_pixels, *row_ptr, *ptr;
-  gint          rowstride;
+  g_free ( job->vals.str_red_chan );
+  g_free ( job->vals.str_green_chan );
+  g_free ( job->vals.str_blue_chan );
+  g_free ( job->vals.str_gray_chan );
+  g_free ( job->vals.str_alpha_chan );
+  render_free_preview_source ( job->source );
+  g_free ( job->pixels );
+  g_free ( job );
+}
 
-  if ( ( pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, dvals->width, dvals->height) ) == NULL )
-    return NULL;
 
-  memcpy ( &preview_dvals, dvals, sizeof(PlugInDrawableVals) );
-  preview_dvals.width = PREVIEW_WIDTH;
-  preview_dvals.height = PREVIEW_HEIGHT;
+/*
+ * Copies pixels rendered by the preview thread into the preview (main loop).
+ */
+static gboolean
+show_preview_rect ( gpointer data )
+{
+  PREVIEW_RECT *rect = (PREVIEW_RECT *) data;
+  guchar *row_ptr;
+  gint row_stride, j;
 
-  pixbuf_pixels = gdk_pixbuf_get_pixels ( pixbuf );
-  rowstride = gdk_pixbuf_get_rowstride ( pixbuf );
+  /* the pixels of a stopped job may be those of another view */
+  if ( rect->generation == g_atomic_int_get ( &preview_generation ) )
+    {
+      row_stride = gdk_pixbuf_get_rowstride ( preview_pixbuf );
+      row_ptr = gdk_pixbuf_get_pixels ( preview_pixbuf ) + rect->y * row_stride + rect->x * 3;
 
-  /* we calculate some aspect ratios */
-  aspect_ratio_w = ( (gdouble) dvals->width / (gdouble) PREVIEW_WIDTH );
-  aspect_ratio_h = ( (gdouble) dvals->height / (gdouble) PREVIEW_HEIGHT );
+      for ( j=0; j<rect->height; ++j, row_ptr+=row_stride )
+        memcpy ( row_ptr, rect->pixels + j * rect->width * 3, rect->width * 3 * sizeof(guchar) );
 
-  /* we copy the gimp drawable into a pixbuf (if someone knows another way to do it....) */
-  in_image = g_new ( guchar, dvals->size );
-  in_ptr = in_image;
-  gimp_pixel_rgn_init ( &in_pr, dvals->drawable, 0, 0, dvals->width, dvals->height, FALSE, FALSE );
-  gimp_pixel_rgn_get_rect ( &in_pr, in_image, 0, 0, dvals->width, dvals->height );
+      gtk_widget_queue_draw ( preview );
+    }
 
-  /* we separate the loops, so we don't waste time testing for alpha and rgb */
-  if ( dvals->is_rgb )
-    {
-      const gint col_size = dvals->height*rowstride;
-      const gint row_size = dvals->width*3*sizeof(guchar);
+  g_free ( rect->pixels );
+  g_free ( rect );
+  return FALSE;
+}
 
-      if (dvals->has_alpha)
-        {
-          for ( row_ptr=pixbuf_pixels; row_ptr<(pixbuf_pixels+col_size); row_ptr+=rowstride )
-            for ( ptr=row_ptr; ptr<(row_ptr+row_size); ptr+=3, in_ptr+=4 )
-              memcpy ( ptr, in_ptr, 3*sizeof(guchar) );
-        }
-      else
+
+/*
+ * Reports the errors of the formulas of a preview job (main loop).
+ */
+static gboolean
+report_preview_errors ( gpointer data )
+{
+  PREVIEW_JOB *job = (PREVIEW_JOB *) data;
+
+  if ( job->generation == g_atomic_int_get ( &preview_generation ) )
+    render_check_preview ( &preview_dvals, &job->vals );
+
+  free_job ( job );
+  return FALSE;
+}
+
+
+/*
+ * Hands the pixels a job has just rendered to the main loop, and stops the
+ * job once a newer one is requested.
+ */
+static gboolean
+preview_progress ( const gint  x1,
+                   const gint  y1,
+                   const gint  x2,
+                   const gint  y2,
+                   gpointer    data )
+{
+  PREVIEW_JOB *job = (PREVIEW_JOB *) data;
+  PREVIEW_RECT *rect;
+  gint j;
+
+  if ( job->generation != g_atomic_int_get ( &preview_generation ) )
+    return FALSE;
+
+  if ( ( x2 <= x1 ) || ( y2 <= y1 ) )
+    return TRUE;
+
+  /* the job goes on writing its pixels, the main loop gets a copy */
+  rect = g_new ( PREVIEW_RECT, 1 );
+  rect->generation = job->generation;
+  rect->x = x1;
+  rect->y = y1;
+  rect->width = x2 - x1;
+  rect->height = y2 - y1;
+  rect->pixels = g_new ( guchar, rect->width * rect->height * 3 );
+
+  for ( j=0; j<rect->height; ++j )
+    memcpy ( rect->pixels + j * rect->width * 3, job->pixels + ( ( y1 + j ) * job->view.width + x1 ) * 3,
+             rect->width * 3 * sizeof(guchar) );
+
+  g_idle_add ( show_preview_rect, rect );
+  return TRUE;
+}
+
+
+/*
+ * Preview thread: renders the jobs one after the other.
+ */
+static gpointer
+preview_thread_main ( gpointer data )
+{
+  PREVIEW_JOB *job;
+
+  g_mutex_lock ( &preview_lock );
+
+  while ( !preview_quit )
+    {
+      if ( preview_pending == NULL )
         {
-          for ( row_ptr=pixbuf_pixels; row_ptr<(pixbuf_pixels+col_size); row_ptr+=rowstride, in_ptr+=row_size )
-            memcpy ( row_ptr, in_ptr, row_size );
+          g_cond_wait ( &preview_cond, &preview_lock );
+          continue;
         }
-    }
-  else
-    {
-      const gint col_size = dvals->height*rowstride;
-      const gint row_size = dvals->width*3*sizeof(guchar);
 
-      if ( dvals->has_alpha )
+      job = preview_pending;
+      preview_pending = NULL;
+      g_mutex_unlock ( &preview_lock );
+
+      if ( render_preview ( &preview_dvals, &job->vals, &job->view, job->source,
+                            job->pixels, job->view.width * 3, preview_progress, job ) )
+        free_job ( job );
+      else if ( job->report_errors && ( job->generation == g_atomic_int_get ( &preview_generation ) ) )
         {
-          for ( row_ptr=pixbuf_pixels; row_ptr<(pixbuf_pixels+col_size); row_ptr+=rowstride )
-            for ( ptr=row_ptr; ptr<(row_ptr+row_size); ptr+=3, in_ptr+=2 )
-              memset ( ptr, *in_ptr, 3*sizeof(guchar) );
+          /* messages can only be sent from the main thread */
+          g_idle_add ( report_preview_errors, job );
         }
       else
-        {
-          for ( row_ptr=pixbuf_pixels; row_ptr<(pixbuf_pixels+col_size); row_ptr+=rowstride )
-            for ( ptr=row_ptr; ptr<(row_ptr+row_size); ptr+=3, ++in_ptr )
-              memset ( ptr, *in_ptr, 3*sizeof(guchar) );
-        }
+        free_job ( job );
+
+      g_mutex_lock ( &preview_lock );
     }
 
-  if ( ( new_pixbuf = gdk_pixbuf_scale_simple(pixbuf, PREVIEW_WIDTH, PREVIEW_HEIGHT, GDK_INTERP_TILES) ) == NULL )
-    return NULL;
-  
-  g_free ( in_image );
-  g_object_unref ( pixbuf );
-  return new_pixbuf;
+  g_mutex_unlock ( &preview_lock );
+  return NULL;
+}
+
+
+/*
+ * Asks the preview thread to render the formulas of the text entries over
+ * the view, the job being rendered is stopped.
+ */
+static void
+request_preview ( const gboolean report_errors )
+{
+  PREVIEW_JOB *job;
+
+  job = g_new0 ( PREVIEW_JOB, 1 );
+  get_formulas ( &preview_dvals, &job->vals );
+  job->report_errors = report_errors;
+
+  /* only the drawable under the view is read, if a formula reads it: the
+     preview thread can not talk to the GIMP */
+  job->view = preview_view;
+  job->source = render_preview_source ( &preview_dvals, &job->vals, &preview_view );
+  job->pixels = g_new0 ( guchar, preview_view.width * preview_view.height * 3 );
+
+  g_mutex_lock ( &preview_lock );
+  job->generation = g_atomic_int_add ( &preview_generation, 1 ) + 1;
+
+  if ( preview_pending != NULL )
+    free_job ( preview_pending );
+
+  preview_pending = job;
+  g_cond_signal ( &preview_cond );
+  g_mutex_unlock ( &preview_lock );
+}
+
+
+/*
+ * Stops the preview thread.
+ */
+static void
+stop_preview_thread ( void )
+{
+  if ( preview_timeout != 0 )
+    {
+      g_source_remove ( preview_timeout );
+      preview_timeout = 0;
+    }
+
+  g_mutex_lock ( &preview_lock );
+  preview_quit = TRUE;
+  g_atomic_int_inc ( &preview_generation );
+  g_cond_signal ( &preview_cond );
+  g_mutex_unlock ( &preview_lock );
+
+  g_thread_join ( preview_thread );
+  preview_thread = NULL;
+
+  if ( preview_pending != NULL )
+    {
+      free_job ( preview_pending );
+      preview_pending = NULL;
+    }
 }
 
 
@@ -206,30 +374,31 @@ static gboolean
 update_preview ( GtkWidget *widget, 
                  gpointer   data )
 {
-  PlugInVals vals = default_vals ;
-  get_formulas ( &preview_dvals, &vals );
-
-  /* if the widget is null, then this is not a callback... we do not report errors */
-  if ( widget == NULL )
+  if ( preview_timeout != 0 )
     {
-      render_to_pixbuf ( preview_pixbuf, original_small_pixbuf, 
-                         &preview_dvals, &vals,
-                         aspect_ratio_w, aspect_ratio_h,
-                         FALSE );
-    }
-  else
-    {
-      render_to_pixbuf ( preview_pixbuf, original_small_pixbuf,
-                         &preview_dvals, &vals,
-                         aspect_ratio_w, aspect_ratio_h,
-                         TRUE );
+      g_source_remove ( preview_timeout );
+      preview_timeout = 0;
     }
 
-  gtk_widget_queue_draw ( preview );
+  /* if the widget is null, then this is not a callback... we do not report errors */
+  request_preview ( widget != NULL );
   return TRUE;
 }
 
 
+/*
+ * Updates the preview once the user has stopped typing.
+ */
+static gboolean
+preview_delay_elapsed ( gpointer data )
+{
+  preview_timeout = 0;
+  request_preview ( FALSE );
+
+  return FALSE;
+}
+
+
 /*
  * Listens the changes of the auto-update-preview toggle.
  */
@@ -257,12 +426,163 @@ txt_changed ( GtkWidget *widget,
               gpointer   data )
 {
   if (auto_update_preview)
-    update_preview(NULL, NULL);
+    {
+      /* the preview being rendered is already out of date */
+      g_atomic_int_inc ( &preview_generation );
+
+      if ( preview_timeout != 0 )
+        g_source_remove ( preview_timeout );
+
+      preview_timeout = g_timeout_add ( PREVIEW_DELAY, preview_delay_elapsed, NULL );
+    }
 
   return TRUE;
 }
 
 
+/*
+ * Shows another part of the drawable in the preview, (x,y) is kept within
+ * the drawable scaled to the level.
+ */
+static void
+set_preview_view ( const gint level,
+                   gint       x,
+                   gint       y )
+{
+  x = CLAMP ( x, 0, ( PREVIEW_WIDTH << level ) - PREVIEW_WIDTH );
+  y = CLAMP ( y, 0, ( PREVIEW_HEIGHT << level ) - PREVIEW_HEIGHT );
+
+  if ( ( level == preview_view.level ) && ( x == preview_view.x ) && ( y == preview_view.y ) )
+    return;
+
+  preview_view.level = level;
+  preview_view.x = x;
+  preview_view.y = y;
+
+  gtk_widget_set_sensitive ( zoom_in_button, ( level < preview_max_level ) );
+  gtk_widget_set_sensitive ( zoom_out_button, ( level > 0 ) );
+
+  request_preview ( FALSE );
+}
+
+
+/*
+ * Zooms the preview in (delta > 0) or out (delta < 0), the pixel of the
+ * preview at (px,py) stays in place.
+ */
+static void
+zoom_preview ( const gint delta,
+               const gint px,
+               const gint py )
+{
+  const gint level = CLAMP ( preview_view.level + delta, 0, preview_max_level );
+  gint x, y;
+
+  if ( level == preview_view.level )
+    return;
+
+  x = preview_view.x + px;
+  y = preview_view.y + py;
+
+  if ( level > preview_view.level )
+    set_preview_view ( level, ( x << ( level - preview_view.level ) ) - px, ( y << ( level - preview_view.level ) ) - py );
+  else
+    set_preview_view ( level, ( x >> ( preview_view.level - level ) ) - px, ( y >> ( preview_view.level - level ) ) - py );
+}
+
+
+/*
+ * Listens the zoom buttons.
+ */
+static gboolean
+zoom_in_clicked ( GtkWidget *widget,
+                  gpointer   data )
+{
+  zoom_preview ( 1, PREVIEW_WIDTH / 2, PREVIEW_HEIGHT / 2 );
+  return TRUE;
+}
+
+static gboolean
+zoom_out_clicked ( GtkWidget *widget,
+                   gpointer   data )
+{
+  zoom_preview ( -1, PREVIEW_WIDTH / 2, PREVIEW_HEIGHT / 2 );
+  return TRUE;
+}
+
+
+/*
+ * Listens the mouse wheel over the preview, it zooms around the pointer.
+ */
+static gboolean
+preview_scrolled ( GtkWidget      *widget,
+                   GdkEventScroll *event,
+                   gpointer        data )
+{
+  const gint px = CLAMP ( (gint) event->x, 0, PREVIEW_WIDTH - 1 );
+  const gint py = CLAMP ( (gint) event->y, 0, PREVIEW_HEIGHT - 1 );
+
+  if ( event->direction == GDK_SCROLL_UP )
+    zoom_preview ( 1, px, py );
+  else if ( event->direction == GDK_SCROLL_DOWN )
+    zoom_preview ( -1, px, py );
+
+  return TRUE;
+}
+
+
+/*
+ * Listens the mouse buttons over the preview, the first one drags it.
+ */
+static gboolean
+preview_pressed ( GtkWidget      *widget,
+                  GdkEventButton *event,
+                  gpointer        data )
+{
+  if ( event->button != 1 )
+    return FALSE;
+
+  preview_dragged = TRUE;
+  drag_x = event->x;
+  drag_y = event->y;
+  drag_view_x = preview_view.x;
+  drag_view_y = preview_view.y;
+
+  return TRUE;
+}
+
+static gboolean
+preview_released ( GtkWidget      *widget,
+                   GdkEventButton *event,
+                   gpointer        data )
+{
+  if ( event->button != 1 )
+    return FALSE;
+
+  preview_dragged = FALSE;
+  return TRUE;
+}
+
+
+/*
+ * Listens the moves of the mouse over the preview, the view follows the
+ * pointer while it is dragged.
+ */
+static gboolean
+preview_moved ( GtkWidget      *widget,
+                GdkEventMotion *event,
+                gpointer        data )
+{
+  if ( !preview_dragged )
+    return FALSE;
+
+  set_preview_view ( preview_view.level,
+                     drag_view_x - (gint) ( event->x - drag_x ),
+                     drag_view_y - (gint) ( event->y - drag_y ) );
+  return TRUE;
+}
+
+
 /*
  * Creates the plugin dialog.
  */
@@ -277,6 +597,8 @@ dialog ( gint32               image_ID,
   GtkWidget *label;
   GtkWidget *frame;
   GtkWidget *button;
+  GtkWidget *event_box;
+  GtkWidget *hbox;
   gint       response;
 
   gimp_ui_init(PLUGIN_NAME, TRUE);
@@ -312,36 +634,73 @@ dialog ( gint32               image_ID,
   gtk_container_add(GTK_CONTAINER(frame), table);
   gtk_widget_show(table);
 
-  /* preview image */
-  if ((original_small_pixbuf = make_original_small_pixbuf(dvals)) == NULL)
-    {
-      error(NULL, _("Unable to make the small pixbuf of the original image."));
-      return 0;
-    }
-
+  /* preview image, the whole drawable is shown first */
   if ((preview_pixbuf = make_preview_pixbuf(dvals)) == NULL)
     {
       error(NULL, _("Unable to make the preview pixbuf."));
       return 0;
     }
 
+  memcpy ( &preview_dvals, dvals, sizeof(PlugInDrawableVals) );
+  preview_view.width = PREVIEW_WIDTH;
+  preview_view.height = PREVIEW_HEIGHT;
+  preview_view.level = 0;
+  preview_view.x = 0;
+  preview_view.y = 0;
+
+  /* it zooms in until a pixel of the preview is a pixel of the drawable */
+  for ( preview_max_level=0;
+        ( (PREVIEW_WIDTH << preview_max_level) < dvals->width ) || ( (PREVIEW_HEIGHT << preview_max_level) < dvals->height );
+        ++preview_max_level );
+
   preview = gtk_image_new_from_pixbuf(preview_pixbuf);
   gtk_widget_set_size_request(preview, PREVIEW_WIDTH, PREVIEW_HEIGHT);
-  gtk_table_attach_defaults(GTK_TABLE(table), preview, 0, 1, 0, 1);
+
+  event_box = gtk_event_box_new();
+  gtk_widget_add_events(event_box, GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_POINTER_MOTION_MASK | GDK_SCROLL_MASK);
+  gimp_help_set_help_data (event_box, _("Drag to pan, scroll to zoom"), NULL);
+  g_signal_connect(G_OBJECT(event_box), "button-press-event", G_CALLBACK(preview_pressed), NULL);
+  g_signal_connect(G_OBJECT(event_box), "button-release-event", G_CALLBACK(preview_released), NULL);
+  g_signal_connect(G_OBJECT(event_box), "motion-notify-event", G_CALLBACK(preview_moved), NULL);
+  g_signal_connect(G_OBJECT(event_box), "scroll-event", G_CALLBACK(preview_scrolled), NULL);
+  gtk_container_add(GTK_CONTAINER(event_box), preview);
+  gtk_table_attach_defaults(GTK_TABLE(table), event_box, 0, 1, 0, 1);
+  gtk_widget_show(event_box);
+
+  /* zoom buttons */
+  hbox = gtk_hbox_new(TRUE, 2);
+  gtk_table_attach(GTK_TABLE(table), hbox, 0, 1, 1, 2, GTK_FILL, 0, 0, 0);
+  gtk_widget_show(hbox);
+
+  zoom_out_button = gtk_button_new();
+  gtk_container_add(GTK_CONTAINER(zoom_out_button), gtk_image_new_from_stock(GTK_STOCK_ZOOM_OUT, GTK_ICON_SIZE_BUTTON));
+  gimp_help_set_help_data (zoom_out_button, _("Zoom the preview out"), NULL);
+  gtk_widget_set_sensitive(zoom_out_button, FALSE);
+  g_signal_connect(G_OBJECT(zoom_out_button), "clicked", G_CALLBACK(zoom_out_clicked), NULL);
+  gtk_box_pack_start(GTK_BOX(hbox), zoom_out_button, TRUE, TRUE, 0);
+  gtk_widget_show_all(zoom_out_button);
+
+  zoom_in_button = gtk_button_new();
+  gtk_container_add(GTK_CONTAINER(zoom_in_button), gtk_image_new_from_stock(GTK_STOCK_ZOOM_IN, GTK_ICON_SIZE_BUTTON));
+  gimp_help_set_help_data (zoom_in_button, _("Zoom the preview in"), NULL);
+  gtk_widget_set_sensitive(zoom_in_button, (preview_max_level > 0));
+  g_signal_connect(G_OBJECT(zoom_in_button), "clicked", G_CALLBACK(zoom_in_clicked), NULL);
+  gtk_box_pack_start(GTK_BOX(hbox), zoom_in_button, TRUE, TRUE, 0);
+  gtk_widget_show_all(zoom_in_button);
 
   /* automatic preview update toggle */
   button = gtk_check_button_new_with_label(_("Automatic Update"));
   gimp_help_set_help_data (button, _("Enable/Disable the automatic update of the preview"), NULL);
   gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), auto_update_preview);
   g_signal_connect(G_OBJECT(button), "toggled", G_CALLBACK(auto_update_preview_toggled), NULL);
-  gtk_table_attach(GTK_TABLE(table), button, 0, 1, 1, 2, GTK_FILL, 0, 0, 0);
+  gtk_table_attach(GTK_TABLE(table), button, 0, 1, 2, 3, GTK_FILL, 0, 0, 0);
   gtk_widget_show(button);
 
   /* preview update button */
   button = gtk_button_new_with_label(_("Update"));
   gimp_help_set_help_data (button, _("Update the preview"), NULL);
   g_signal_connect(G_OBJECT(button), "clicked", G_CALLBACK(update_preview), NULL);
-  gtk_table_attach(GTK_TABLE(table), button, 0, 1, 2, 3, GTK_FILL, 0, 0, 0); 
+  gtk_table_attach(GTK_TABLE(table), button, 0, 1, 3, 4, GTK_FILL, 0, 0, 0); 
   gtk_widget_show(button);
 
   /* formulas' frame */
@@ -393,21 +752,21 @@ dialog ( gint32               image_ID,
 
   if (dvals->is_rgb)
     {
-      text_red_chan = gtk_entry_new_with_max_length(FORMULA_STR_MAX_LEN);
+      text_red_chan = gtk_entry_new();
       gtk_table_attach(GTK_TABLE(table), text_red_chan, 1, 2, 0, 1, GTK_EXPAND|GTK_FILL, GTK_EXPAND|GTK_FILL, 0, 0 );
       gimp_help_set_help_data (text_red_chan, _("The formula for the red channel of the image"), NULL);
       gtk_entry_set_text(GTK_ENTRY(text_red_chan), vals->str_red_chan);
       g_signal_connect(G_OBJECT(text_red_chan), "changed", G_CALLBACK(txt_changed), NULL);
       gtk_widget_show(text_red_chan);
 
-      text_green_chan = gtk_entry_new_with_max_length(FORMULA_STR_MAX_LEN);
+      text_green_chan = gtk_entry_new();
       gtk_table_attach(GTK_TABLE(table), text_green_chan, 1, 2, 1, 2, GTK_EXPAND|GTK_FILL, GTK_EXPAND|GTK_FILL, 0, 0 );
       gimp_help_set_help_data (text_green_chan, _("The formula for the green channel of the image"), NULL);
       gtk_entry_set_text(GTK_ENTRY(text_green_chan), vals->str_green_chan);
       g_signal_connect(G_OBJECT(text_green_chan), "changed", G_CALLBACK(txt_changed), NULL);
       gtk_widget_show(text_green_chan);
 
-      text_blue_chan = gtk_entry_new_with_max_length(FORMULA_STR_MAX_LEN);
+      text_blue_chan = gtk_entry_new();
       gtk_table_attach(GTK_TABLE(table), text_blue_chan, 1, 2, 2, 3, GTK_EXPAND|GTK_FILL, GTK_EXPAND|GTK_FILL, 0, 0 );
       gimp_help_set_help_data (text_blue_chan, _("The formula for the blue channel of the image"), NULL);
       gtk_entry_set_text(GTK_ENTRY(text_blue_chan), vals->str_blue_chan);
@@ -419,7 +778,7 @@ dialog ( gint32               image_ID,
       text_red_chan = NULL;
       text_blue_chan = NULL;
       text_green_chan = NULL;
-      text_gray_chan = gtk_entry_new_with_max_length(FORMULA_STR_MAX_LEN);
+      text_gray_chan = gtk_entry_new();
       gtk_table_attach(GTK_TABLE(table), text_gray_chan, 1, 2, 0, 1, GTK_EXPAND|GTK_FILL, GTK_EXPAND|GTK_FILL, 0, 0 );
       gimp_help_set_help_data (text_gray_chan, _("The formula for the gray channel of the image"), NULL);
       gtk_entry_set_text(GTK_ENTRY(text_gray_chan), vals->str_gray_chan);
@@ -428,7 +787,7 @@ dialog ( gint32               image_ID,
     }
 
   /* alpha channel */
-  text_alpha_chan = gtk_entry_new_with_max_length(FORMULA_STR_MAX_LEN);
+  text_alpha_chan = gtk_entry_new();
   gtk_table_attach(GTK_TABLE(table), text_alpha_chan, 1, 2, 3, 4, GTK_EXPAND|GTK_FILL, GTK_EXPAND|GTK_FILL, 0, 0 );
   gimp_help_set_help_data (text_alpha_chan, _("The formula for the alpha channel of the image"), NULL);
   gtk_entry_set_text(GTK_ENTRY(text_alpha_chan), vals->str_alpha_chan);
@@ -441,6 +800,8 @@ dialog ( gint32               image_ID,
   gtk_widget_show(text_alpha_chan);
 
   /* user can see the dialog */
+  preview_quit = FALSE;
+  preview_thread = g_thread_new ( "formulas-preview", preview_thread_main, NULL );
   update_preview(NULL, NULL);
   gtk_widget_show(preview);
   gtk_widget_show(main_hbox);
@@ -458,6 +819,9 @@ dialog ( gint32               image_ID,
     }
   while ( ( response == GTK_RESPONSE_HELP ) || ( response == RESPONSE_RESET ) );
 
+  /* the preview is no longer rendered */
+  stop_preview_thread ( );
+
   /* we get the formulas */
   get_formulas(dvals, vals);
 
@@ -465,6 +829,7 @@ dialog ( gint32               image_ID,
   vals->auto_update_preview = auto_update_preview;
   gtk_widget_destroy ( dlg );
   g_object_unref ( preview_pixbuf );
+  render_free_preview ( );
 
   return (response == GTK_RESPONSE_OK);
 }
@@ -28,6 +28,7 @@
 #include "main.h"
 #include "interface.h"
 #include "render.h"
+#include "formula.h"
 #include "plugin-intl.h"
 
 
@@ -51,6 +52,82 @@ static PlugInVals         vals;
 static PlugInDrawableVals dvals;
 
 
+/*
+ * Replaces a formula by a copy of a string.
+ */
+void
+vals_set_formula ( gchar       **formula,
+                   const gchar  *str )
+{
+  g_free ( *formula );
+  *formula = g_strdup ( str );
+}
+
+
+/*
+ * Loads the values of the last run: the formulas one after the other, each
+ * followed by its '\0', then the auto-update flag. They are left untouched
+ * if the data is not complete.
+ */
+static void
+load_vals ( void )
+{
+  gchar **formulas[] = { &vals.str_red_chan, &vals.str_green_chan, &vals.str_blue_chan,
+                         &vals.str_gray_chan, &vals.str_alpha_chan };
+  gchar *data, *ptr, *end;
+  gint size;
+  guint i;
+
+  if ( ( size = gimp_get_data_size ( DATA_KEY_VALS ) ) <= 0 )
+    return;
+
+  data = (gchar *) g_malloc ( size );
+  gimp_get_data ( DATA_KEY_VALS, data );
+  end = data + size;
+
+  for ( i=0, ptr=data; i<G_N_ELEMENTS(formulas); ++i )
+    {
+      if ( ( ptr >= end ) || ( memchr ( ptr, '\0', end-ptr ) == NULL ) )
+        break;
+
+      ptr += strlen ( ptr ) + 1;
+    }
+
+  if ( ( i == G_N_ELEMENTS(formulas) ) && ( ptr < end ) )
+    {
+      for ( i=0, ptr=data; i<G_N_ELEMENTS(formulas); ++i )
+        {
+          vals_set_formula ( formulas[i], ptr );
+          ptr += strlen ( ptr ) + 1;
+        }
+
+      vals.auto_update_preview = ( *ptr != 0 );
+    }
+
+  g_free ( data );
+}
+
+
+/*
+ * Saves the values for the next run.
+ */
+static void
+save_vals ( void )
+{
+  const gchar *formulas[] = { vals.str_red_chan, vals.str_green_chan, vals.str_blue_chan,
+                              vals.str_gray_chan, vals.str_alpha_chan };
+  GString *data = g_string_new ( NULL );
+  guint i;
+
+  for ( i=0; i<G_N_ELEMENTS(formulas); ++i )
+    g_string_append_len ( data, formulas[i], strlen(formulas[i])+1 );
+
+  g_string_append_c ( data, ( vals.auto_update_preview ? 1 : 0 ) );
+  gimp_set_data ( DATA_KEY_VALS, data->str, data->len );
+  g_string_free ( data, TRUE );
+}
+
+
 /*
  * GIMP plugin query function.
  */
@@ -119,7 +196,12 @@ run ( const gchar      *name,
   image_ID = param[1].data.d_int32;
 
   /* initializes with default values */
-  vals = default_vals;
+  vals.str_red_chan = g_strdup ( default_vals.str_red_chan );
+  vals.str_green_chan = g_strdup ( default_vals.str_green_chan );
+  vals.str_blue_chan = g_strdup ( default_vals.str_blue_chan );
+  vals.str_gray_chan = g_strdup ( default_vals.str_gray_chan );
+  vals.str_alpha_chan = g_strdup ( default_vals.str_alpha_chan );
+  vals.auto_update_preview = default_vals.auto_update_preview;
   dvals = default_dvals;
   dvals.drawable = gimp_drawable_get ( param[2].data.d_drawable );
   dvals.width = gimp_drawable_width ( dvals.drawable->drawable_id );
@@ -135,29 +217,29 @@ run ( const gchar      *name,
         case GIMP_RUN_NONINTERACTIVE:
           if (dvals.is_rgb)
             {
-              g_strlcpy ( vals.str_red_chan, param[3].data.d_string, 1+(MIN(strlen(param[3].data.d_string), FORMULA_STR_MAX_LEN)));
-              g_strlcpy ( vals.str_green_chan, param[4].data.d_string, 1+(MIN(strlen(param[4].data.d_string), FORMULA_STR_MAX_LEN)));
-              g_strlcpy ( vals.str_blue_chan, param[5].data.d_string, 1+(MIN(strlen(param[5].data.d_string), FORMULA_STR_MAX_LEN)));
+              vals_set_formula ( &vals.str_red_chan, param[3].data.d_string );
+              vals_set_formula ( &vals.str_green_chan, param[4].data.d_string );
+              vals_set_formula ( &vals.str_blue_chan, param[5].data.d_string );
             }
           else
             {
-              g_strlcpy ( vals.str_gray_chan, param[5].data.d_string, 1+(MIN(strlen(param[6].data.d_string), FORMULA_STR_MAX_LEN)) );
+              vals_set_formula ( &vals.str_gray_chan, param[6].data.d_string );
             }
 
           if ( dvals.has_alpha )
-            g_strlcpy ( vals.str_alpha_chan, param[6].data.d_string, 1+(MIN(strlen(param[7].data.d_string), FORMULA_STR_MAX_LEN)) );
+            vals_set_formula ( &vals.str_alpha_chan, param[7].data.d_string );
 
           break;
 
         case GIMP_RUN_INTERACTIVE:
-          gimp_get_data ( DATA_KEY_VALS, &vals );
+          load_vals ( );
 
           if ( !dialog(image_ID, &dvals, &vals) )
             status = GIMP_PDB_CANCEL;
           break;
 
         case GIMP_RUN_WITH_LAST_VALS:
-          gimp_get_data ( DATA_KEY_VALS, &vals );
+          load_vals ( );
           break;
 
         default:
@@ -170,7 +252,7 @@ run ( const gchar      *name,
     }
 
   if ( run_mode == GIMP_RUN_INTERACTIVE )
-    gimp_set_data ( DATA_KEY_VALS, &vals, sizeof(vals) );
+    save_vals ( );
 
   if ( status == GIMP_PDB_SUCCESS )
     {
@@ -179,6 +261,9 @@ run ( const gchar      *name,
       gimp_drawable_detach ( dvals.drawable );
     }
 
+  /* the formulas compiled for the preview and the rendering */
+  formula_cache_clear ( );
+
   values[0].type = GIMP_PDB_STATUS;
   values[0].data.d_status = status;
 }
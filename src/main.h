@@ -25,16 +25,15 @@
 #define __MAIN_H__
 
 
-#define FORMULA_STR_MAX_LEN 256
-
-
+/* The formulas have no length limit, they are allocated with g_malloc(),
+   except those of default_vals */
 typedef struct
 {
-  gchar   str_red_chan   [FORMULA_STR_MAX_LEN+1];
-  gchar   str_green_chan [FORMULA_STR_MAX_LEN+1];
-  gchar   str_blue_chan  [FORMULA_STR_MAX_LEN+1];
-  gchar   str_gray_chan  [FORMULA_STR_MAX_LEN+1];
-  gchar   str_alpha_chan [FORMULA_STR_MAX_LEN+1];
+  gchar   *str_red_chan;
+  gchar   *str_green_chan;
+  gchar   *str_blue_chan;
+  gchar   *str_gray_chan;
+  gchar   *str_alpha_chan;
   gboolean auto_update_preview;
 } PlugInVals;
 
@@ -56,4 +55,8 @@ extern const PlugInVals         default_vals;
 extern const PlugInDrawableVals default_drawable_vals;
 
 
+/* Replaces a formula by a copy of 'str' */
+void vals_set_formula ( gchar **formula, const gchar *str );
+
+
 #endif
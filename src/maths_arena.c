@@ -0,0 +1,111 @@
+/*
+ * maths_arena.c
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib.h>
+#include "maths_arena.h"
+
+
+/* Size of the blocks, larger allocations get a block of their own */
+#define MATHS_ARENA_BLOCK_SIZE 4096
+
+/* Alignment of the allocations */
+#define MATHS_ARENA_ALIGN(size)  ( ( (size) + 15 ) & ~((gsize) 15) )
+
+
+/*
+ * Creates an arena.
+ */
+MATHS_ARENA *
+maths_arena_new ( void )
+{
+  MATHS_ARENA *arena;
+
+  arena = (MATHS_ARENA *) g_malloc ( sizeof(MATHS_ARENA) );
+  arena->blocks = NULL;
+  arena->next = NULL;
+  arena->left = 0;
+
+  return arena;
+}
+
+
+/*
+ * Allocates memory from an arena.
+ */
+gpointer
+maths_arena_alloc ( MATHS_ARENA *arena,
+                    const gsize  size )
+{
+  const gsize aligned = MATHS_ARENA_ALIGN ( size );
+  guint8 *block;
+
+  if ( arena == NULL )
+    return NULL;
+
+  if ( aligned > arena->left )
+    {
+      /* the current block goes on serving the small allocations */
+      if ( aligned > MATHS_ARENA_BLOCK_SIZE / 4 )
+        {
+          block = (guint8 *) g_malloc0 ( aligned );
+          arena->blocks = g_slist_prepend ( arena->blocks, block );
+          return block;
+        }
+
+      block = (guint8 *) g_malloc0 ( MATHS_ARENA_BLOCK_SIZE );
+      arena->blocks = g_slist_prepend ( arena->blocks, block );
+      arena->next = block;
+      arena->left = MATHS_ARENA_BLOCK_SIZE;
+    }
+
+  block = arena->next;
+  arena->next += aligned;
+  arena->left -= aligned;
+
+  return block;
+}
+
+
+/*
+ * Frees an arena.
+ */
+void
+maths_arena_free ( MATHS_ARENA *arena )
+{
+  GSList *l;
+
+  if ( arena == NULL )
+    return;
+
+  for ( l=arena->blocks; l!=NULL; l=l->next )
+    g_free ( l->data );
+
+  g_slist_free ( arena->blocks );
+  g_free ( arena );
+}
@@ -0,0 +1,51 @@
+/*
+ * maths_arena.h
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#ifndef __MATHS_ARENA_H__
+#define __MATHS_ARENA_H__
+
+
+/* Memory of the trees of a formula: the elements are allocated one after the
+   other in large blocks, so that a tree is walked through contiguous memory,
+   and everything is freed at once with the formula */
+typedef struct maths_arena_t
+{
+  GSList  *blocks;
+  guint8  *next;    /* free space of the current block */
+  gsize    left;
+} MATHS_ARENA ;
+
+
+/* Creates an empty arena */
+MATHS_ARENA *maths_arena_new ( void );
+
+/* Returns size bytes filled with zeros, aligned for any type. They remain
+   valid until the arena is freed */
+gpointer maths_arena_alloc ( MATHS_ARENA *arena, const gsize size );
+
+/* Frees an arena and everything allocated from it */
+void maths_arena_free ( MATHS_ARENA *arena );
+
+
+#endif
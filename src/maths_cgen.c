@@ -0,0 +1,949 @@
+/*
+ * maths_cgen.c
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gmodule.h>
+#include "error.h"
+#include "maths_op.h"
+#include "maths_val.h"
+#include "maths_func.h"
+#include "maths_prog.h"
+#include "maths_cgen.h"
+#include "plugin-intl.h"
+
+
+/* Accessors to channel value of a given source */
+extern gdouble source_get_red ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_gray ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_green ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_blue ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_alpha ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_chan ( const struct pixel_source_t *, gint, gdouble, gdouble );
+
+
+/* Changes each time the generated code changes, so that older objects of
+   the cache are not loaded anymore */
+#define MATHS_CGEN_VERSION "1"
+
+/* Compiler flags: no contraction into FMAs and no builtins, so that the
+   kernels give the same results as the interpreter, down to the last bit */
+static const gchar *cflags[] =
+  {
+    "-O2", "-fno-builtin", "-ffp-contract=off", "-fPIC", "-shared",
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+    "-march=native",
+#endif
+    NULL
+  };
+
+/* Beginning of each generated file */
+static const gchar prelude[] =
+  "#include <math.h>\n"
+  "typedef struct\n"
+  "{\n"
+  "  double (*red) (const void *, double, double);\n"
+  "  double (*gray) (const void *, double, double);\n"
+  "  double (*green) (const void *, double, double);\n"
+  "  double (*blue) (const void *, double, double);\n"
+  "  double (*alpha) (const void *, double, double);\n"
+  "  double (*chan) (const void *, int, double, double);\n"
+  "  double (*rand) (void);\n"
+  "  double (*sincos) (double, double *);\n"
+  "  double (*sinhcosh) (double, double *);\n"
+  "} env_t;\n"
+  "static double sign_ ( double v ) { return ( v == 0.0 ) ? 0.0 : ( ( v > 0.0 ) ? 1.0 : -1.0 ); }\n"
+  "void\n"
+  "formulas_kernel ( int n, const double *x, double y, const double *r, const double *t,\n"
+  "                  const double *w, const double *h, const void *src, int chan,\n"
+  "                  double *out, const env_t *env )\n"
+  "{\n"
+  "  int i;\n";
+
+/* libm functions, in the order of the MATHS_FUNC_ID_* identifiers
+   (NULL for the functions handled apart) */
+static const gchar *func_names[] =
+  {
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, "fabs",
+    "sign_", "sin", "sinh", "asin",
+    "asinh", "cos", "cosh", "acos",
+    "acosh", "tan", "tanh", "atan",
+    "atan2", "atanh", NULL, NULL,
+    "sqrt", "cbrt", "log", "log2",
+    "log10", "exp", "ceil", "round",
+    NULL, NULL, NULL
+  };
+
+
+/* Code being generated: the values which do not vary with x are computed
+   once per row, before the loop over the pixels. An expression already
+   computed by a variable is not computed again. */
+typedef struct cgen_state_t
+{
+  GString     *pre;
+  GString     *body;
+  gint         nvars;
+  GHashTable  *exprs;  /* expression -> name of the variable holding it */
+  GHashTable  *pairs;  /* calls of sin, cos, sinh and cosh whose partner is
+                          called on the same argument */
+  MATHS_CGEN  *cg;
+} CGEN_STATE ;
+
+
+/*
+ * Returns the C literal of a double, exact to the last bit.
+ */
+static gchar *
+double_literal ( const gdouble v )
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if ( isnan ( v ) )
+    return g_strdup ( "NAN" );
+
+  if ( isinf ( v ) )
+    return g_strdup ( ( v > 0.0 ) ? "HUGE_VAL" : "(-HUGE_VAL)" );
+
+  /* not printf(), which follows the locale of the interface */
+  g_ascii_dtostr ( buf, sizeof ( buf ), v );
+
+  /* an integral value would make an int literal */
+  return g_strconcat ( "(", buf, strpbrk ( buf, ".e" ) ? ")" : ".0)", NULL );
+}
+
+
+/*
+ * Indentation of the code varying with 'vary'.
+ */
+static const gchar *
+indent ( const gint vary )
+{
+  return ( vary & MATHS_PROG_VARY_X ) ? "      " : "  ";
+}
+
+
+/*
+ * Declares a new variable initialized to 'expr', in the loop if it varies
+ * with x. Returns its name.
+ */
+static gchar *
+declare_var ( CGEN_STATE  *st,
+              const gint   vary,
+              const gchar *expr )
+{
+  GString *code = ( vary & MATHS_PROG_VARY_X ) ? st->body : st->pre;
+  gchar *name;
+
+  name = g_strdup_printf ( "v%d", st->nvars++ );
+  g_string_append_printf ( code, "%sdouble %s = %s;\n", indent ( vary ), name, expr );
+
+  return name;
+}
+
+
+/*
+ * Returns the name of a variable holding an expression, declares it unless
+ * the same expression has already been computed.
+ */
+static gchar *
+new_var ( CGEN_STATE  *st,
+          const gint   vary,
+          const gchar *format,
+          ... )
+{
+  va_list args;
+  gchar *expr, *name;
+
+  va_start ( args, format );
+  expr = g_strdup_vprintf ( format, args );
+  va_end ( args );
+
+  if ( ( name = g_hash_table_lookup ( st->exprs, expr ) ) != NULL )
+    {
+      g_free ( expr );
+      return g_strdup ( name );
+    }
+
+  name = declare_var ( st, vary, expr );
+  g_hash_table_insert ( st->exprs, expr, g_strdup ( name ) );
+
+  return name;
+}
+
+
+/*
+ * Tells whether two elements compute the same value (recursive), elements
+ * calling rand() never do.
+ */
+static gboolean
+same_element ( MATHS_TREE_ELEMENT *a,
+               MATHS_TREE_ELEMENT *b )
+{
+  gint i;
+
+  if ( ( a == NULL ) || ( b == NULL ) || ( a->data == NULL ) || ( b->data == NULL ) || ( a->exec != b->exec ) )
+    return FALSE;
+
+  if ( a->exec == maths_val_exec )
+    {
+      MATHS_VALUE *va = (MATHS_VALUE *) a->data;
+      MATHS_VALUE *vb = (MATHS_VALUE *) b->data;
+
+      if ( ( va->precalc_code == PRECALC_NOT ) || ( vb->precalc_code == PRECALC_NOT ) )
+        return ( ( va->precalc_code == vb->precalc_code ) && ( va->value == vb->value ) );
+
+      return ( memcmp ( va->value, vb->value, sizeof(gdouble) ) == 0 );
+    }
+  else if ( a->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *oa = (MATHS_OPERATOR *) a->data;
+      MATHS_OPERATOR *ob = (MATHS_OPERATOR *) b->data;
+
+      return ( ( *oa->name == *ob->name ) && same_element ( oa->l, ob->l ) && same_element ( oa->r, ob->r ) );
+    }
+  else if ( a->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *fa = (MATHS_FUNCTION *) a->data;
+      MATHS_FUNCTION *fb = (MATHS_FUNCTION *) b->data;
+
+      if ( ( fa->id != fb->id ) || ( fa->argc != fb->argc ) || ( fa->id == MATHS_FUNC_ID_RAND ) )
+        return FALSE;
+
+      for ( i=0; i<fa->argc; ++i )
+        if ( !same_element ( fa->argv[i], fb->argv[i] ) )
+          return FALSE;
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+
+/*
+ * Returns the function whose value comes with the one of a function:
+ * cos for sin, sinh for cosh... -1 if there is none.
+ */
+static gint
+get_partner ( const gint id )
+{
+  switch ( id )
+    {
+    case MATHS_FUNC_ID_SIN:  return MATHS_FUNC_ID_COS;
+    case MATHS_FUNC_ID_COS:  return MATHS_FUNC_ID_SIN;
+    case MATHS_FUNC_ID_SINH: return MATHS_FUNC_ID_COSH;
+    case MATHS_FUNC_ID_COSH: return MATHS_FUNC_ID_SINH;
+    }
+
+  return -1;
+}
+
+
+/*
+ * Collects the calls of sin, cos, sinh and cosh of a tree (recursive).
+ */
+static void
+collect_calls ( MATHS_TREE_ELEMENT *el,
+                GPtrArray          *calls )
+{
+  gint i;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return;
+
+  if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+
+      collect_calls ( op->l, calls );
+      collect_calls ( op->r, calls );
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      if ( ( func->argc == 1 ) && ( get_partner ( func->id ) >= 0 ) )
+        g_ptr_array_add ( calls, el );
+
+      for ( i=0; i<func->argc; ++i )
+        collect_calls ( func->argv[i], calls );
+    }
+}
+
+
+/*
+ * Finds the calls of sin and cos, or sinh and cosh, of the same argument:
+ * the kernel computes both values at once.
+ */
+static void
+find_pairs ( CGEN_STATE         *st,
+             MATHS_TREE_ELEMENT *head )
+{
+  GPtrArray *calls = g_ptr_array_new ( );
+  MATHS_FUNCTION *a, *b;
+  gint i, j;
+
+  collect_calls ( head, calls );
+
+  for ( i=0; i<calls->len; ++i )
+    for ( j=i+1; j<calls->len; ++j )
+      {
+        a = (MATHS_FUNCTION *) ((MATHS_TREE_ELEMENT *) g_ptr_array_index(calls, i))->data;
+        b = (MATHS_FUNCTION *) ((MATHS_TREE_ELEMENT *) g_ptr_array_index(calls, j))->data;
+
+        if ( ( get_partner ( a->id ) == b->id )
+             && same_element ( a->argv[0], b->argv[0] ) )
+          {
+            g_hash_table_insert ( st->pairs, g_ptr_array_index(calls, i), GINT_TO_POINTER ( TRUE ) );
+            g_hash_table_insert ( st->pairs, g_ptr_array_index(calls, j), GINT_TO_POINTER ( TRUE ) );
+          }
+      }
+
+  g_ptr_array_free ( calls, TRUE );
+}
+
+
+/*
+ * Returns the name of the variable holding the function 'id' of 'arg', which
+ * is computed along with its partner unless one of them already has been.
+ */
+static gchar *
+gen_pair ( CGEN_STATE  *st,
+           const gint   vary,
+           const gint   id,
+           const gchar *arg )
+{
+  const gboolean hyper = ( ( id == MATHS_FUNC_ID_SINH ) || ( id == MATHS_FUNC_ID_COSH ) );
+  GString *code = ( vary & MATHS_PROG_VARY_X ) ? st->body : st->pre;
+  gchar *first, *second, *first_expr, *second_expr;
+  const gchar *name;
+
+  first_expr = g_strdup_printf ( "%s ( %s )", hyper ? "sinh" : "sin", arg );
+  second_expr = g_strdup_printf ( "%s ( %s )", hyper ? "cosh" : "cos", arg );
+
+  if ( ( g_hash_table_lookup ( st->exprs, first_expr ) != NULL )
+       || ( g_hash_table_lookup ( st->exprs, second_expr ) != NULL ) )
+    {
+      g_free ( first_expr );
+      g_free ( second_expr );
+      return new_var ( st, vary, "%s ( %s )", func_names[id], arg );
+    }
+
+  first = g_strdup_printf ( "v%d", st->nvars++ );
+  second = g_strdup_printf ( "v%d", st->nvars++ );
+  g_string_append_printf ( code, "%sdouble %s;\n", indent ( vary ), second );
+  g_string_append_printf ( code, "%sdouble %s = env->%s ( %s, &%s );\n",
+                           indent ( vary ), first, hyper ? "sinhcosh" : "sincos", arg, second );
+
+  name = ( ( id == MATHS_FUNC_ID_SIN ) || ( id == MATHS_FUNC_ID_SINH ) ) ? first : second;
+  g_hash_table_insert ( st->exprs, first_expr, first );
+  g_hash_table_insert ( st->exprs, second_expr, second );
+
+  return g_strdup ( name );
+}
+
+
+/*
+ * Translates the operation 'name' of the expression 'l' by the constant 'k'
+ * into a cheaper form than the generic one, as the interpreter lowers it.
+ * Returns NULL if there is none.
+ */
+static gchar *
+gen_constant_form ( CGEN_STATE  *st,
+                    const gint   vary,
+                    const gchar  name,
+                    const gchar *l,
+                    const gdouble k )
+{
+  gchar *res, *tmp, *lit;
+  gint e;
+
+  switch ( name )
+    {
+    case '^':
+      if ( k == 0.5 )
+        return new_var ( st, vary, "sqrt ( %s )", l );
+
+      if ( ( k != floor ( k ) ) || ( fabs ( k ) > 4.0 ) || ( k == 0.0 ) )
+        return NULL;
+
+      switch ( ABS ( (gint) k ) )
+        {
+        case 1:
+          res = g_strdup ( l );
+          break;
+
+        case 2:
+          res = new_var ( st, vary, "%s * %s", l, l );
+          break;
+
+        case 3:
+          tmp = new_var ( st, vary, "%s * %s", l, l );
+          res = new_var ( st, vary, "%s * %s", tmp, l );
+          g_free ( tmp );
+          break;
+
+        default:
+          tmp = new_var ( st, vary, "%s * %s", l, l );
+          res = new_var ( st, vary, "%s * %s", tmp, tmp );
+          g_free ( tmp );
+          break;
+        }
+
+      if ( k < 0.0 )
+        {
+          tmp = res;
+          res = new_var ( st, vary, "1.0 / %s", tmp );
+          g_free ( tmp );
+        }
+
+      return res;
+
+    case '/':
+      /* only when the reciprocal is exact */
+      if ( ( fabs ( frexp ( k, &e ) ) != 0.5 ) || !isnormal ( 1.0 / k ) )
+        return NULL;
+
+      lit = double_literal ( 1.0 / k );
+      res = new_var ( st, vary, "%s * %s", l, lit );
+      g_free ( lit );
+      return res;
+
+    case '%':
+      if ( !( k > (gdouble) G_MININT ) || !( k < (gdouble) G_MAXINT ) || ( (gint) k == 0 ) )
+        return NULL;
+
+      return new_var ( st, vary, "(double) ((int) %s %% %d)", l, (gint) k );
+    }
+
+  return NULL;
+}
+
+
+/*
+ * Translates an element (recursive), returns the C expression of its value
+ * or NULL if it can not be translated.
+ * 'vary' receives what the value varies with.
+ */
+static gchar *
+gen_element ( CGEN_STATE         *st,
+              MATHS_TREE_ELEMENT *el,
+              gint               *vary )
+{
+  GString *code;
+  gchar **args, *res, *tmp, *key;
+  gint i, argc, avary;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return NULL;
+
+  if ( el->exec == maths_val_exec )
+    {
+      MATHS_VALUE *val = (MATHS_VALUE *) el->data;
+
+      *vary = MATHS_PROG_VARY_NONE;
+
+      if ( val->precalc_code != PRECALC_NOT )
+        return double_literal ( *val->value );
+
+      switch ( val->id )
+        {
+        case MATHS_VAL_ID_X: *vary = MATHS_PROG_VARY_X; return g_strdup ( "x[i]" );
+        case MATHS_VAL_ID_Y: *vary = MATHS_PROG_VARY_Y; return g_strdup ( "y" );
+        case MATHS_VAL_ID_R: *vary = MATHS_PROG_VARY_PIXEL; return g_strdup ( "r[i]" );
+        case MATHS_VAL_ID_T: *vary = MATHS_PROG_VARY_PIXEL; return g_strdup ( "t[i]" );
+        case MATHS_VAL_ID_W: st->cg->w = val->value; return g_strdup ( "(*w)" );
+        case MATHS_VAL_ID_H: st->cg->h = val->value; return g_strdup ( "(*h)" );
+        }
+
+      return NULL;
+    }
+  else if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+      MATHS_VALUE *kval;
+      gchar *l, *r;
+      gint lvary, rvary;
+
+      if ( ( l = gen_element ( st, op->l, &lvary ) ) == NULL )
+        return NULL;
+
+      if ( ( op->r != NULL ) && ( op->r->exec == maths_val_exec ) )
+        {
+          kval = (MATHS_VALUE *) op->r->data;
+
+          if ( ( kval->precalc_code != PRECALC_NOT )
+               && ( ( res = gen_constant_form ( st, lvary, *op->name, l, *kval->value ) ) != NULL ) )
+            {
+              *vary = lvary;
+              g_free ( l );
+              return res;
+            }
+        }
+
+      if ( ( r = gen_element ( st, op->r, &rvary ) ) == NULL )
+        {
+          g_free ( l );
+          return NULL;
+        }
+
+      *vary = lvary | rvary;
+
+      switch ( *op->name )
+        {
+        case '+': res = new_var ( st, *vary, "%s + %s", l, r ); break;
+        case '-': res = new_var ( st, *vary, "%s - %s", l, r ); break;
+        case '*': res = new_var ( st, *vary, "%s * %s", l, r ); break;
+        case '/': res = new_var ( st, *vary, "%s / %s", l, r ); break;
+        case '^': res = new_var ( st, *vary, "pow ( %s, %s )", l, r ); break;
+        case '%': res = new_var ( st, *vary, "(double) ((int) %s %% (int) %s)", l, r ); break;
+        default:
+          res = NULL;
+          break;
+        }
+
+      g_free ( l );
+      g_free ( r );
+
+      return res;
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      if ( ( func->id < 0 ) || ( func->id >= MATHS_FUNC_ID_NONE ) )
+        return NULL;
+
+      argc = func->argc;
+      args = g_new0 ( gchar *, argc + 1 );
+      *vary = MATHS_PROG_VARY_NONE;
+
+      for ( i=0; i<argc; ++i )
+        {
+          if ( ( args[i] = gen_element ( st, func->argv[i], &avary ) ) == NULL )
+            {
+              g_strfreev ( args );
+              return NULL;
+            }
+
+          *vary |= avary;
+        }
+
+      /* the source may change between two rows, and rand() never repeats */
+      if ( ( func->id <= MATHS_FUNC_ID_RGB ) || ( func->id == MATHS_FUNC_ID_RAND ) )
+        *vary = MATHS_PROG_VARY_PIXEL;
+
+      res = NULL;
+
+      switch ( func->id )
+        {
+        case MATHS_FUNC_ID_RED:   res = new_var ( st, *vary, "env->red ( src, %s, %s )", args[0], args[1] ); break;
+        case MATHS_FUNC_ID_GRAY:  res = new_var ( st, *vary, "env->gray ( src, %s, %s )", args[0], args[1] ); break;
+        case MATHS_FUNC_ID_GREEN: res = new_var ( st, *vary, "env->green ( src, %s, %s )", args[0], args[1] ); break;
+        case MATHS_FUNC_ID_BLUE:  res = new_var ( st, *vary, "env->blue ( src, %s, %s )", args[0], args[1] ); break;
+        case MATHS_FUNC_ID_ALPHA: res = new_var ( st, *vary, "env->alpha ( src, %s, %s )", args[0], args[1] ); break;
+        case MATHS_FUNC_ID_RGB:   res = new_var ( st, *vary, "env->chan ( src, chan, %s, %s )", args[0], args[1] ); break;
+        case MATHS_FUNC_ID_RAND:  res = declare_var ( st, *vary, "env->rand ( )" ); break;
+        case MATHS_FUNC_ID_ATAN2: res = new_var ( st, *vary, "atan2 ( %s, %s )", args[0], args[1] ); break;
+
+        case MATHS_FUNC_ID_RAD:
+        case MATHS_FUNC_ID_DEG:
+          tmp = double_literal ( ( func->id == MATHS_FUNC_ID_RAD ) ? (G_PI/180.0) : (180.0/G_PI) );
+          res = new_var ( st, *vary, "%s * %s", args[0], tmp );
+          g_free ( tmp );
+          break;
+
+        case MATHS_FUNC_ID_MIN:
+        case MATHS_FUNC_ID_MAX:
+        case MATHS_FUNC_ID_AVG:
+          tmp = g_strjoinv ( ", ", args );
+          key = g_strdup_printf ( "%d ( %s )", func->id, tmp );
+          g_free ( tmp );
+
+          if ( ( res = g_hash_table_lookup ( st->exprs, key ) ) != NULL )
+            {
+              res = g_strdup ( res );
+              g_free ( key );
+              break;
+            }
+
+          switch ( func->id )
+            {
+            case MATHS_FUNC_ID_MIN: tmp = double_literal ( G_MAXDOUBLE ); break;
+            case MATHS_FUNC_ID_MAX: tmp = double_literal ( G_MINDOUBLE ); break;
+            default:                tmp = double_literal ( 0.0 ); break;
+            }
+
+          res = declare_var ( st, *vary, tmp );
+          g_hash_table_insert ( st->exprs, key, g_strdup ( res ) );
+          g_free ( tmp );
+
+          code = ( *vary & MATHS_PROG_VARY_X ) ? st->body : st->pre;
+
+          for ( i=0; i<argc; ++i )
+            switch ( func->id )
+              {
+              case MATHS_FUNC_ID_MIN: g_string_append_printf ( code, "%sif ( %s < %s ) %s = %s;\n", indent ( *vary ), args[i], res, res, args[i] ); break;
+              case MATHS_FUNC_ID_MAX: g_string_append_printf ( code, "%sif ( %s > %s ) %s = %s;\n", indent ( *vary ), args[i], res, res, args[i] ); break;
+              default:                g_string_append_printf ( code, "%s%s += %s;\n", indent ( *vary ), res, args[i] ); break;
+              }
+
+          if ( func->id == MATHS_FUNC_ID_AVG )
+            {
+              tmp = double_literal ( (gdouble) argc );
+              g_string_append_printf ( code, "%s%s = %s / %s;\n", indent ( *vary ), res, res, tmp );
+              g_free ( tmp );
+            }
+          break;
+
+        default:
+          if ( g_hash_table_lookup ( st->pairs, el ) != NULL )
+            res = gen_pair ( st, *vary, func->id, args[0] );
+          else if ( ( func_names[func->id] != NULL ) && ( argc == 1 ) )
+            res = new_var ( st, *vary, "%s ( %s )", func_names[func->id], args[0] );
+          break;
+        }
+
+      g_strfreev ( args );
+
+      return res;
+    }
+
+  return NULL;
+}
+
+
+/*
+ * Translates a tree into the source of a kernel.
+ */
+static gchar *
+gen_source ( MATHS_CGEN         *cg,
+             MATHS_TREE_ELEMENT *head )
+{
+  CGEN_STATE st;
+  GString *src;
+  gchar *res;
+  gint vary;
+
+  st.pre = g_string_new ( NULL );
+  st.body = g_string_new ( NULL );
+  st.nvars = 0;
+  st.exprs = g_hash_table_new_full ( g_str_hash, g_str_equal, g_free, g_free );
+  st.pairs = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  st.cg = cg;
+
+  find_pairs ( &st, head );
+  res = gen_element ( &st, head, &vary );
+  g_hash_table_destroy ( st.pairs );
+  g_hash_table_destroy ( st.exprs );
+
+  if ( res == NULL )
+    {
+      g_string_free ( st.pre, TRUE );
+      g_string_free ( st.body, TRUE );
+      return NULL;
+    }
+
+  src = g_string_new ( prelude );
+  g_string_append ( src, st.pre->str );
+  g_string_append ( src, "  for ( i=0; i<n; ++i )\n    {\n" );
+  g_string_append ( src, st.body->str );
+  g_string_append_printf ( src, "      out[i] = %s;\n    }\n}\n", res );
+
+  g_free ( res );
+  g_string_free ( st.pre, TRUE );
+  g_string_free ( st.body, TRUE );
+
+  return g_string_free ( src, FALSE );
+}
+
+
+/*
+ * Describes the processor, the kernels are optimized for it.
+ */
+static gchar *
+get_cpu_features ( void )
+{
+  GString *features = g_string_new ( G_STRINGIFY(G_BYTE_ORDER) );
+
+  g_string_append_printf ( features, " %d", (gint) GLIB_SIZEOF_VOID_P );
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+  __builtin_cpu_init ( );
+
+  if ( __builtin_cpu_supports ( "sse4.1" ) )
+    g_string_append ( features, " sse4.1" );
+  if ( __builtin_cpu_supports ( "sse4.2" ) )
+    g_string_append ( features, " sse4.2" );
+  if ( __builtin_cpu_supports ( "avx" ) )
+    g_string_append ( features, " avx" );
+  if ( __builtin_cpu_supports ( "avx2" ) )
+    g_string_append ( features, " avx2" );
+  if ( __builtin_cpu_supports ( "fma" ) )
+    g_string_append ( features, " fma" );
+  if ( __builtin_cpu_supports ( "avx512f" ) )
+    g_string_append ( features, " avx512f" );
+#endif
+
+  return g_string_free ( features, FALSE );
+}
+
+
+/*
+ * Describes the compiler: its version and the target 'cflags' resolve to.
+ * The compiler is only queried once.
+ */
+static const gchar *
+get_compiler_target ( gchar **compiler )
+{
+  static const gchar *queries[][4] =
+    {
+      { "--version", NULL },
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+      { "-march=native", "-Q", "--help=target", NULL },
+#endif
+    };
+  static GMutex lock;
+  static gchar *target = NULL;
+  GString *str;
+  GPtrArray *argv;
+  gchar *out;
+  guint i, j;
+
+  g_mutex_lock ( &lock );
+
+  if ( target == NULL )
+    {
+      str = g_string_new ( NULL );
+
+      for ( i=0; i<G_N_ELEMENTS ( queries ); ++i )
+        {
+          argv = g_ptr_array_new ( );
+
+          for ( j=0; compiler[j]!=NULL; ++j )
+            g_ptr_array_add ( argv, compiler[j] );
+
+          for ( j=0; queries[i][j]!=NULL; ++j )
+            g_ptr_array_add ( argv, (gpointer) queries[i][j] );
+
+          g_ptr_array_add ( argv, NULL );
+
+          if ( g_spawn_sync ( NULL, (gchar **) argv->pdata, NULL,
+                              G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                              NULL, NULL, &out, NULL, NULL, NULL ) )
+            {
+              g_string_append ( str, out );
+              g_free ( out );
+            }
+
+          g_ptr_array_free ( argv, TRUE );
+        }
+
+      target = g_string_free ( str, FALSE );
+    }
+
+  g_mutex_unlock ( &lock );
+
+  return target;
+}
+
+
+/*
+ * Returns the compiler command line, from $CC if it is set.
+ */
+static gchar **
+get_compiler ( void )
+{
+  const gchar *cc = g_getenv ( "CC" );
+  gchar **argv = NULL;
+
+  if ( ( cc == NULL ) || !g_shell_parse_argv ( cc, NULL, &argv, NULL ) )
+    argv = g_strsplit ( "cc", " ", -1 );
+
+  return argv;
+}
+
+
+/*
+ * Compiles a source file into a shared object, the object appears at once
+ * under its final name so that other instances never load it half written.
+ */
+static gboolean
+build_object ( gchar       **compiler,
+               const gchar  *src_path,
+               const gchar  *so_path )
+{
+  GPtrArray *argv;
+  gchar *tmp_path;
+  gint i, status;
+  gboolean ok;
+
+  tmp_path = g_strdup_printf ( "%s.%d.tmp", so_path, (gint) getpid ( ) );
+  argv = g_ptr_array_new ( );
+
+  for ( i=0; compiler[i]!=NULL; ++i )
+    g_ptr_array_add ( argv, compiler[i] );
+
+  for ( i=0; cflags[i]!=NULL; ++i )
+    g_ptr_array_add ( argv, (gpointer) cflags[i] );
+
+  g_ptr_array_add ( argv, "-o" );
+  g_ptr_array_add ( argv, tmp_path );
+  g_ptr_array_add ( argv, (gpointer) src_path );
+  g_ptr_array_add ( argv, "-lm" );
+  g_ptr_array_add ( argv, NULL );
+
+  ok = g_spawn_sync ( NULL, (gchar **) argv->pdata, NULL,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                      NULL, NULL, NULL, NULL, &status, NULL )
+       && g_spawn_check_exit_status ( status, NULL )
+       && ( g_rename ( tmp_path, so_path ) == 0 );
+
+  if ( !ok )
+    g_unlink ( tmp_path );
+
+  g_ptr_array_free ( argv, TRUE );
+  g_free ( tmp_path );
+
+  return ok;
+}
+
+
+/*
+ * Translates a tree into C, then compiles and loads it unless the cache
+ * already holds the object.
+ */
+MATHS_CGEN *
+maths_cgen_compile ( MATHS_TREE_ELEMENT *head )
+{
+  MATHS_CGEN *cg;
+  gchar *source, *features, *key_str, *key, *dir, *name, *src_path, *so_path;
+  gchar **compiler;
+  gpointer symbol;
+
+  if ( !g_module_supported ( ) )
+    return NULL;
+
+  cg = g_new0 ( MATHS_CGEN, 1 );
+
+  if ( ( source = gen_source ( cg, head ) ) == NULL )
+    {
+      g_free ( cg );
+      return NULL;
+    }
+
+  /* the object depends on the code, the compiler and the processor */
+  compiler = get_compiler ( );
+  features = get_cpu_features ( );
+  key_str = g_strjoin ( "\n", MATHS_CGEN_VERSION, features, compiler[0],
+                        get_compiler_target ( compiler ), source, NULL );
+  key = g_compute_checksum_for_string ( G_CHECKSUM_SHA256, key_str, -1 );
+
+  dir = g_build_filename ( g_get_user_cache_dir ( ), "gimp-plugin-formulas", NULL );
+  name = g_strconcat ( key, ".c", NULL );
+  src_path = g_build_filename ( dir, name, NULL );
+  g_free ( name );
+  name = g_strconcat ( key, "." G_MODULE_SUFFIX, NULL );
+  so_path = g_build_filename ( dir, name, NULL );
+  g_free ( name );
+
+  if ( !g_file_test ( so_path, G_FILE_TEST_EXISTS ) )
+    {
+      if ( ( g_mkdir_with_parents ( dir, 0700 ) != 0 )
+           || !g_file_set_contents ( src_path, source, -1, NULL )
+           || !build_object ( compiler, src_path, so_path ) )
+        {
+#ifdef VERBOSE
+          error ( "maths_cgen_compile", _("unable to compile the formula") );
+#endif
+        }
+
+      g_unlink ( src_path );
+    }
+
+  cg->module = g_module_open ( so_path, G_MODULE_BIND_LOCAL );
+
+  if ( ( cg->module == NULL ) || !g_module_symbol ( cg->module, "formulas_kernel", &symbol ) )
+    {
+      if ( cg->module != NULL )
+        g_module_close ( cg->module );
+
+      g_free ( cg );
+      cg = NULL;
+    }
+  else
+    cg->kernel = (MATHS_CGEN_KERNEL) symbol;
+
+  g_free ( so_path );
+  g_free ( src_path );
+  g_free ( dir );
+  g_free ( key );
+  g_free ( key_str );
+  g_free ( features );
+  g_strfreev ( compiler );
+  g_free ( source );
+
+  return cg;
+}
+
+
+/*
+ * Runs a kernel over a row.
+ */
+void
+maths_cgen_exec_row ( const MATHS_CGEN *cg,
+                      const MATHS_ROW  *row,
+                      gdouble          *out )
+{
+  static const MATHS_CGEN_ENV env =
+    {
+      source_get_red, source_get_gray, source_get_green, source_get_blue,
+      source_get_alpha, source_get_chan, g_random_double,
+      maths_prog_sincos, maths_prog_sinhcosh
+    };
+
+  cg->kernel ( row->n, row->x, row->y, row->r, row->t, cg->w, cg->h,
+               row->source, row->chan, out, &env );
+}
+
+
+/*
+ * Unloads a kernel.
+ */
+void
+maths_cgen_free ( MATHS_CGEN *cg )
+{
+  if ( cg == NULL )
+    return;
+
+  g_module_close ( cg->module );
+  g_free ( cg );
+}
@@ -0,0 +1,91 @@
+/*
+ * maths_cgen.h
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef __MATHS_CGEN_H__
+#define __MATHS_CGEN_H__
+
+
+#ifndef __MATHS_TREE_H__
+#include "maths_tree.h"
+#endif
+
+#ifndef __MATHS_PROG_H__
+#include "maths_prog.h"
+#endif
+
+#include <gmodule.h>
+
+
+/* Functions of the plug-in called by the kernels (the generated code
+   declares the same structure) */
+typedef struct maths_cgen_env_t
+{
+  gdouble  ( *red )   ( const struct pixel_source_t *src, gdouble x, gdouble y );
+  gdouble  ( *gray )  ( const struct pixel_source_t *src, gdouble x, gdouble y );
+  gdouble  ( *green ) ( const struct pixel_source_t *src, gdouble x, gdouble y );
+  gdouble  ( *blue )  ( const struct pixel_source_t *src, gdouble x, gdouble y );
+  gdouble  ( *alpha ) ( const struct pixel_source_t *src, gdouble x, gdouble y );
+  gdouble  ( *chan )  ( const struct pixel_source_t *src, gint chan, gdouble x, gdouble y );
+  gdouble  ( *rand )  ( void );
+  gdouble  ( *sincos )   ( const gdouble a, gdouble *c );
+  gdouble  ( *sinhcosh ) ( const gdouble a, gdouble *c );
+} MATHS_CGEN_ENV ;
+
+
+/* Kernel: evaluates a formula over a row of n pixels */
+typedef void ( *MATHS_CGEN_KERNEL ) ( gint                          n,
+                                      const gdouble                *x,
+                                      gdouble                       y,
+                                      const gdouble                *r,
+                                      const gdouble                *t,
+                                      const gdouble                *w,
+                                      const gdouble                *h,
+                                      const struct pixel_source_t  *src,
+                                      gint                          chan,
+                                      gdouble                      *out,
+                                      const MATHS_CGEN_ENV         *env );
+
+
+/* Formula compiled by the system C compiler */
+typedef struct maths_cgen_t
+{
+  GModule            *module;
+  MATHS_CGEN_KERNEL   kernel;
+  const gdouble      *w;       /* values the formula reads w and h from */
+  const gdouble      *h;
+} MATHS_CGEN ;
+
+
+/* Translates a tree into C, and loads the shared object the system compiler
+   makes of it; the objects are kept in the user's cache directory, so that a
+   formula is only compiled once. Returns NULL if anything fails */
+MATHS_CGEN *maths_cgen_compile ( MATHS_TREE_ELEMENT *head );
+
+/* Runs a kernel over a whole row, writing row->n results to out */
+void maths_cgen_exec_row ( const MATHS_CGEN *cg, const MATHS_ROW *row, gdouble *out );
+
+/* Unloads a kernel */
+void maths_cgen_free ( MATHS_CGEN *cg );
+
+
+#endif
@@ -55,6 +55,32 @@ maths_func_exec ( gpointer data )
 }
 
 
+/* Tells whether a pixel function reads the pixel being rendered, as in red(x,y) */
+gboolean
+maths_func_reads_pixel ( MATHS_FUNCTION *func )
+{
+  gint i;
+  MATHS_VALUE *val;
+  static const gint ids[2] = { MATHS_VAL_ID_X, MATHS_VAL_ID_Y };
+
+  if ( func->argc != 2 )
+    return FALSE;
+
+  for (i=0; i<2; ++i)
+    {
+      if ( ( func->argv[i] == NULL ) || ( func->argv[i]->exec != maths_val_exec ) )
+        return FALSE;
+
+      val = (MATHS_VALUE *) func->argv[i]->data;
+
+      if ( ( val->precalc_code != PRECALC_NOT ) || ( val->id != ids[i] ) )
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+
 /* XML dump of a function */
 gint
 maths_func_dump_xml ( FILE *output,
@@ -71,7 +97,7 @@ maths_func_dump_xml ( FILE *output,
 
   for (i=0; i<func->argc; ++i)
     {
-      arg = g_ptr_array_index ( func->argv, i );
+      arg = func->argv[i];
 
       if ( arg != NULL )
         {
@@ -87,15 +113,13 @@ maths_func_dump_xml ( FILE *output,
 
 /* Precalculation */
 gint
-maths_func_precalc ( gpointer data )
+maths_func_precalc ( gpointer     data,
+                     MATHS_ARENA *arena )
 {
   gint i;
   gint *arg_precalc;
   gint global_precalc;
-  GPtrArray *new_argv;
   MATHS_TREE_ELEMENT *arg;
-  MATHS_TREE_ELEMENT *el;
-  MATHS_VALUE *val;
   MATHS_FUNCTION *func = (MATHS_FUNCTION *) data;
 
   if ( func->argc == 0 )
@@ -106,8 +130,8 @@ maths_func_precalc ( gpointer data )
 
   for (i=0; i<func->argc; ++i)
     {
-      arg = g_ptr_array_index ( func->argv, i );
-      arg_precalc[i] = arg->precalc ( arg->data );
+      arg = func->argv[i];
+      arg_precalc[i] = arg->precalc ( arg->data, arena );
 
       if ( arg_precalc[i] == PRECALC_NOT )
         global_precalc = PRECALC_NOT;
@@ -120,146 +144,103 @@ maths_func_precalc ( gpointer data )
       return PRECALC_OK;
     }
 
-  new_argv = g_ptr_array_new ( );
-
+  /* the arguments replaced remain in the arena until the formula is destroyed */
   for (i=0; i<func->argc; ++i)
     {
-      arg = g_ptr_array_index ( func->argv, i );
+      arg = func->argv[i];
 
       if ( arg_precalc[i] == PRECALC_OK )
-        {
-          val = maths_val_alloc ( );
-          val->value = (gdouble *) g_malloc ( sizeof(gdouble) );
-          (*val->value) = arg->exec ( arg->data );
-
-          el = (MATHS_TREE_ELEMENT *) g_malloc ( sizeof(MATHS_TREE_ELEMENT) );
-          el->data = ( gpointer ) val;
-          el->exec = maths_val_exec;
-          el->dump_xml = maths_val_dump_xml;
-          el->precalc = maths_val_precalc;
-          el->free = maths_val_free;
-          arg->free ( arg->data );
-          g_free ( arg );
-          arg = el;
-        }
-      
-      g_ptr_array_add ( new_argv, arg );
+        func->argv[i] = maths_val_new_constant ( arena, arg->exec ( arg->data ) );
     }
 
-  g_ptr_array_free ( func->argv, FALSE );
-  func->argv = new_argv;
   g_free ( arg_precalc );
   return PRECALC_NOT;
 }
 
 
-/* Memory desallocation of a function */
-void
-maths_func_free ( gpointer data )
-{
-  gint i;
-  MATHS_TREE_ELEMENT *arg;
-  MATHS_FUNCTION *func =  (MATHS_FUNCTION *) data;
-
-  for (i=0; i<func->argc; ++i)
-    {
-      arg = g_ptr_array_index ( func->argv, i );
-
-      if ( arg != NULL )
-        {
-          arg->free ( arg->data );
-          g_free ( arg );
-        }
-    }
-
-  if ( func->argv != NULL )
-    g_ptr_array_free ( func->argv, FALSE );
-}
-
-
 static gdouble
-dred ( const gint argc, GPtrArray *argv )
+dred ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   MATHS_TREE_ELEMENT *x, *y;
 
-  x = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  y = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  x = argv[0];
+  y = argv[1];
 
   return get_red_at ( x->exec(x->data), y->exec(y->data) );
 }
 
 static gdouble
-dgray ( const gint argc, GPtrArray *argv )
+dgray ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   MATHS_TREE_ELEMENT *x, *y;
 
-  x = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  y = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  x = argv[0];
+  y = argv[1];
 
   return get_gray_at ( x->exec(x->data), y->exec(y->data) );
 }
 
 static gdouble
-dgreen ( const gint argc, GPtrArray *argv )
+dgreen ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
 MATHS_TREE_ELEMENT *x, *y;
 
-  x = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  y = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  x = argv[0];
+  y = argv[1];
 
   return get_green_at ( x->exec(x->data), y->exec(y->data) );
 }
 
 static gdouble
-dblue ( const gint argc, GPtrArray *argv )
+dblue ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   MATHS_TREE_ELEMENT *x, *y;
 
-  x = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  y = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  x = argv[0];
+  y = argv[1];
 
   return get_blue_at ( x->exec(x->data), y->exec(y->data) );
 }
 
 static gdouble
-dalpha ( const gint argc, GPtrArray *argv )
+dalpha ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   MATHS_TREE_ELEMENT *x, *y;
 
-  x = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  y = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  x = argv[0];
+  y = argv[1];
 
   return get_alpha_at ( x->exec(x->data), y->exec(y->data) );
 }
 
 static gdouble
-drgb ( const gint argc, GPtrArray *argv )
+drgb ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   MATHS_TREE_ELEMENT *x, *y;
 
-  x = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  y = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  x = argv[0];
+  y = argv[1];
 
   return get_rgb_at ( x->exec(x->data), y->exec(y->data) );
 }
 
 static gdouble
-drand ( const gint argc, GPtrArray *argv )
+drand ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   return g_random_double ( );
 }
 
 static gdouble
-dabs ( const gint argc, GPtrArray *argv )
+dabs ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return fabs ( arg->exec(arg->data) );
 }
 
 static gdouble
-dsign ( const gint argc, GPtrArray *argv )
+dsign ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   gdouble d = arg->exec ( arg->data );
 
   if ( d == 0.0 )
@@ -271,169 +252,169 @@ dsign ( const gint argc, GPtrArray *argv )
 }
 
 static gdouble
-dsin ( const gint argc, GPtrArray *argv )
+dsin ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return sin ( arg->exec(arg->data) );
 }
 
 static gdouble
-dsinh ( const gint argc, GPtrArray *argv )
+dsinh ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return sinh ( arg->exec(arg->data) );
 }
 
 static gdouble
-dasin ( const gint argc, GPtrArray *argv )
+dasin ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return asin ( arg->exec(arg->data) );
 }
 
 static gdouble
-dasinh ( const gint argc, GPtrArray *argv )
+dasinh ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return asinh ( arg->exec(arg->data) );
 }
 
 static gdouble
-dcos ( const gint argc, GPtrArray *argv )
+dcos ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return cos ( arg->exec(arg->data) );
 }
 
 static gdouble
-dcosh ( const gint argc, GPtrArray *argv )
+dcosh ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return cosh ( arg->exec(arg->data) );
 }
 
 static gdouble
-dacos ( const gint argc, GPtrArray *argv )
+dacos ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return acos ( arg->exec(arg->data) );
 }
 
 static gdouble
-dacosh ( const gint argc, GPtrArray *argv )
+dacosh ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return acosh ( arg->exec(arg->data) );
 }
 
 static gdouble
-dtan ( const gint argc, GPtrArray *argv )
+dtan ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return tan ( arg->exec(arg->data) );
 }
 
 static gdouble
-dtanh ( const gint argc, GPtrArray *argv )
+dtanh ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return tanh ( arg->exec(arg->data) );
 }
 
 static gdouble
-datan ( const gint argc, GPtrArray *argv )
+datan ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return atan ( arg->exec(arg->data) );
 }
 
 static gdouble
-datan2 ( const gint argc, GPtrArray *argv )
+datan2 ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg0 = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
-  MATHS_TREE_ELEMENT *arg1 = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 1 ) ));
+  MATHS_TREE_ELEMENT *arg0 = argv[0];
+  MATHS_TREE_ELEMENT *arg1 = argv[1];
   return atan2 ( arg0->exec(arg0->data), arg1->exec(arg1->data) );
 }
 
 static gdouble
-datanh ( const gint argc, GPtrArray *argv )
+datanh ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return atanh ( arg->exec(arg->data) );
 }
 
 static gdouble
-drad ( const gint argc, GPtrArray *argv )
+drad ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return ( arg->exec(arg->data) * (G_PI/180.0) );
 }
 
 static gdouble
-ddeg ( const gint argc, GPtrArray *argv )
+ddeg ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return ( arg->exec(arg->data) * (180.0/G_PI) );
 }
 
 static gdouble
-dsqrt ( const gint argc, GPtrArray *argv )
+dsqrt ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return sqrt ( arg->exec(arg->data) );
 }
 
 static gdouble
-dcbrt ( const gint argc, GPtrArray *argv )
+dcbrt ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return cbrt ( arg->exec(arg->data) );
 }
 
 static gdouble
-dlog ( const gint argc, GPtrArray *argv )
+dlog ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return log ( arg->exec(arg->data) );
 }
 
 static gdouble
-dlog2 ( const gint argc, GPtrArray *argv )
+dlog2 ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return log2 ( arg->exec(arg->data) );
 }
 
 static gdouble
-dlog10 ( const gint argc, GPtrArray *argv )
+dlog10 ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return log10 ( arg->exec(arg->data) );
 }
 
 static gdouble
-dexp ( const gint argc, GPtrArray *argv )
+dexp ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return exp ( arg->exec(arg->data) );
 }
 
 static gdouble
-dceil ( const gint argc, GPtrArray *argv )
+dceil ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return ceil ( arg->exec(arg->data) );
 }
 
 static gdouble
-dround ( const gint argc, GPtrArray *argv )
+dround ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
-  MATHS_TREE_ELEMENT *arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, 0 ) ));
+  MATHS_TREE_ELEMENT *arg = argv[0];
   return ( round ( arg->exec ( arg->data ) ) );
 }
 
 static gdouble
-dmin ( const gint argc, GPtrArray *argv )
+dmin ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   gint i;
   MATHS_TREE_ELEMENT *arg;
@@ -443,7 +424,7 @@ dmin ( const gint argc, GPtrArray *argv )
 
   for (i=0; i<argc; ++i)
     {
-      arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, i ) ));
+      arg = argv[i];
       tmp = arg->exec ( arg->data );
 
       if ( tmp < min )
@@ -454,7 +435,7 @@ dmin ( const gint argc, GPtrArray *argv )
 }
 
 static gdouble
-dmax ( const gint argc, GPtrArray *argv )
+dmax ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   gint i;
   MATHS_TREE_ELEMENT *arg;
@@ -464,7 +445,7 @@ dmax ( const gint argc, GPtrArray *argv )
 
   for (i=0; i<argc; ++i)
     {
-      arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, i ) ));
+      arg = argv[i];
       tmp = arg->exec ( arg->data );
 
       if ( tmp > max )
@@ -475,7 +456,7 @@ dmax ( const gint argc, GPtrArray *argv )
 }
 
 static gdouble
-davg ( const gint argc, GPtrArray *argv )
+davg ( const gint argc, MATHS_TREE_ELEMENT **argv )
 {
   gint i;
   MATHS_TREE_ELEMENT *arg;
@@ -485,7 +466,7 @@ davg ( const gint argc, GPtrArray *argv )
 
   for (i=0; i<argc; ++i)
     {
-      arg = ( (MATHS_TREE_ELEMENT *) ( g_ptr_array_index ( argv, i ) ));
+      arg = argv[i];
       avg += arg->exec ( arg->data );
     }
 
@@ -495,40 +476,40 @@ davg ( const gint argc, GPtrArray *argv )
 
 MATHS_FUNCTION functions[] = 
   {
-    {"red(",   "Red channel value at x, y coordinates",                PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dred},
-    {"gray(",  "Gray channel value at x, y coordinates",               PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dgray},
-    {"green(", "Green channel value at x, y coordinates",              PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dgreen},
-    {"blue(",  "Blue channel value at x, y coordinates",               PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dblue},
-    {"alpha(", "Alpha channel value at x, y coordinates",              PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dalpha},
-    {"rgb(",   "Red, Green or Blue channel value at x, y coordinates", PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &drgb},
-    {"rand(",  "Random value between 0.0 and 1.0",                     PRECALC_NOT, MATHS_FUNC_NO_ARG,  NULL, &drand},
-    {"abs(",   "Absolute value",                                       PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dabs},
-    {"sign(",  "Sign of the value",                                    PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsign},
-    {"sin(",   "Sine",                                                 PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsin},
-    {"sinh(",  "Hyperbolic sine",                                      PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsinh},
-    {"asin(",  "Arc sine",                                             PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dasin},
-    {"asinh(", "Arc hyperbolic",                                       PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dasinh},
-    {"cos(",   "Cosine",                                               PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dcos},
-    {"cosh(",  "Hyperbolic cosine",                                    PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dcosh},
-    {"acos(",  "Arc cosine",                                           PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dacos},
-    {"acosh(", "Arc hyperbolic cosine",                                PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dacosh},
-    {"tan(",   "Tangent",                                              PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dtan},
-    {"tanh(",  "Hyperbolic tangent",                                   PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dtanh},
-    {"atan(",  "Arc tangent",                                          PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &datan},
-    {"atan2(", "Arc tangent with correct quadrant",                    PRECALC_OK,  MATHS_FUNC_TWO_ARG, NULL, &datan2},
-    {"atanh(", "Arc hyperbolic tangent",                               PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &datanh},
-    {"rad(",   "To radians conversion",                                PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &drad},
-    {"deg(",   "To degrees conversion",                                PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &ddeg},
-    {"sqrt(",  "Square root",                                          PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsqrt},
-    {"cbrt(",  "Cube root",                                            PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dcbrt},
-    {"log(",   "Natural logarithmic",                                  PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dlog},
-    {"log2(",  "Base-2 logarithmic",                                   PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dlog2},
-    {"log10(", "Base-10 logarithmic",                                  PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dlog10},
-    {"exp(",   "Base-e exponential",                                   PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dexp},
-    {"ceil(",  "Smallest integral value not less than argument",       PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dceil},
-    {"round(", "Round to nearest integer, away from zero",             PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dround},
-    {"min(",   "Minimal value",                                        PRECALC_OK,  MATHS_FUNC_N_ARG,   NULL, &dmin},
-    {"max(",   "Maximal value",                                        PRECALC_OK,  MATHS_FUNC_N_ARG,   NULL, &dmax},
-    {"avg(",   "Average value",                                        PRECALC_OK,  MATHS_FUNC_N_ARG,   NULL, &davg},
-    {NULL,     NULL,                                                   PRECALC_NOT, MATHS_FUNC_NO_ARG,  NULL, NULL}
+    {"red(",   "Red channel value at x, y coordinates",                PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dred,    MATHS_FUNC_ID_RED},
+    {"gray(",  "Gray channel value at x, y coordinates",               PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dgray,   MATHS_FUNC_ID_GRAY},
+    {"green(", "Green channel value at x, y coordinates",              PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dgreen,  MATHS_FUNC_ID_GREEN},
+    {"blue(",  "Blue channel value at x, y coordinates",               PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dblue,   MATHS_FUNC_ID_BLUE},
+    {"alpha(", "Alpha channel value at x, y coordinates",              PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &dalpha,  MATHS_FUNC_ID_ALPHA},
+    {"rgb(",   "Red, Green or Blue channel value at x, y coordinates", PRECALC_NOT, MATHS_FUNC_TWO_ARG, NULL, &drgb,    MATHS_FUNC_ID_RGB},
+    {"rand(",  "Random value between 0.0 and 1.0",                     PRECALC_NOT, MATHS_FUNC_NO_ARG,  NULL, &drand,   MATHS_FUNC_ID_RAND},
+    {"abs(",   "Absolute value",                                       PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dabs,    MATHS_FUNC_ID_ABS},
+    {"sign(",  "Sign of the value",                                    PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsign,   MATHS_FUNC_ID_SIGN},
+    {"sin(",   "Sine",                                                 PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsin,    MATHS_FUNC_ID_SIN},
+    {"sinh(",  "Hyperbolic sine",                                      PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsinh,   MATHS_FUNC_ID_SINH},
+    {"asin(",  "Arc sine",                                             PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dasin,   MATHS_FUNC_ID_ASIN},
+    {"asinh(", "Arc hyperbolic",                                       PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dasinh,  MATHS_FUNC_ID_ASINH},
+    {"cos(",   "Cosine",                                               PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dcos,    MATHS_FUNC_ID_COS},
+    {"cosh(",  "Hyperbolic cosine",                                    PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dcosh,   MATHS_FUNC_ID_COSH},
+    {"acos(",  "Arc cosine",                                           PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dacos,   MATHS_FUNC_ID_ACOS},
+    {"acosh(", "Arc hyperbolic cosine",                                PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dacosh,  MATHS_FUNC_ID_ACOSH},
+    {"tan(",   "Tangent",                                              PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dtan,    MATHS_FUNC_ID_TAN},
+    {"tanh(",  "Hyperbolic tangent",                                   PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dtanh,   MATHS_FUNC_ID_TANH},
+    {"atan(",  "Arc tangent",                                          PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &datan,   MATHS_FUNC_ID_ATAN},
+    {"atan2(", "Arc tangent with correct quadrant",                    PRECALC_OK,  MATHS_FUNC_TWO_ARG, NULL, &datan2,  MATHS_FUNC_ID_ATAN2},
+    {"atanh(", "Arc hyperbolic tangent",                               PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &datanh,  MATHS_FUNC_ID_ATANH},
+    {"rad(",   "To radians conversion",                                PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &drad,    MATHS_FUNC_ID_RAD},
+    {"deg(",   "To degrees conversion",                                PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &ddeg,    MATHS_FUNC_ID_DEG},
+    {"sqrt(",  "Square root",                                          PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dsqrt,   MATHS_FUNC_ID_SQRT},
+    {"cbrt(",  "Cube root",                                            PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dcbrt,   MATHS_FUNC_ID_CBRT},
+    {"log(",   "Natural logarithmic",                                  PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dlog,    MATHS_FUNC_ID_LOG},
+    {"log2(",  "Base-2 logarithmic",                                   PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dlog2,   MATHS_FUNC_ID_LOG2},
+    {"log10(", "Base-10 logarithmic",                                  PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dlog10,  MATHS_FUNC_ID_LOG10},
+    {"exp(",   "Base-e exponential",                                   PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dexp,    MATHS_FUNC_ID_EXP},
+    {"ceil(",  "Smallest integral value not less than argument",       PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dceil,   MATHS_FUNC_ID_CEIL},
+    {"round(", "Round to nearest integer, away from zero",             PRECALC_OK,  MATHS_FUNC_ONE_ARG, NULL, &dround,  MATHS_FUNC_ID_ROUND},
+    {"min(",   "Minimal value",                                        PRECALC_OK,  MATHS_FUNC_N_ARG,   NULL, &dmin,    MATHS_FUNC_ID_MIN},
+    {"max(",   "Maximal value",                                        PRECALC_OK,  MATHS_FUNC_N_ARG,   NULL, &dmax,    MATHS_FUNC_ID_MAX},
+    {"avg(",   "Average value",                                        PRECALC_OK,  MATHS_FUNC_N_ARG,   NULL, &davg,    MATHS_FUNC_ID_AVG},
+    {NULL,     NULL,                                                   PRECALC_NOT, MATHS_FUNC_NO_ARG,  NULL, NULL,     MATHS_FUNC_ID_NONE}
   };
@@ -37,18 +37,19 @@ double round ( double x );
 
 
 /* Types */
-typedef gdouble ( maths_func_f )      ( const gint argc, GPtrArray *argv );
+typedef gdouble ( maths_func_f )      ( const gint argc, MATHS_TREE_ELEMENT **argv );
 
 
 /* Structures */
 typedef struct maths_function_t
 {
-  gchar        *name;
-  gchar        *desc;
-  gint          precalc_code;
-  gint          argc;
-  GPtrArray    *argv;
-  maths_func_f *function;
+  gchar                *name;
+  gchar                *desc;
+  gint                  precalc_code;
+  gint                  argc;
+  MATHS_TREE_ELEMENT  **argv;
+  maths_func_f         *function;
+  gint                  id;
 } MATHS_FUNCTION ;
 
 
@@ -56,11 +57,26 @@ typedef struct maths_function_t
 enum { MATHS_FUNC_NO_ARG, MATHS_FUNC_ONE_ARG, MATHS_FUNC_TWO_ARG, MATHS_FUNC_N_OR_NO_ARG, MATHS_FUNC_N_ARG };
 
 
+/* Function identifiers (used by the compilers to recognize a function) */
+enum
+{
+  MATHS_FUNC_ID_RED, MATHS_FUNC_ID_GRAY, MATHS_FUNC_ID_GREEN, MATHS_FUNC_ID_BLUE,
+  MATHS_FUNC_ID_ALPHA, MATHS_FUNC_ID_RGB, MATHS_FUNC_ID_RAND, MATHS_FUNC_ID_ABS,
+  MATHS_FUNC_ID_SIGN, MATHS_FUNC_ID_SIN, MATHS_FUNC_ID_SINH, MATHS_FUNC_ID_ASIN,
+  MATHS_FUNC_ID_ASINH, MATHS_FUNC_ID_COS, MATHS_FUNC_ID_COSH, MATHS_FUNC_ID_ACOS,
+  MATHS_FUNC_ID_ACOSH, MATHS_FUNC_ID_TAN, MATHS_FUNC_ID_TANH, MATHS_FUNC_ID_ATAN,
+  MATHS_FUNC_ID_ATAN2, MATHS_FUNC_ID_ATANH, MATHS_FUNC_ID_RAD, MATHS_FUNC_ID_DEG,
+  MATHS_FUNC_ID_SQRT, MATHS_FUNC_ID_CBRT, MATHS_FUNC_ID_LOG, MATHS_FUNC_ID_LOG2,
+  MATHS_FUNC_ID_LOG10, MATHS_FUNC_ID_EXP, MATHS_FUNC_ID_CEIL, MATHS_FUNC_ID_ROUND,
+  MATHS_FUNC_ID_MIN, MATHS_FUNC_ID_MAX, MATHS_FUNC_ID_AVG, MATHS_FUNC_ID_NONE
+};
+
+
 /* Functions prototypes */
 gdouble  maths_func_exec     ( gpointer data );
+gboolean maths_func_reads_pixel ( MATHS_FUNCTION *func );
 gint     maths_func_dump_xml ( FILE *output, gint index, gpointer data );
-gint     maths_func_precalc  ( gpointer data );
-void     maths_func_free     ( gpointer data );
+gint     maths_func_precalc  ( gpointer data, MATHS_ARENA *arena );
 
 
 /* Defined functions */
@@ -0,0 +1,667 @@
+/*
+ * maths_jit.c
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include "maths_val.h"
+#include "maths_prog.h"
+#include "maths_jit.h"
+
+#ifdef MATHS_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+
+#ifdef MATHS_JIT_X86_64
+
+/* Accessors to channel value of a given source */
+extern gdouble source_get_red ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_gray ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_green ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_blue ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_alpha ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_chan ( const struct pixel_source_t *, gint, gdouble, gdouble );
+
+
+/*
+ * The kernels are generated for the System V ABI, they use:
+ *   r14     the row
+ *   r12     the offset of the current pixel (i*8)
+ *   r13     the offset of the end of the row (n*8)
+ *   [rsp]   the address of the first lane of each register
+ *   xmm0    the result of the instruction, xmm1 the second operand
+ * r12 to r14 are preserved by the functions called, xmm0 keeps the value of
+ * the last register stored so that it is not reloaded.
+ */
+
+/* appends the given bytes to the code */
+#define EMIT(C, ...)  { const guint8 b_[] = { __VA_ARGS__ }; g_byte_array_append ( (C), b_, sizeof(b_) ); }
+
+/* SSE2 scalar instructions: xmm0 = xmm0 op xmm1 */
+#define SSE_ADDSD 0x58
+#define SSE_MULSD 0x59
+#define SSE_SUBSD 0x5C
+#define SSE_MINSD 0x5D
+#define SSE_DIVSD 0x5E
+#define SSE_MAXSD 0x5F
+
+
+/*
+ * Appends a 32 bits value.
+ */
+static void
+emit_u32 ( GByteArray    *c,
+           const guint32  v )
+{
+  EMIT ( c, v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, (v >> 24) & 0xFF );
+}
+
+
+/*
+ * Appends a 64 bits value.
+ */
+static void
+emit_u64 ( GByteArray    *c,
+           const guint64  v )
+{
+  emit_u32 ( c, (guint32) v );
+  emit_u32 ( c, (guint32) (v >> 32) );
+}
+
+
+/*
+ * Loads the current lane of a register into xmm0 or xmm1.
+ */
+static void
+emit_load ( GByteArray *c,
+            const gint  xmm,
+            const gint  reg )
+{
+  /* mov rax, [rsp+reg*8] ; movsd xmm, [rax+r12] */
+  EMIT ( c, 0x48, 0x8B, 0x84, 0x24 );
+  emit_u32 ( c, reg * 8 );
+  EMIT ( c, 0xF2, 0x42, 0x0F, 0x10, 0x04 | (xmm << 3), 0x20 );
+}
+
+
+/*
+ * Stores xmm0 into the current lane of a register.
+ */
+static void
+emit_store ( GByteArray *c,
+             const gint  reg )
+{
+  /* mov rax, [rsp+reg*8] ; movsd [rax+r12], xmm0 */
+  EMIT ( c, 0x48, 0x8B, 0x84, 0x24 );
+  emit_u32 ( c, reg * 8 );
+  EMIT ( c, 0xF2, 0x42, 0x0F, 0x11, 0x04, 0x20 );
+}
+
+
+/*
+ * Loads a constant into xmm0 or xmm1.
+ */
+static void
+emit_const ( GByteArray    *c,
+             const gint     xmm,
+             const gdouble  value )
+{
+  union { gdouble d; guint64 u; } bits;
+
+  bits.d = value;
+
+  /* mov rax, imm64 ; movq xmm, rax */
+  EMIT ( c, 0x48, 0xB8 );
+  emit_u64 ( c, bits.u );
+  EMIT ( c, 0x66, 0x48, 0x0F, 0x6E, 0xC0 | (xmm << 3) );
+}
+
+
+/*
+ * Calls a C function.
+ */
+static void
+emit_call ( GByteArray *c,
+            const gsize func )
+{
+  /* mov rax, imm64 ; call rax */
+  EMIT ( c, 0x48, 0xB8 );
+  emit_u64 ( c, (guint64) func );
+  EMIT ( c, 0xFF, 0xD0 );
+}
+
+
+/*
+ * Runs an SSE2 scalar instruction on xmm0 and xmm1.
+ */
+static void
+emit_sse ( GByteArray *c,
+           const gint  op )
+{
+  EMIT ( c, 0xF2, 0x0F, op, 0xC1 );
+}
+
+
+/*
+ * sign(), as the interpreter does it.
+ */
+static gdouble
+jit_sign ( gdouble v )
+{
+  return ( v == 0.0 ) ? 0.0 : ( ( v > 0.0 ) ? 1.0 : -1.0 );
+}
+
+
+/*
+ * Returns the libm function of an unary opcode, 0 if there is none.
+ */
+static gsize
+get_unary_func ( const gint opcode )
+{
+  switch ( opcode )
+    {
+    case MATHS_PROG_OP_SIGN:  return (gsize) jit_sign;
+    case MATHS_PROG_OP_SIN:   return (gsize) sin;
+    case MATHS_PROG_OP_SINH:  return (gsize) sinh;
+    case MATHS_PROG_OP_ASIN:  return (gsize) asin;
+    case MATHS_PROG_OP_ASINH: return (gsize) asinh;
+    case MATHS_PROG_OP_COS:   return (gsize) cos;
+    case MATHS_PROG_OP_COSH:  return (gsize) cosh;
+    case MATHS_PROG_OP_ACOS:  return (gsize) acos;
+    case MATHS_PROG_OP_ACOSH: return (gsize) acosh;
+    case MATHS_PROG_OP_TAN:   return (gsize) tan;
+    case MATHS_PROG_OP_TANH:  return (gsize) tanh;
+    case MATHS_PROG_OP_ATAN:  return (gsize) atan;
+    case MATHS_PROG_OP_ATANH: return (gsize) atanh;
+    case MATHS_PROG_OP_CBRT:  return (gsize) cbrt;
+    case MATHS_PROG_OP_LOG:   return (gsize) log;
+    case MATHS_PROG_OP_LOG2:  return (gsize) log2;
+    case MATHS_PROG_OP_LOG10: return (gsize) log10;
+    case MATHS_PROG_OP_EXP:   return (gsize) exp;
+    case MATHS_PROG_OP_CEIL:  return (gsize) ceil;
+    case MATHS_PROG_OP_ROUND: return (gsize) round;
+    }
+
+  return 0;
+}
+
+
+/*
+ * Returns the accessor of a pixel function opcode, 0 if it is not one.
+ */
+static gsize
+get_pixel_func ( const gint opcode )
+{
+  switch ( opcode )
+    {
+    case MATHS_PROG_OP_RED:   return (gsize) source_get_red;
+    case MATHS_PROG_OP_GRAY:  return (gsize) source_get_gray;
+    case MATHS_PROG_OP_GREEN: return (gsize) source_get_green;
+    case MATHS_PROG_OP_BLUE:  return (gsize) source_get_blue;
+    case MATHS_PROG_OP_ALPHA: return (gsize) source_get_alpha;
+    case MATHS_PROG_OP_RGB:   return (gsize) source_get_chan;
+    }
+
+  return 0;
+}
+
+
+/*
+ * Tells whether an instruction may go into a kernel: it must vary with each
+ * pixel, the others are left to the interpreter.
+ */
+static gboolean
+is_supported ( const MATHS_INSTR *ip )
+{
+  if ( ip->vary != MATHS_PROG_VARY_PIXEL )
+    return FALSE;
+
+  switch ( ip->opcode )
+    {
+    case MATHS_PROG_OP_CONST:
+    case MATHS_PROG_OP_RET:
+      return FALSE;
+
+    case MATHS_PROG_OP_LOAD:
+      return ( ( ip->b == MATHS_VAL_ID_R ) || ( ip->b == MATHS_VAL_ID_T ) );
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * Loads the operands of a binary instruction into xmm0 and xmm1,
+ * 'held' is the register xmm0 holds.
+ */
+static void
+emit_operands ( GByteArray *c,
+                const gint  a,
+                const gint  b,
+                const gint  held )
+{
+  if ( b == held )
+    EMIT ( c, 0x66, 0x0F, 0x28, 0xC8 )  /* movapd xmm1, xmm0 */
+  else
+    emit_load ( c, 1, b );
+
+  if ( a != held )
+    emit_load ( c, 0, a );
+}
+
+
+/*
+ * Generates the code of an instruction for the current pixel,
+ * returns the register xmm0 holds afterwards.
+ */
+static gint
+emit_instr ( GByteArray        *c,
+             const MATHS_INSTR *ip,
+             gint               held )
+{
+  gint k, first;
+
+  switch ( ip->opcode )
+    {
+    case MATHS_PROG_OP_LOAD:
+      /* mov rax, [r14+offset] ; movsd xmm0, [rax+r12] */
+      EMIT ( c, 0x49, 0x8B, 0x86 );
+      emit_u32 ( c, ( ip->b == MATHS_VAL_ID_R ) ? offsetof(MATHS_ROW, r) : offsetof(MATHS_ROW, t) );
+      EMIT ( c, 0xF2, 0x42, 0x0F, 0x10, 0x04, 0x20 );
+      break;
+
+    case MATHS_PROG_OP_MOV:
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+      break;
+
+    case MATHS_PROG_OP_ADD: emit_operands ( c, ip->a, ip->b, held ); emit_sse ( c, SSE_ADDSD ); break;
+    case MATHS_PROG_OP_SUB: emit_operands ( c, ip->a, ip->b, held ); emit_sse ( c, SSE_SUBSD ); break;
+    case MATHS_PROG_OP_MUL: emit_operands ( c, ip->a, ip->b, held ); emit_sse ( c, SSE_MULSD ); break;
+    case MATHS_PROG_OP_DIV: emit_operands ( c, ip->a, ip->b, held ); emit_sse ( c, SSE_DIVSD ); break;
+
+    case MATHS_PROG_OP_POW:
+      emit_operands ( c, ip->a, ip->b, held );
+      emit_call ( c, (gsize) pow );
+      break;
+
+    case MATHS_PROG_OP_MOD:
+      /* (gdouble) ((gint) a % (gint) b) */
+      emit_operands ( c, ip->a, ip->b, held );
+      EMIT ( c, 0xF2, 0x0F, 0x2C, 0xC0 );  /* cvttsd2si eax, xmm0 */
+      EMIT ( c, 0xF2, 0x0F, 0x2C, 0xC9 );  /* cvttsd2si ecx, xmm1 */
+      EMIT ( c, 0x99 );                    /* cdq */
+      EMIT ( c, 0xF7, 0xF9 );              /* idiv ecx */
+      EMIT ( c, 0x66, 0x0F, 0x57, 0xC0 );  /* xorpd xmm0, xmm0 */
+      EMIT ( c, 0xF2, 0x0F, 0x2A, 0xC2 );  /* cvtsi2sd xmm0, edx */
+      break;
+
+    case MATHS_PROG_OP_MODK:
+      /* (gdouble) ((gint) a % k), k being in the instruction */
+      k = (gint) ip->value;
+
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+
+      EMIT ( c, 0xF2, 0x0F, 0x2C, 0xC0 );  /* cvttsd2si eax, xmm0 */
+
+      if ( ( k > 0 ) && ( ( k & (k - 1) ) == 0 ) )
+        {
+          /* a - ( ( a + ( a < 0 ? k-1 : 0 ) ) & -k ) */
+          EMIT ( c, 0x89, 0xC2 );            /* mov edx, eax */
+          EMIT ( c, 0xC1, 0xFA, 0x1F );      /* sar edx, 31 */
+          EMIT ( c, 0x81, 0xE2 );            /* and edx, k-1 */
+          emit_u32 ( c, (guint32) (k - 1) );
+          EMIT ( c, 0x01, 0xC2 );            /* add edx, eax */
+          EMIT ( c, 0x81, 0xE2 );            /* and edx, -k */
+          emit_u32 ( c, (guint32) -k );
+          EMIT ( c, 0x29, 0xD0 );            /* sub eax, edx */
+          EMIT ( c, 0x66, 0x0F, 0x57, 0xC0 );  /* xorpd xmm0, xmm0 */
+          EMIT ( c, 0xF2, 0x0F, 0x2A, 0xC0 );  /* cvtsi2sd xmm0, eax */
+        }
+      else
+        {
+          EMIT ( c, 0xB9 );                  /* mov ecx, k */
+          emit_u32 ( c, (guint32) k );
+          EMIT ( c, 0x99 );                  /* cdq */
+          EMIT ( c, 0xF7, 0xF9 );            /* idiv ecx */
+          EMIT ( c, 0x66, 0x0F, 0x57, 0xC0 );  /* xorpd xmm0, xmm0 */
+          EMIT ( c, 0xF2, 0x0F, 0x2A, 0xC2 );  /* cvtsi2sd xmm0, edx */
+        }
+      break;
+
+    case MATHS_PROG_OP_RED:
+    case MATHS_PROG_OP_GRAY:
+    case MATHS_PROG_OP_GREEN:
+    case MATHS_PROG_OP_BLUE:
+    case MATHS_PROG_OP_ALPHA:
+    case MATHS_PROG_OP_RGB:
+      emit_operands ( c, ip->a, ip->a+1, held );
+
+      /* mov rdi, [r14+offset] */
+      EMIT ( c, 0x49, 0x8B, 0xBE );
+      emit_u32 ( c, offsetof(MATHS_ROW, source) );
+
+      if ( ip->opcode == MATHS_PROG_OP_RGB )
+        {
+          /* mov esi, [r14+offset] */
+          EMIT ( c, 0x41, 0x8B, 0xB6 );
+          emit_u32 ( c, offsetof(MATHS_ROW, chan) );
+        }
+
+      emit_call ( c, get_pixel_func ( ip->opcode ) );
+      break;
+
+    case MATHS_PROG_OP_RAND:
+      emit_call ( c, (gsize) g_random_double );
+      break;
+
+    case MATHS_PROG_OP_ABS:
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+      EMIT ( c, 0x48, 0xB8 );                    /* mov rax, 0x7FFFFFFFFFFFFFFF */
+      emit_u64 ( c, G_GUINT64_CONSTANT(0x7FFFFFFFFFFFFFFF) );
+      EMIT ( c, 0x66, 0x48, 0x0F, 0x6E, 0xC8 );  /* movq xmm1, rax */
+      EMIT ( c, 0x66, 0x0F, 0x54, 0xC1 );        /* andpd xmm0, xmm1 */
+      break;
+
+    case MATHS_PROG_OP_RAD:
+    case MATHS_PROG_OP_DEG:
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+      emit_const ( c, 1, ( ip->opcode == MATHS_PROG_OP_RAD ) ? (G_PI/180.0) : (180.0/G_PI) );
+      emit_sse ( c, SSE_MULSD );
+      break;
+
+    case MATHS_PROG_OP_SQRT:
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+      EMIT ( c, 0xF2, 0x0F, 0x51, 0xC0 );  /* sqrtsd xmm0, xmm0 */
+      break;
+
+    case MATHS_PROG_OP_ATAN2:
+      emit_operands ( c, ip->a, ip->a+1, held );
+      emit_call ( c, (gsize) atan2 );
+      break;
+
+    case MATHS_PROG_OP_MIN:
+    case MATHS_PROG_OP_MAX:
+      /* tmp = ( a < tmp ) ? a : tmp, which is what minsd a, tmp does */
+      emit_const ( c, 0, ( ip->opcode == MATHS_PROG_OP_MIN ) ? G_MAXDOUBLE : G_MINDOUBLE );
+
+      for ( k=0; k<ip->b; ++k )
+        {
+          emit_load ( c, 1, ip->a + k );
+          EMIT ( c, 0xF2, 0x0F, ( ip->opcode == MATHS_PROG_OP_MIN ) ? SSE_MINSD : SSE_MAXSD, 0xC8 );
+          EMIT ( c, 0x66, 0x0F, 0x28, 0xC1 );  /* movapd xmm0, xmm1 */
+        }
+      break;
+
+    case MATHS_PROG_OP_AVG:
+      EMIT ( c, 0x66, 0x0F, 0x57, 0xC0 );  /* xorpd xmm0, xmm0 */
+
+      for ( k=0; k<ip->b; ++k )
+        {
+          emit_load ( c, 1, ip->a + k );
+          emit_sse ( c, SSE_ADDSD );
+        }
+
+      emit_const ( c, 1, (gdouble) ip->b );
+      emit_sse ( c, SSE_DIVSD );
+      break;
+
+    case MATHS_PROG_OP_SINCOS:
+    case MATHS_PROG_OP_COSSIN:
+    case MATHS_PROG_OP_SINHCOSH:
+    case MATHS_PROG_OP_COSHSINH:
+      /* the first result comes back in xmm0, the second through rdi */
+      first = ( ( ip->opcode == MATHS_PROG_OP_SINCOS ) || ( ip->opcode == MATHS_PROG_OP_SINHCOSH ) ) ? ip->dst : ip->b;
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+      EMIT ( c, 0x48, 0x8B, 0xBC, 0x24 );  /* mov rdi, [rsp+second*8] */
+      emit_u32 ( c, ( ( first == ip->dst ) ? ip->b : ip->dst ) * 8 );
+      EMIT ( c, 0x4C, 0x01, 0xE7 );        /* add rdi, r12 */
+      emit_call ( c, ( ( ip->opcode == MATHS_PROG_OP_SINCOS ) || ( ip->opcode == MATHS_PROG_OP_COSSIN ) )
+                     ? (gsize) maths_prog_sincos : (gsize) maths_prog_sinhcosh );
+      emit_store ( c, first );
+      return first;
+
+    default:
+      if ( ip->a != held )
+        emit_load ( c, 0, ip->a );
+      emit_call ( c, get_unary_func ( ip->opcode ) );
+      break;
+    }
+
+  emit_store ( c, ip->dst );
+
+  return ip->dst;
+}
+
+
+/*
+ * Generates the kernel of the instructions first to last.
+ */
+static void
+emit_kernel ( GByteArray          *c,
+              const MATHS_PROGRAM *prog,
+              const gint           first,
+              const gint           last )
+{
+  guint frame, loop, exit_jump;
+  gint i, held;
+
+  /* the return address and the 4 registers saved leave rsp 8 bytes off */
+  frame = prog->nregs * 8;
+  if ( ( frame & 15 ) == 0 )
+    frame += 8;
+
+  EMIT ( c, 0x53 );                   /* push rbx */
+  EMIT ( c, 0x41, 0x54 );             /* push r12 */
+  EMIT ( c, 0x41, 0x55 );             /* push r13 */
+  EMIT ( c, 0x41, 0x56 );             /* push r14 */
+  EMIT ( c, 0x48, 0x81, 0xEC );       /* sub rsp, frame */
+  emit_u32 ( c, frame );
+  EMIT ( c, 0x49, 0x89, 0xFE );       /* mov r14, rdi */
+  EMIT ( c, 0x49, 0x8B, 0x9E );       /* mov rbx, [r14+regs] */
+  emit_u32 ( c, offsetof(MATHS_ROW, regs) );
+  EMIT ( c, 0x4D, 0x63, 0xAE );       /* movsxd r13, [r14+n] */
+  emit_u32 ( c, offsetof(MATHS_ROW, n) );
+  EMIT ( c, 0x49, 0xC1, 0xE5, 0x03 ); /* shl r13, 3 */
+
+  /* first lane of each register: regs + k*n */
+  for ( i=0; i<prog->nregs; ++i )
+    {
+      EMIT ( c, 0x4C, 0x89, 0xE8 );       /* mov rax, r13 */
+      EMIT ( c, 0x48, 0x69, 0xC0 );       /* imul rax, rax, i */
+      emit_u32 ( c, i );
+      EMIT ( c, 0x48, 0x01, 0xD8 );       /* add rax, rbx */
+      EMIT ( c, 0x48, 0x89, 0x84, 0x24 ); /* mov [rsp+i*8], rax */
+      emit_u32 ( c, i * 8 );
+    }
+
+  EMIT ( c, 0x45, 0x31, 0xE4 );       /* xor r12d, r12d */
+  EMIT ( c, 0x4D, 0x85, 0xED );       /* test r13, r13 */
+  EMIT ( c, 0x0F, 0x8E );             /* jle exit */
+  exit_jump = c->len;
+  emit_u32 ( c, 0 );
+
+  loop = c->len;
+
+  for ( i=first, held=-1; i<=last; ++i )
+    held = emit_instr ( c, &prog->code[i], held );
+
+  EMIT ( c, 0x49, 0x83, 0xC4, 0x08 ); /* add r12, 8 */
+  EMIT ( c, 0x4D, 0x39, 0xEC );       /* cmp r12, r13 */
+  EMIT ( c, 0x0F, 0x8C );             /* jl loop */
+  emit_u32 ( c, loop - (c->len + 4) );
+
+  /* exit: */
+  i = c->len - (exit_jump + 4);
+  memcpy ( c->data + exit_jump, &i, 4 );
+
+  EMIT ( c, 0x48, 0x81, 0xC4 );       /* add rsp, frame */
+  emit_u32 ( c, frame );
+  EMIT ( c, 0x41, 0x5E );             /* pop r14 */
+  EMIT ( c, 0x41, 0x5D );             /* pop r13 */
+  EMIT ( c, 0x41, 0x5C );             /* pop r12 */
+  EMIT ( c, 0x5B );                   /* pop rbx */
+  EMIT ( c, 0xC3 );                   /* ret */
+
+  /* the next kernel starts on 16 bytes */
+  while ( c->len & 15 )
+    EMIT ( c, 0xCC );
+}
+
+
+/*
+ * Compiles each run of per-pixel instructions into a kernel, the code of
+ * the kernels is moved into executable memory once generated.
+ */
+MATHS_JIT *
+maths_jit_compile ( const MATHS_PROGRAM *prog )
+{
+  MATHS_JIT *jit;
+  GByteArray *c;
+  GArray *segments;
+  GArray *offsets;
+  MATHS_JIT_SEGMENT seg;
+  guint offset;
+  gint i;
+
+  if ( prog == NULL )
+    return NULL;
+
+  c = g_byte_array_new ( );
+  segments = g_array_new ( FALSE, FALSE, sizeof(MATHS_JIT_SEGMENT) );
+  offsets = g_array_new ( FALSE, FALSE, sizeof(guint) );
+
+  for ( i=0; i<prog->len; ++i )
+    {
+      if ( !is_supported ( &prog->code[i] ) )
+        continue;
+
+      seg.first = i;
+
+      while ( ( i+1 < prog->len ) && is_supported ( &prog->code[i+1] ) )
+        ++i;
+
+      seg.last = i;
+      seg.kernel = NULL;
+
+      offset = c->len;
+      emit_kernel ( c, prog, seg.first, seg.last );
+
+      g_array_append_val ( segments, seg );
+      g_array_append_val ( offsets, offset );
+    }
+
+  jit = NULL;
+
+  if ( segments->len > 0 )
+    {
+      jit = g_new ( MATHS_JIT, 1 );
+      jit->size = c->len;
+      jit->mem = mmap ( NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+      if ( jit->mem == MAP_FAILED )
+        {
+          g_free ( jit );
+          jit = NULL;
+        }
+      else
+        {
+          memcpy ( jit->mem, c->data, c->len );
+
+          /* the memory is never writable and executable at once */
+          if ( mprotect ( jit->mem, jit->size, PROT_READ | PROT_EXEC ) != 0 )
+            {
+              munmap ( jit->mem, jit->size );
+              g_free ( jit );
+              jit = NULL;
+            }
+        }
+    }
+
+  if ( jit != NULL )
+    {
+      jit->nsegments = segments->len;
+      jit->segments = (MATHS_JIT_SEGMENT *) g_array_free ( segments, FALSE );
+
+      for ( i=0; i<jit->nsegments; ++i )
+        jit->segments[i].kernel = (MATHS_JIT_KERNEL) ( (guint8 *) jit->mem + g_array_index ( offsets, guint, i ) );
+    }
+  else
+    g_array_free ( segments, TRUE );
+
+  g_array_free ( offsets, TRUE );
+  g_byte_array_free ( c, TRUE );
+
+  return jit;
+}
+
+
+/*
+ * Destroys the native code of a program.
+ */
+void
+maths_jit_free ( MATHS_JIT *jit )
+{
+  if ( jit == NULL )
+    return;
+
+  munmap ( jit->mem, jit->size );
+  g_free ( jit->segments );
+  g_free ( jit );
+}
+
+
+#else /* MATHS_JIT_X86_64 */
+
+
+/*
+ * No native code on this platform, the programs are interpreted.
+ */
+MATHS_JIT *
+maths_jit_compile ( const MATHS_PROGRAM *prog )
+{
+  return NULL;
+}
+
+
+/*
+ * Nothing to destroy.
+ */
+void
+maths_jit_free ( MATHS_JIT *jit )
+{
+}
+
+
+#endif /* MATHS_JIT_X86_64 */
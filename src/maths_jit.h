@@ -0,0 +1,72 @@
+/*
+ * maths_jit.h
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef __MATHS_JIT_H__
+#define __MATHS_JIT_H__
+
+
+#ifndef __MATHS_PROG_H__
+#include "maths_prog.h"
+#endif
+
+
+/* Native code is only generated for x86-64, where mmap() gives us
+   executable memory */
+#if defined(__x86_64__) && defined(HAVE_SYS_MMAN_H) && !defined(MATHS_JIT_DISABLE)
+#define MATHS_JIT_X86_64
+#endif
+
+
+/* Native code of consecutive per-pixel instructions of a program: runs them
+   on every pixel of a row, one pixel after the other */
+typedef void ( *MATHS_JIT_KERNEL ) ( const MATHS_ROW *row );
+
+
+/* Instructions first to last of a program, compiled into a kernel */
+typedef struct maths_jit_segment_t
+{
+  gint               first;
+  gint               last;
+  MATHS_JIT_KERNEL   kernel;
+} MATHS_JIT_SEGMENT ;
+
+
+/* Native code of a program */
+typedef struct maths_jit_t
+{
+  gpointer             mem;
+  gsize                size;
+  MATHS_JIT_SEGMENT   *segments;
+  gint                 nsegments;
+} MATHS_JIT ;
+
+
+/* Compiles the per-pixel instructions of a program into native code,
+   returns NULL if there is nothing to compile or if it is not supported */
+MATHS_JIT *maths_jit_compile ( const MATHS_PROGRAM *prog );
+
+/* Destroys the native code of a program */
+void maths_jit_free ( MATHS_JIT *jit );
+
+
+#endif
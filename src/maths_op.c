@@ -79,79 +79,31 @@ maths_op_dump_xml ( FILE *output,
 
 /* Precalculation */
 gint
-maths_op_precalc ( gpointer data )
+maths_op_precalc ( gpointer     data,
+                   MATHS_ARENA *arena )
 {
   MATHS_OPERATOR *op = (MATHS_OPERATOR *) data;
-  MATHS_TREE_ELEMENT *el;
-  MATHS_VALUE *val;
   gint l_precalc_code, r_precalc_code;
 
-  l_precalc_code = op->l->precalc ( op->l->data );
-  r_precalc_code = op->r->precalc ( op->r->data );
+  l_precalc_code = op->l->precalc ( op->l->data, arena );
+  r_precalc_code = op->r->precalc ( op->r->data, arena );
 
   if ( ( l_precalc_code != PRECALC_NOT ) &&
        ( r_precalc_code != PRECALC_NOT ) &&
        ( op->precalc_code == PRECALC_OK ) )
     return PRECALC_OK;
 
+  /* the subtrees replaced remain in the arena until the formula is destroyed */
   if ( l_precalc_code == PRECALC_OK )
-    {
-      val = maths_val_alloc ( );
-      val->value = (gdouble *) g_malloc ( sizeof(gdouble) );
-      (*val->value) = op->l->exec ( op->l->data );
-
-      el = (MATHS_TREE_ELEMENT *) g_malloc ( sizeof(MATHS_TREE_ELEMENT) );
-      el->data = ( gpointer ) val;
-      el->exec = maths_val_exec;
-      el->dump_xml = maths_val_dump_xml;
-      el->precalc = maths_val_precalc;
-      el->free = maths_val_free;
-      op->l->free ( op->l->data );
-      g_free ( op->l );
-      op->l = el;
-    }
+    op->l = maths_val_new_constant ( arena, op->l->exec ( op->l->data ) );
 
   if ( r_precalc_code == PRECALC_OK )
-    {
-      val = maths_val_alloc ( );
-      val->value = (gdouble *) g_malloc ( sizeof(gdouble) );
-      (*val->value) = op->r->exec ( op->r->data );
-
-      el = (MATHS_TREE_ELEMENT *) g_malloc ( sizeof(MATHS_TREE_ELEMENT) );
-      el->data = ( gpointer ) val;
-      el->exec = maths_val_exec;
-      el->dump_xml = maths_val_dump_xml;
-      el->precalc = maths_val_precalc;
-      el->free = maths_val_free;
-      op->r->free ( op->r->data );
-      g_free ( op->r );
-      op->r = el;
-    }
+    op->r = maths_val_new_constant ( arena, op->r->exec ( op->r->data ) );
 
   return PRECALC_NOT;
 }
 
 
-/* Memory desallocation of an operation */
-void
-maths_op_free ( gpointer data )
-{
-  MATHS_OPERATOR *op = (MATHS_OPERATOR *) data;
-
-  if ( op->l != NULL )
-    {
-      op->l->free ( op->l->data );
-      g_free ( op->l );
-    }
-
-  if ( op->r != NULL )
-    {
-      op->r->free ( op->r->data );
-      g_free ( op->r );
-    }
-}
-
-
 static gdouble
 add ( const gdouble a,
       const gdouble b )
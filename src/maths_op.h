@@ -49,8 +49,7 @@ typedef struct maths_operator_t
 /* Operations prototypes */
 gdouble maths_op_exec     ( gpointer data );
 gint    maths_op_dump_xml ( FILE *output, gint index, gpointer data );
-gint    maths_op_precalc  ( gpointer data );
-void    maths_op_free     ( gpointer data );
+gint    maths_op_precalc  ( gpointer data, MATHS_ARENA *arena );
 
 
 extern MATHS_OPERATOR operators [];
@@ -0,0 +1,1484 @@
+/*
+ * maths_prog.c
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <glib.h>
+#include "error.h"
+#include "maths_op.h"
+#include "maths_val.h"
+#include "maths_func.h"
+#include "maths_simplify.h"
+#include "maths_prog.h"
+#include "maths_jit.h"
+#include "plugin-intl.h"
+
+
+/* Accessors to channel value according to coords */
+extern gdouble get_red_at ( gdouble, gdouble );
+extern gdouble get_gray_at ( gdouble, gdouble );
+extern gdouble get_green_at ( gdouble, gdouble );
+extern gdouble get_blue_at ( gdouble, gdouble );
+extern gdouble get_alpha_at ( gdouble, gdouble );
+extern gdouble get_rgb_at ( gdouble, gdouble );
+
+/* Accessors to channel value of a given source */
+extern gdouble source_get_red ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_gray ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_green ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_blue ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_alpha ( const struct pixel_source_t *, gdouble, gdouble );
+extern gdouble source_get_chan ( const struct pixel_source_t *, gint, gdouble, gdouble );
+
+
+/* GCC's labels as values give us a threaded dispatch, others get a switch */
+#if defined(__GNUC__) && !defined(MATHS_PROG_NO_COMPUTED_GOTO)
+#define MATHS_PROG_COMPUTED_GOTO
+#endif
+
+
+/* Opcodes of the functions, in the order of the MATHS_FUNC_ID_* identifiers */
+static const gint func_opcodes[] =
+  {
+    MATHS_PROG_OP_RED, MATHS_PROG_OP_GRAY, MATHS_PROG_OP_GREEN, MATHS_PROG_OP_BLUE,
+    MATHS_PROG_OP_ALPHA, MATHS_PROG_OP_RGB, MATHS_PROG_OP_RAND, MATHS_PROG_OP_ABS,
+    MATHS_PROG_OP_SIGN, MATHS_PROG_OP_SIN, MATHS_PROG_OP_SINH, MATHS_PROG_OP_ASIN,
+    MATHS_PROG_OP_ASINH, MATHS_PROG_OP_COS, MATHS_PROG_OP_COSH, MATHS_PROG_OP_ACOS,
+    MATHS_PROG_OP_ACOSH, MATHS_PROG_OP_TAN, MATHS_PROG_OP_TANH, MATHS_PROG_OP_ATAN,
+    MATHS_PROG_OP_ATAN2, MATHS_PROG_OP_ATANH, MATHS_PROG_OP_RAD, MATHS_PROG_OP_DEG,
+    MATHS_PROG_OP_SQRT, MATHS_PROG_OP_CBRT, MATHS_PROG_OP_LOG, MATHS_PROG_OP_LOG2,
+    MATHS_PROG_OP_LOG10, MATHS_PROG_OP_EXP, MATHS_PROG_OP_CEIL, MATHS_PROG_OP_ROUND,
+    MATHS_PROG_OP_MIN, MATHS_PROG_OP_MAX, MATHS_PROG_OP_AVG
+  };
+
+
+/*
+ * Appends an instruction to the code being built.
+ */
+static void
+emit ( MATHS_PROGRAM  *prog,
+       GArray         *code,
+       const gint      opcode,
+       const gint      dst,
+       const gint      a,
+       const gint      b,
+       const gdouble   value,
+       const gdouble  *var,
+       const gint      vary )
+{
+  MATHS_INSTR instr;
+
+  instr.opcode = opcode;
+  instr.dst = dst;
+  instr.a = a;
+  instr.b = b;
+  instr.value = value;
+  instr.var = var;
+  instr.vary = vary;
+  instr.cache = -1;
+  instr.spread = FALSE;
+  g_array_append_val ( code, instr );
+
+  if ( dst >= prog->nregs )
+    prog->nregs = dst + 1;
+}
+
+
+/*
+ * The instruction 'root' computes an operand varying with 'vary' of an
+ * instruction varying with 'user_vary': makes its value available on as
+ * many lanes as the user needs.
+ */
+static void
+widen ( MATHS_PROGRAM  *prog,
+        GArray         *code,
+        const gint      root,
+        const gint      vary,
+        const gint      user_vary )
+{
+  MATHS_INSTR *instr = &g_array_index ( code, MATHS_INSTR, root );
+
+  if ( !( user_vary & MATHS_PROG_VARY_X ) )
+    return;
+
+  if ( !( vary & MATHS_PROG_VARY_X ) )
+    instr->spread = TRUE;
+  else if ( ( vary == MATHS_PROG_VARY_X ) && ( user_vary != MATHS_PROG_VARY_X ) )
+    instr->cache = prog->ncaches++;
+}
+
+
+/* Common subexpressions of a tree being lowered */
+typedef struct cse_t
+{
+  MATHS_KEYS  *keys;    /* structural keys of the elements */
+  GHashTable  *counts;  /* key -> number of occurrences */
+  GHashTable  *uses;    /* key -> number of times the lowering reaches it */
+  GHashTable  *regs;    /* key -> index of its shared register, and vary */
+  GHashTable  *pairs;   /* key of sin(a), cos(a), sinh(a) or cosh(a) -> key of
+                           its partner, when both are in the trees */
+  gint         nshared;
+} CSE ;
+
+
+/* Shared registers are numbered from -1 downwards while lowering, and moved
+   above the others once the program is complete */
+#define CSE_REG(k)  ( -1 - (k) )
+
+
+/*
+ * Returns the function computed along with an element at no extra cost:
+ * cos for sin, sinh for cosh... -1 if there is none.
+ */
+static gint
+cse_partner ( MATHS_TREE_ELEMENT *el )
+{
+  MATHS_FUNCTION *func;
+
+  if ( el->exec != maths_func_exec )
+    return -1;
+
+  func = (MATHS_FUNCTION *) el->data;
+
+  if ( func->argc != 1 )
+    return -1;
+
+  switch ( func->id )
+    {
+    case MATHS_FUNC_ID_SIN:  return MATHS_FUNC_ID_COS;
+    case MATHS_FUNC_ID_COS:  return MATHS_FUNC_ID_SIN;
+    case MATHS_FUNC_ID_SINH: return MATHS_FUNC_ID_COSH;
+    case MATHS_FUNC_ID_COSH: return MATHS_FUNC_ID_SINH;
+    }
+
+  return -1;
+}
+
+
+/*
+ * Counts the occurrences of an element and of its subtrees (recursive),
+ * and notes the partners of the sin, cos, sinh and cosh calls. Subtrees
+ * calling rand() never repeat, they get no key.
+ */
+static void
+cse_count ( CSE                *cse,
+            MATHS_TREE_ELEMENT *el )
+{
+  gint key, arg, i, partner;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return;
+
+  if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+
+      cse_count ( cse, op->l );
+      cse_count ( cse, op->r );
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      for ( i=0; i<func->argc; ++i )
+        cse_count ( cse, func->argv[i] );
+    }
+
+  if ( ( key = maths_simplify_key ( el, cse->keys ) ) == 0 )
+    return;
+
+  /* the partner has the same argument */
+  if ( ( partner = cse_partner ( el ) ) >= 0 )
+    {
+      arg = maths_simplify_key ( ((MATHS_FUNCTION *) el->data)->argv[0], cse->keys );
+      g_hash_table_insert ( cse->pairs, GINT_TO_POINTER ( key ),
+                            GINT_TO_POINTER ( maths_simplify_call_key ( cse->keys, partner, arg ) ) );
+    }
+
+  /* leaves are cheaper to reload than to share */
+  if ( el->exec != maths_val_exec )
+    g_hash_table_insert ( cse->counts, GINT_TO_POINTER ( key ),
+                          GINT_TO_POINTER ( GPOINTER_TO_INT ( g_hash_table_lookup ( cse->counts, GINT_TO_POINTER ( key ) ) ) + 1 ) );
+}
+
+
+/*
+ * Counts the times the lowering reaches each subtree (recursive): once a
+ * repeated subtree has been lowered, its next occurrences are not walked.
+ * Neither is the argument of a function whose partner has been lowered.
+ */
+static void
+cse_count_uses ( CSE                *cse,
+                 MATHS_TREE_ELEMENT *el,
+                 GHashTable         *seen )
+{
+  gpointer key, partner;
+  gint i;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return;
+
+  key = GINT_TO_POINTER ( maths_simplify_key ( el, cse->keys ) );
+
+  if ( ( key != NULL ) && ( GPOINTER_TO_INT ( g_hash_table_lookup ( cse->counts, key ) ) > 1 ) )
+    {
+      g_hash_table_insert ( cse->uses, key,
+                            GINT_TO_POINTER ( GPOINTER_TO_INT ( g_hash_table_lookup ( cse->uses, key ) ) + 1 ) );
+
+      if ( g_hash_table_lookup ( seen, key ) != NULL )
+        return;
+
+      g_hash_table_insert ( seen, key, key );
+    }
+
+  if ( ( key != NULL ) && ( ( partner = g_hash_table_lookup ( cse->pairs, key ) ) != NULL ) )
+    {
+      if ( g_hash_table_lookup ( seen, partner ) != NULL )
+        return;
+
+      g_hash_table_insert ( seen, key, key );
+    }
+
+  if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+
+      cse_count_uses ( cse, op->l, seen );
+      cse_count_uses ( cse, op->r, seen );
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      for ( i=0; i<func->argc; ++i )
+        cse_count_uses ( cse, func->argv[i], seen );
+    }
+}
+
+
+/*
+ * Tells whether the partner of a function is missing from the trees.
+ */
+static gboolean
+cse_lacks_partner ( gpointer key,
+                    gpointer partner,
+                    gpointer counts )
+{
+  return ( g_hash_table_lookup ( (GHashTable *) counts, partner ) == NULL );
+}
+
+
+/*
+ * Finds the subtrees of n trees worth sharing, the trees are lowered one
+ * after the other. Also pairs the functions computed together.
+ */
+static void
+cse_init ( CSE                 *cse,
+           MATHS_TREE_ELEMENT **heads,
+           const gint           n )
+{
+  GHashTable *seen;
+  gint i;
+
+  cse->keys = maths_simplify_keys_new ( );
+  cse->counts = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  cse->uses = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  cse->regs = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  cse->pairs = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  cse->nshared = 0;
+
+  for ( i=0; i<n; ++i )
+    cse_count ( cse, heads[i] );
+
+  g_hash_table_foreach_remove ( cse->pairs, cse_lacks_partner, cse->counts );
+
+  seen = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  for ( i=0; i<n; ++i )
+    cse_count_uses ( cse, heads[i], seen );
+  g_hash_table_destroy ( seen );
+}
+
+
+/*
+ * Returns the key of an element if the lowering reaches it more than once,
+ * 0 otherwise.
+ */
+static gint
+cse_shared_key ( CSE                *cse,
+                 MATHS_TREE_ELEMENT *el )
+{
+  gint key = maths_simplify_key ( el, cse->keys );
+
+  if ( ( key == 0 ) || ( GPOINTER_TO_INT ( g_hash_table_lookup ( cse->uses, GINT_TO_POINTER ( key ) ) ) < 2 ) )
+    return 0;
+
+  return key;
+}
+
+
+/*
+ * Destroys the tables of a CSE.
+ */
+static void
+cse_free ( CSE *cse )
+{
+  g_hash_table_destroy ( cse->pairs );
+  g_hash_table_destroy ( cse->regs );
+  g_hash_table_destroy ( cse->uses );
+  g_hash_table_destroy ( cse->counts );
+  maths_simplify_keys_free ( cse->keys );
+}
+
+
+/*
+ * Returns TRUE if an element is a constant, 'v' receives its value.
+ */
+static gboolean
+is_constant ( MATHS_TREE_ELEMENT *el,
+              gdouble            *v )
+{
+  MATHS_VALUE *val;
+
+  if ( ( el == NULL ) || ( el->exec != maths_val_exec ) )
+    return FALSE;
+
+  val = (MATHS_VALUE *) el->data;
+
+  if ( val->precalc_code == PRECALC_NOT )
+    return FALSE;
+
+  *v = *val->value;
+  return TRUE;
+}
+
+
+/*
+ * Tells whether an operation by the constant 'k' has a cheaper form than the
+ * generic instruction:
+ *  - a ^ 0.5 is a square root, a ^ n for n in [-4, 4] multiplications and
+ *    a reciprocal
+ *  - a / k is a multiplication when 1/k is exact, k being a power of two
+ *  - a % k does not convert k on each pixel, and is a mask for powers of two
+ */
+static gboolean
+has_constant_form ( const gint    opcode,
+                    const gdouble k )
+{
+  gint e;
+
+  switch ( opcode )
+    {
+    case MATHS_PROG_OP_POW:
+      return ( ( k == 0.5 ) || ( ( k == floor ( k ) ) && ( fabs ( k ) <= 4.0 ) && ( k != 0.0 ) ) );
+
+    case MATHS_PROG_OP_DIV:
+      return ( ( fabs ( frexp ( k, &e ) ) == 0.5 ) && isnormal ( 1.0 / k ) );
+
+    case MATHS_PROG_OP_MOD:
+      return ( ( k > (gdouble) G_MININT ) && ( k < (gdouble) G_MAXINT ) && ( (gint) k != 0 ) );
+    }
+
+  return FALSE;
+}
+
+
+/*
+ * Lowers the operation by the constant 'k' of an operand already in the 'dst'
+ * register, see has_constant_form().
+ */
+static void
+compile_constant_form ( MATHS_PROGRAM  *prog,
+                        GArray         *code,
+                        const gint      opcode,
+                        const gint      dst,
+                        const gdouble   k,
+                        const gint      vary )
+{
+  switch ( opcode )
+    {
+    case MATHS_PROG_OP_POW:
+      if ( k == 0.5 )
+        {
+          emit ( prog, code, MATHS_PROG_OP_SQRT, dst, dst, 1, 0.0, NULL, vary );
+          return;
+        }
+
+      switch ( ABS ( (gint) k ) )
+        {
+        case 2:
+          emit ( prog, code, MATHS_PROG_OP_MUL, dst, dst, dst, 0.0, NULL, vary );
+          break;
+
+        case 3:
+          emit ( prog, code, MATHS_PROG_OP_MUL, dst+1, dst, dst, 0.0, NULL, vary );
+          emit ( prog, code, MATHS_PROG_OP_MUL, dst, dst+1, dst, 0.0, NULL, vary );
+          break;
+
+        case 4:
+          emit ( prog, code, MATHS_PROG_OP_MUL, dst, dst, dst, 0.0, NULL, vary );
+          emit ( prog, code, MATHS_PROG_OP_MUL, dst, dst, dst, 0.0, NULL, vary );
+          break;
+        }
+
+      if ( k < 0.0 )
+        {
+          emit ( prog, code, MATHS_PROG_OP_CONST, dst+1, 0, 0, 1.0, NULL, MATHS_PROG_VARY_NONE );
+          widen ( prog, code, code->len - 1, MATHS_PROG_VARY_NONE, vary );
+          emit ( prog, code, MATHS_PROG_OP_DIV, dst, dst+1, dst, 0.0, NULL, vary );
+        }
+      break;
+
+    case MATHS_PROG_OP_DIV:
+      emit ( prog, code, MATHS_PROG_OP_CONST, dst+1, 0, 0, 1.0 / k, NULL, MATHS_PROG_VARY_NONE );
+      widen ( prog, code, code->len - 1, MATHS_PROG_VARY_NONE, vary );
+      emit ( prog, code, MATHS_PROG_OP_MUL, dst, dst, dst+1, 0.0, NULL, vary );
+      break;
+
+    case MATHS_PROG_OP_MOD:
+      emit ( prog, code, MATHS_PROG_OP_MODK, dst, dst, 0, (gdouble) (gint) k, NULL, vary );
+      break;
+    }
+}
+
+
+static gboolean compile_element ( MATHS_PROGRAM *, GArray *, CSE *, MATHS_TREE_ELEMENT *, const gint, gint *, gint * );
+
+
+/*
+ * Lowers the operation of an element, see compile_element().
+ */
+static gboolean
+compile_node ( MATHS_PROGRAM      *prog,
+               GArray             *code,
+               CSE                *cse,
+               MATHS_TREE_ELEMENT *el,
+               const gint          dst,
+               gint               *vary )
+{
+  gint i, opcode, lvary, rvary, lroot, rroot;
+  gint *roots, *varies;
+  gpointer key, partner;
+  gdouble k;
+
+  if ( el->exec == maths_val_exec )
+    {
+      MATHS_VALUE *val = (MATHS_VALUE *) el->data;
+
+      if ( val->precalc_code == PRECALC_NOT )
+        {
+          switch ( val->id )
+            {
+            case MATHS_VAL_ID_X: *vary = MATHS_PROG_VARY_X; break;
+            case MATHS_VAL_ID_Y: *vary = MATHS_PROG_VARY_Y; break;
+            case MATHS_VAL_ID_R:
+              prog->flags |= MATHS_PROG_USES_R;
+              *vary = MATHS_PROG_VARY_PIXEL;
+              break;
+            case MATHS_VAL_ID_T:
+              prog->flags |= MATHS_PROG_USES_T;
+              *vary = MATHS_PROG_VARY_PIXEL;
+              break;
+            default:
+              *vary = MATHS_PROG_VARY_NONE;
+              break;
+            }
+
+          emit ( prog, code, MATHS_PROG_OP_LOAD, dst, 0, val->id, 0.0, val->value, *vary );
+        }
+      else
+        {
+          *vary = MATHS_PROG_VARY_NONE;
+          emit ( prog, code, MATHS_PROG_OP_CONST, dst, 0, 0, *val->value, NULL, *vary );
+        }
+
+      return TRUE;
+    }
+  else if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+
+      switch ( *op->name )
+        {
+        case '+': opcode = MATHS_PROG_OP_ADD; break;
+        case '-': opcode = MATHS_PROG_OP_SUB; break;
+        case '*': opcode = MATHS_PROG_OP_MUL; break;
+        case '/': opcode = MATHS_PROG_OP_DIV; break;
+        case '^': opcode = MATHS_PROG_OP_POW; break;
+        case '%': opcode = MATHS_PROG_OP_MOD; break;
+        default:
+          return FALSE;
+        }
+
+      if ( is_constant ( op->r, &k ) && has_constant_form ( opcode, k ) )
+        {
+          if ( !compile_element ( prog, code, cse, op->l, dst, vary, &lroot ) )
+            return FALSE;
+
+          compile_constant_form ( prog, code, opcode, dst, k, *vary );
+          return TRUE;
+        }
+
+      if ( !compile_element ( prog, code, cse, op->l, dst, &lvary, &lroot )
+           || !compile_element ( prog, code, cse, op->r, dst+1, &rvary, &rroot ) )
+        return FALSE;
+
+      *vary = lvary | rvary;
+      widen ( prog, code, lroot, lvary, *vary );
+      widen ( prog, code, rroot, rvary, *vary );
+
+      emit ( prog, code, opcode, dst, dst, dst+1, 0.0, NULL, *vary );
+      return TRUE;
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      if ( ( func->id < 0 ) || ( func->id >= G_N_ELEMENTS(func_opcodes) ) )
+        return FALSE;
+
+      /* pixel functions: red, gray, green, blue, alpha and rgb */
+      if ( func->id <= MATHS_FUNC_ID_RGB )
+        {
+          prog->flags |= MATHS_PROG_USES_SOURCE;
+
+          if ( func->id == MATHS_FUNC_ID_RGB )
+            prog->flags |= MATHS_PROG_USES_CHAN;
+
+          if ( !maths_func_reads_pixel ( func ) )
+            prog->flags |= MATHS_PROG_SAMPLES_AROUND;
+        }
+
+      roots = g_new ( gint, 2 * func->argc + 1 );
+      varies = roots + func->argc;
+
+      for ( i=0; i<func->argc; ++i )
+        {
+          if ( !compile_element ( prog, code, cse, func->argv[i], dst+i, &varies[i], &roots[i] ) )
+            {
+              g_free ( roots );
+              return FALSE;
+            }
+        }
+
+      /* the source may change between two rows, and rand() never repeats */
+      if ( ( func->id <= MATHS_FUNC_ID_RGB ) || ( func->id == MATHS_FUNC_ID_RAND ) )
+        *vary = MATHS_PROG_VARY_PIXEL;
+      else
+        for ( *vary=MATHS_PROG_VARY_NONE, i=0; i<func->argc; ++i )
+          *vary |= varies[i];
+
+      for ( i=0; i<func->argc; ++i )
+        widen ( prog, code, roots[i], varies[i], *vary );
+
+      g_free ( roots );
+
+      /* the partner goes to a shared register, its occurrences copy it */
+      key = GINT_TO_POINTER ( maths_simplify_key ( el, cse->keys ) );
+
+      if ( ( key != NULL ) && ( ( partner = g_hash_table_lookup ( cse->pairs, key ) ) != NULL ) )
+        {
+          switch ( func->id )
+            {
+            case MATHS_FUNC_ID_SIN:  opcode = MATHS_PROG_OP_SINCOS; break;
+            case MATHS_FUNC_ID_COS:  opcode = MATHS_PROG_OP_COSSIN; break;
+            case MATHS_FUNC_ID_SINH: opcode = MATHS_PROG_OP_SINHCOSH; break;
+            default:                 opcode = MATHS_PROG_OP_COSHSINH; break;
+            }
+
+          emit ( prog, code, opcode, dst, dst, CSE_REG ( cse->nshared ), 0.0, NULL, *vary );
+          g_hash_table_insert ( cse->regs, partner, GINT_TO_POINTER ( ( ( cse->nshared + 1 ) << 2 ) | *vary ) );
+          ++cse->nshared;
+          return TRUE;
+        }
+
+      emit ( prog, code, func_opcodes[func->id], dst, dst, func->argc, 0.0, NULL, *vary );
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+
+/*
+ * Lowers an element (recursive), its value ends up in the 'dst' register.
+ * Registers above 'dst' are free for the subtrees.
+ * 'vary' receives what the value varies with, and 'root' the index of the
+ * instruction which writes 'dst'.
+ * A subtree the lowering reaches several times is computed once: its value is
+ * copied to a shared register, which the next occurrences copy back. The
+ * partner of a function lowered before is copied from its register too.
+ */
+static gboolean
+compile_element ( MATHS_PROGRAM      *prog,
+                  GArray             *code,
+                  CSE                *cse,
+                  MATHS_TREE_ELEMENT *el,
+                  const gint          dst,
+                  gint               *vary,
+                  gint               *root )
+{
+  gint key, shared;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return FALSE;
+
+  key = maths_simplify_key ( el, cse->keys );
+
+  if ( ( key != 0 ) && ( ( shared = GPOINTER_TO_INT ( g_hash_table_lookup ( cse->regs, GINT_TO_POINTER ( key ) ) ) ) != 0 ) )
+    {
+      *vary = shared & MATHS_PROG_VARY_PIXEL;
+      emit ( prog, code, MATHS_PROG_OP_MOV, dst, CSE_REG ( ( shared >> 2 ) - 1 ), 0, 0.0, NULL, *vary );
+      *root = code->len - 1;
+      return TRUE;
+    }
+
+  if ( !compile_node ( prog, code, cse, el, dst, vary ) )
+    return FALSE;
+
+  *root = code->len - 1;
+
+  if ( ( key = cse_shared_key ( cse, el ) ) != 0 )
+    {
+      emit ( prog, code, MATHS_PROG_OP_MOV, CSE_REG ( cse->nshared ), dst, 0, 0.0, NULL, *vary );
+      g_hash_table_insert ( cse->regs, GINT_TO_POINTER ( key ), GINT_TO_POINTER ( ( ( cse->nshared + 1 ) << 2 ) | *vary ) );
+      ++cse->nshared;
+    }
+
+  return TRUE;
+}
+
+
+static MATHS_PROGRAM *compile ( MATHS_TREE_ELEMENT **heads, const gint n, const gboolean split );
+
+
+/*
+ * Looks for a top-level operator between a part varying with x only and a
+ * part varying with y only: those can be evaluated once per column and once
+ * per row, then combined.
+ */
+static void
+split_program ( MATHS_PROGRAM      *prog,
+                MATHS_TREE_ELEMENT *head )
+{
+  MATHS_OPERATOR *op;
+  MATHS_PROGRAM *l, *r;
+  gint opcode;
+
+  if ( head->exec != maths_op_exec )
+    return;
+
+  op = (MATHS_OPERATOR *) head->data;
+
+  switch ( *op->name )
+    {
+    case '+': opcode = MATHS_PROG_OP_ADD; break;
+    case '-': opcode = MATHS_PROG_OP_SUB; break;
+    case '*': opcode = MATHS_PROG_OP_MUL; break;
+    case '/': opcode = MATHS_PROG_OP_DIV; break;
+    default:
+      return;
+    }
+
+  l = compile ( &op->l, 1, FALSE );
+  r = compile ( &op->r, 1, FALSE );
+
+  if ( ( l != NULL ) && ( r != NULL )
+       && ( l->vary != MATHS_PROG_VARY_PIXEL ) && ( r->vary != MATHS_PROG_VARY_PIXEL ) )
+    {
+      prog->separable = MATHS_PROG_SEP_XY;
+      prog->sep_op = opcode;
+      prog->sep_x_first = ( l->vary & MATHS_PROG_VARY_X ) ? TRUE : FALSE;
+      prog->sep_x = prog->sep_x_first ? l : r;
+      prog->sep_y = prog->sep_x_first ? r : l;
+      return;
+    }
+
+  maths_prog_free ( l );
+  maths_prog_free ( r );
+}
+
+
+/*
+ * Lowers n trees into a program with n results, the result of the tree i
+ * ends up in the register i, or in the register of the first identical tree.
+ * Looks for separable parts if 'split' is set and there is a single tree.
+ */
+static MATHS_PROGRAM *
+compile ( MATHS_TREE_ELEMENT **heads,
+          const gint           n,
+          const gboolean       split )
+{
+  MATHS_PROGRAM *prog;
+  GArray *code;
+  CSE cse;
+  gint key;
+  gint *varies, *results;
+  gint vary, root, i, j;
+
+  prog = (MATHS_PROGRAM *) g_malloc ( sizeof(MATHS_PROGRAM) );
+  prog->code = NULL;
+  prog->len = 0;
+  prog->nregs = 0;
+  prog->flags = 0;
+  prog->ncaches = 0;
+  prog->nouts = n;
+  prog->vary = MATHS_PROG_VARY_NONE;
+  prog->separable = MATHS_PROG_SEP_NOT;
+  prog->sep_op = MATHS_PROG_OP_RET;
+  prog->sep_x_first = TRUE;
+  prog->sep_x = NULL;
+  prog->sep_y = NULL;
+  prog->jit = NULL;
+
+  code = g_array_new ( FALSE, FALSE, sizeof(MATHS_INSTR) );
+  varies = g_new ( gint, n );
+  results = g_new ( gint, n );
+  cse_init ( &cse, heads, n );
+
+  for ( i=0; i<n; ++i )
+    {
+      /* identical trees share their result */
+      key = maths_simplify_key ( heads[i], cse.keys );
+
+      for ( j=0; j<i; ++j )
+        if ( ( key != 0 ) && ( maths_simplify_key ( heads[j], cse.keys ) == key ) )
+          break;
+
+      results[i] = j;
+
+      if ( j < i )
+        {
+          varies[i] = varies[j];
+          continue;
+        }
+
+      if ( !compile_element ( prog, code, &cse, heads[i], i, &varies[i], &root ) )
+        {
+#ifdef VERBOSE
+          error ( "maths_prog_compile", _("unable to lower the tree") );
+#endif
+          cse_free ( &cse );
+          g_free ( varies );
+          g_free ( results );
+          g_array_free ( code, TRUE );
+          g_free ( prog );
+          return NULL;
+        }
+
+      /* a formula varying only with x is entirely read from the cache */
+      if ( varies[i] == MATHS_PROG_VARY_X )
+        g_array_index ( code, MATHS_INSTR, root ).cache = prog->ncaches++;
+
+      prog->vary |= varies[i];
+    }
+
+  for ( i=0; i<n; ++i )
+    emit ( prog, code, MATHS_PROG_OP_RET, results[i], 0, 0, 0.0, NULL, varies[i] );
+
+  /* the shared registers go above the others */
+  for ( i=0; i<code->len; ++i )
+    {
+      MATHS_INSTR *instr = &g_array_index ( code, MATHS_INSTR, i );
+
+      if ( instr->dst < 0 )
+        instr->dst = prog->nregs - 1 - instr->dst;
+      if ( instr->a < 0 )
+        instr->a = prog->nregs - 1 - instr->a;
+      if ( instr->b < 0 )
+        instr->b = prog->nregs - 1 - instr->b;
+    }
+
+  prog->nregs += cse.nshared;
+  cse_free ( &cse );
+  g_free ( varies );
+  g_free ( results );
+
+  prog->len = code->len;
+  prog->code = (MATHS_INSTR *) g_array_free ( code, FALSE );
+  vary = prog->vary;
+
+  if ( n > 1 )
+    return prog;
+
+  if ( vary == MATHS_PROG_VARY_X )
+    prog->separable = MATHS_PROG_SEP_X;
+  else if ( vary != MATHS_PROG_VARY_PIXEL )
+    prog->separable = MATHS_PROG_SEP_Y;
+  else if ( split )
+    split_program ( prog, heads[0] );
+
+  return prog;
+}
+
+
+/*
+ * Lowers a maths tree into a register program.
+ */
+MATHS_PROGRAM *
+maths_prog_compile ( MATHS_TREE_ELEMENT *head )
+{
+  return compile ( &head, 1, TRUE );
+}
+
+
+/*
+ * Lowers n maths trees into a single program, computing their common
+ * subexpressions once.
+ */
+MATHS_PROGRAM *
+maths_prog_compile_multi ( MATHS_TREE_ELEMENT **heads,
+                           const gint           n )
+{
+  return compile ( heads, n, FALSE );
+}
+
+
+/*
+ * Runs a program in the registers 'R'.
+ */
+gdouble
+maths_prog_exec ( const MATHS_PROGRAM *prog,
+                  gdouble             *R )
+{
+  const MATHS_INSTR *ip = prog->code;
+  gdouble tmp;
+  gint i;
+
+#ifdef MATHS_PROG_COMPUTED_GOTO
+#define VM_LABEL(OP) [MATHS_PROG_OP_##OP] = &&L_##OP
+#define VM_BEGIN     goto *dispatch[ip->opcode];
+#define VM_CASE(OP)  L_##OP:
+#define VM_NEXT      goto *dispatch[(++ip)->opcode]
+#define VM_END
+
+  static const void *dispatch[] =
+    {
+      VM_LABEL(CONST), VM_LABEL(LOAD), VM_LABEL(MOV),
+      VM_LABEL(ADD), VM_LABEL(SUB), VM_LABEL(MUL), VM_LABEL(DIV), VM_LABEL(POW), VM_LABEL(MOD), VM_LABEL(MODK),
+      VM_LABEL(RED), VM_LABEL(GRAY), VM_LABEL(GREEN), VM_LABEL(BLUE), VM_LABEL(ALPHA), VM_LABEL(RGB),
+      VM_LABEL(RAND), VM_LABEL(ABS), VM_LABEL(SIGN),
+      VM_LABEL(SIN), VM_LABEL(SINH), VM_LABEL(ASIN), VM_LABEL(ASINH),
+      VM_LABEL(COS), VM_LABEL(COSH), VM_LABEL(ACOS), VM_LABEL(ACOSH),
+      VM_LABEL(TAN), VM_LABEL(TANH), VM_LABEL(ATAN), VM_LABEL(ATAN2), VM_LABEL(ATANH),
+      VM_LABEL(RAD), VM_LABEL(DEG), VM_LABEL(SQRT), VM_LABEL(CBRT),
+      VM_LABEL(LOG), VM_LABEL(LOG2), VM_LABEL(LOG10), VM_LABEL(EXP),
+      VM_LABEL(CEIL), VM_LABEL(ROUND), VM_LABEL(MIN), VM_LABEL(MAX), VM_LABEL(AVG),
+      VM_LABEL(SINCOS), VM_LABEL(COSSIN), VM_LABEL(SINHCOSH), VM_LABEL(COSHSINH),
+      VM_LABEL(RET)
+    };
+#else
+#define VM_BEGIN     for ( ;; ) switch ( ip->opcode ) {
+#define VM_CASE(OP)  case MATHS_PROG_OP_##OP:
+#define VM_NEXT      ++ip; continue
+#define VM_END       }
+#endif
+
+  VM_BEGIN
+
+  VM_CASE(CONST) R[ip->dst] = ip->value; VM_NEXT;
+  VM_CASE(LOAD)  R[ip->dst] = *ip->var; VM_NEXT;
+  VM_CASE(MOV)   R[ip->dst] = R[ip->a]; VM_NEXT;
+
+  VM_CASE(ADD)   R[ip->dst] = R[ip->a] + R[ip->b]; VM_NEXT;
+  VM_CASE(SUB)   R[ip->dst] = R[ip->a] - R[ip->b]; VM_NEXT;
+  VM_CASE(MUL)   R[ip->dst] = R[ip->a] * R[ip->b]; VM_NEXT;
+  VM_CASE(DIV)   R[ip->dst] = R[ip->a] / R[ip->b]; VM_NEXT;
+  VM_CASE(POW)   R[ip->dst] = pow ( R[ip->a], R[ip->b] ); VM_NEXT;
+  VM_CASE(MOD)   R[ip->dst] = (gdouble) ((gint) R[ip->a] % (gint) R[ip->b]); VM_NEXT;
+  VM_CASE(MODK)  R[ip->dst] = (gdouble) ((gint) R[ip->a] % (gint) ip->value); VM_NEXT;
+
+  VM_CASE(RED)   R[ip->dst] = get_red_at ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+  VM_CASE(GRAY)  R[ip->dst] = get_gray_at ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+  VM_CASE(GREEN) R[ip->dst] = get_green_at ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+  VM_CASE(BLUE)  R[ip->dst] = get_blue_at ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+  VM_CASE(ALPHA) R[ip->dst] = get_alpha_at ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+  VM_CASE(RGB)   R[ip->dst] = get_rgb_at ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+
+  VM_CASE(RAND)  R[ip->dst] = g_random_double ( ); VM_NEXT;
+  VM_CASE(ABS)   R[ip->dst] = fabs ( R[ip->a] ); VM_NEXT;
+  VM_CASE(SIGN)
+    tmp = R[ip->a];
+    R[ip->dst] = ( tmp == 0.0 ) ? 0.0 : ( ( tmp > 0.0 ) ? 1.0 : -1.0 );
+    VM_NEXT;
+
+  VM_CASE(SIN)   R[ip->dst] = sin ( R[ip->a] ); VM_NEXT;
+  VM_CASE(SINH)  R[ip->dst] = sinh ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ASIN)  R[ip->dst] = asin ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ASINH) R[ip->dst] = asinh ( R[ip->a] ); VM_NEXT;
+  VM_CASE(COS)   R[ip->dst] = cos ( R[ip->a] ); VM_NEXT;
+  VM_CASE(COSH)  R[ip->dst] = cosh ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ACOS)  R[ip->dst] = acos ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ACOSH) R[ip->dst] = acosh ( R[ip->a] ); VM_NEXT;
+  VM_CASE(TAN)   R[ip->dst] = tan ( R[ip->a] ); VM_NEXT;
+  VM_CASE(TANH)  R[ip->dst] = tanh ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ATAN)  R[ip->dst] = atan ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ATAN2) R[ip->dst] = atan2 ( R[ip->a], R[ip->a+1] ); VM_NEXT;
+  VM_CASE(ATANH) R[ip->dst] = atanh ( R[ip->a] ); VM_NEXT;
+  VM_CASE(RAD)   R[ip->dst] = R[ip->a] * (G_PI/180.0); VM_NEXT;
+  VM_CASE(DEG)   R[ip->dst] = R[ip->a] * (180.0/G_PI); VM_NEXT;
+  VM_CASE(SQRT)  R[ip->dst] = sqrt ( R[ip->a] ); VM_NEXT;
+  VM_CASE(CBRT)  R[ip->dst] = cbrt ( R[ip->a] ); VM_NEXT;
+  VM_CASE(LOG)   R[ip->dst] = log ( R[ip->a] ); VM_NEXT;
+  VM_CASE(LOG2)  R[ip->dst] = log2 ( R[ip->a] ); VM_NEXT;
+  VM_CASE(LOG10) R[ip->dst] = log10 ( R[ip->a] ); VM_NEXT;
+  VM_CASE(EXP)   R[ip->dst] = exp ( R[ip->a] ); VM_NEXT;
+  VM_CASE(CEIL)  R[ip->dst] = ceil ( R[ip->a] ); VM_NEXT;
+  VM_CASE(ROUND) R[ip->dst] = round ( R[ip->a] ); VM_NEXT;
+
+  VM_CASE(MIN)
+    tmp = G_MAXDOUBLE;
+    for ( i=ip->a; i<(ip->a+ip->b); ++i )
+      if ( R[i] < tmp )
+        tmp = R[i];
+    R[ip->dst] = tmp;
+    VM_NEXT;
+
+  VM_CASE(MAX)
+    tmp = G_MINDOUBLE;
+    for ( i=ip->a; i<(ip->a+ip->b); ++i )
+      if ( R[i] > tmp )
+        tmp = R[i];
+    R[ip->dst] = tmp;
+    VM_NEXT;
+
+  VM_CASE(AVG)
+    tmp = 0.0;
+    for ( i=ip->a; i<(ip->a+ip->b); ++i )
+      tmp += R[i];
+    R[ip->dst] = tmp / (gdouble) ip->b;
+    VM_NEXT;
+
+  VM_CASE(SINCOS)   R[ip->dst] = maths_prog_sincos ( R[ip->a], &R[ip->b] ); VM_NEXT;
+  VM_CASE(COSSIN)   R[ip->b] = maths_prog_sincos ( R[ip->a], &R[ip->dst] ); VM_NEXT;
+  VM_CASE(SINHCOSH) R[ip->dst] = maths_prog_sinhcosh ( R[ip->a], &R[ip->b] ); VM_NEXT;
+  VM_CASE(COSHSINH) R[ip->b] = maths_prog_sinhcosh ( R[ip->a], &R[ip->dst] ); VM_NEXT;
+
+  VM_CASE(RET)
+    return R[ip->dst];
+
+  VM_END
+
+  return 0.0;
+}
+
+
+/*
+ * Returns the cache of a program in a row, 'hit' tells whether it holds the
+ * values of the current x lanes.
+ */
+static gdouble *
+row_get_cache ( MATHS_ROW           *row,
+                const MATHS_PROGRAM *prog,
+                gboolean            *hit )
+{
+  MATHS_ROW_CACHE *cache = NULL;
+  gint i;
+
+  for ( i=0; i<row->ncaches; ++i )
+    if ( row->caches[i].prog == prog )
+      {
+        cache = &row->caches[i];
+        break;
+      }
+
+  if ( cache == NULL )
+    {
+      row->caches = g_renew ( MATHS_ROW_CACHE, row->caches, row->ncaches + 1 );
+      cache = &row->caches[row->ncaches++];
+      cache->prog = prog;
+      cache->size = 0;
+      cache->values = NULL;
+    }
+  else if ( cache->x_version == row->x_version )
+    {
+      *hit = TRUE;
+      return cache->values;
+    }
+
+  if ( prog->ncaches * row->n > cache->size )
+    {
+      g_free ( cache->values );
+      cache->size = prog->ncaches * row->n;
+      cache->values = g_new ( gdouble, cache->size );
+    }
+
+  cache->x_version = row->x_version;
+  *hit = FALSE;
+
+  return cache->values;
+}
+
+
+/*
+ * Runs a program over a row, each instruction processes every pixel before
+ * the next one is dispatched.
+ * The registers belong to the row, so a program may run on several rows at
+ * once.
+ * Instructions which do not vary with x only compute their first lane, the
+ * x-only ones are skipped when the row cache is still valid.
+ * Runs of per-pixel instructions compiled to native code are handed over to
+ * their kernel.
+ * Each result of the program is written to the matching buffer of 'outs'.
+ */
+void
+maths_prog_exec_row_multi ( const MATHS_PROGRAM  *prog,
+                            MATHS_ROW            *row,
+                            gdouble             **outs )
+{
+  const MATHS_INSTR *ip;
+  const gint n = row->n;
+  const struct pixel_source_t *src = row->source;
+  const MATHS_JIT_SEGMENT *seg = NULL, *seg_end = NULL;
+  gdouble *D, *A, *B, *cache = NULL;
+  gboolean hit = FALSE;
+  gdouble tmp;
+  gint i, k, m;
+
+  if ( prog->nregs * n > row->regs_size )
+    {
+      g_free ( row->regs );
+      row->regs_size = prog->nregs * n;
+      row->regs = g_new ( gdouble, row->regs_size );
+    }
+
+  if ( prog->ncaches > 0 )
+    cache = row_get_cache ( row, prog, &hit );
+
+  if ( prog->jit != NULL )
+    {
+      seg = prog->jit->segments;
+      seg_end = seg + prog->jit->nsegments;
+    }
+
+#define ROW_LOOP(EXPR) for ( i=0; i<m; ++i ) D[i] = (EXPR); break
+
+  for ( ip=prog->code; ip->opcode!=MATHS_PROG_OP_RET; ++ip )
+    {
+      if ( ( seg < seg_end ) && ( ip == prog->code + seg->first ) )
+        {
+          seg->kernel ( row );
+          ip = prog->code + seg->last;
+          ++seg;
+          continue;
+        }
+
+      D = row->regs + ip->dst*n;
+      A = row->regs + ip->a*n;
+      B = row->regs + ip->b*n;
+
+      if ( hit && ( ip->vary == MATHS_PROG_VARY_X ) )
+        {
+          if ( ip->cache >= 0 )
+            memcpy ( D, cache + ip->cache*n, n*sizeof(gdouble) );
+
+          continue;
+        }
+
+      m = ( ip->vary & MATHS_PROG_VARY_X ) ? n : 1;
+
+      switch ( ip->opcode )
+        {
+        case MATHS_PROG_OP_CONST: ROW_LOOP ( ip->value );
+
+        case MATHS_PROG_OP_LOAD:
+          switch ( ip->b )
+            {
+            case MATHS_VAL_ID_X: memcpy ( D, row->x, n*sizeof(gdouble) ); break;
+            case MATHS_VAL_ID_Y: D[0] = row->y; break;
+            case MATHS_VAL_ID_R: memcpy ( D, row->r, n*sizeof(gdouble) ); break;
+            case MATHS_VAL_ID_T: memcpy ( D, row->t, n*sizeof(gdouble) ); break;
+            default: D[0] = *ip->var; break;
+            }
+          break;
+
+        case MATHS_PROG_OP_MOV: ROW_LOOP ( A[i] );
+
+        case MATHS_PROG_OP_ADD: ROW_LOOP ( A[i] + B[i] );
+        case MATHS_PROG_OP_SUB: ROW_LOOP ( A[i] - B[i] );
+        case MATHS_PROG_OP_MUL: ROW_LOOP ( A[i] * B[i] );
+        case MATHS_PROG_OP_DIV: ROW_LOOP ( A[i] / B[i] );
+        case MATHS_PROG_OP_POW: ROW_LOOP ( pow ( A[i], B[i] ) );
+        case MATHS_PROG_OP_MOD: ROW_LOOP ( (gdouble) ((gint) A[i] % (gint) B[i]) );
+
+        case MATHS_PROG_OP_MODK:
+          k = (gint) ip->value;
+
+          /* i % 2^n is i minus i rounded towards zero to a multiple of 2^n */
+          if ( ( k > 0 ) && ( ( k & (k - 1) ) == 0 ) )
+            {
+              for ( i=0; i<m; ++i )
+                {
+                  const gint v = (gint) A[i];
+                  D[i] = (gdouble) ( v - ( ( v + ( ( v >> 31 ) & (k - 1) ) ) & -k ) );
+                }
+            }
+          else
+            {
+              for ( i=0; i<m; ++i )
+                D[i] = (gdouble) ((gint) A[i] % k);
+            }
+          break;
+
+        case MATHS_PROG_OP_RED:   ROW_LOOP ( source_get_red ( src, A[i], A[i+n] ) );
+        case MATHS_PROG_OP_GRAY:  ROW_LOOP ( source_get_gray ( src, A[i], A[i+n] ) );
+        case MATHS_PROG_OP_GREEN: ROW_LOOP ( source_get_green ( src, A[i], A[i+n] ) );
+        case MATHS_PROG_OP_BLUE:  ROW_LOOP ( source_get_blue ( src, A[i], A[i+n] ) );
+        case MATHS_PROG_OP_ALPHA: ROW_LOOP ( source_get_alpha ( src, A[i], A[i+n] ) );
+        case MATHS_PROG_OP_RGB:   ROW_LOOP ( source_get_chan ( src, row->chan, A[i], A[i+n] ) );
+
+        case MATHS_PROG_OP_RAND:  ROW_LOOP ( g_random_double ( ) );
+        case MATHS_PROG_OP_ABS:   ROW_LOOP ( fabs ( A[i] ) );
+        case MATHS_PROG_OP_SIGN:  ROW_LOOP ( ( A[i] == 0.0 ) ? 0.0 : ( ( A[i] > 0.0 ) ? 1.0 : -1.0 ) );
+        case MATHS_PROG_OP_SIN:   ROW_LOOP ( sin ( A[i] ) );
+        case MATHS_PROG_OP_SINH:  ROW_LOOP ( sinh ( A[i] ) );
+        case MATHS_PROG_OP_ASIN:  ROW_LOOP ( asin ( A[i] ) );
+        case MATHS_PROG_OP_ASINH: ROW_LOOP ( asinh ( A[i] ) );
+        case MATHS_PROG_OP_COS:   ROW_LOOP ( cos ( A[i] ) );
+        case MATHS_PROG_OP_COSH:  ROW_LOOP ( cosh ( A[i] ) );
+        case MATHS_PROG_OP_ACOS:  ROW_LOOP ( acos ( A[i] ) );
+        case MATHS_PROG_OP_ACOSH: ROW_LOOP ( acosh ( A[i] ) );
+        case MATHS_PROG_OP_TAN:   ROW_LOOP ( tan ( A[i] ) );
+        case MATHS_PROG_OP_TANH:  ROW_LOOP ( tanh ( A[i] ) );
+        case MATHS_PROG_OP_ATAN:  ROW_LOOP ( atan ( A[i] ) );
+        case MATHS_PROG_OP_ATAN2: ROW_LOOP ( atan2 ( A[i], A[i+n] ) );
+        case MATHS_PROG_OP_ATANH: ROW_LOOP ( atanh ( A[i] ) );
+        case MATHS_PROG_OP_RAD:   ROW_LOOP ( A[i] * (G_PI/180.0) );
+        case MATHS_PROG_OP_DEG:   ROW_LOOP ( A[i] * (180.0/G_PI) );
+        case MATHS_PROG_OP_SQRT:  ROW_LOOP ( sqrt ( A[i] ) );
+        case MATHS_PROG_OP_CBRT:  ROW_LOOP ( cbrt ( A[i] ) );
+        case MATHS_PROG_OP_LOG:   ROW_LOOP ( log ( A[i] ) );
+        case MATHS_PROG_OP_LOG2:  ROW_LOOP ( log2 ( A[i] ) );
+        case MATHS_PROG_OP_LOG10: ROW_LOOP ( log10 ( A[i] ) );
+        case MATHS_PROG_OP_EXP:   ROW_LOOP ( exp ( A[i] ) );
+        case MATHS_PROG_OP_CEIL:  ROW_LOOP ( ceil ( A[i] ) );
+        case MATHS_PROG_OP_ROUND: ROW_LOOP ( round ( A[i] ) );
+
+        case MATHS_PROG_OP_MIN:
+          for ( i=0; i<m; ++i )
+            {
+              tmp = G_MAXDOUBLE;
+              for ( k=0; k<ip->b; ++k )
+                if ( A[i+k*n] < tmp )
+                  tmp = A[i+k*n];
+              D[i] = tmp;
+            }
+          break;
+
+        case MATHS_PROG_OP_MAX:
+          for ( i=0; i<m; ++i )
+            {
+              tmp = G_MINDOUBLE;
+              for ( k=0; k<ip->b; ++k )
+                if ( A[i+k*n] > tmp )
+                  tmp = A[i+k*n];
+              D[i] = tmp;
+            }
+          break;
+
+        case MATHS_PROG_OP_AVG:
+          for ( i=0; i<m; ++i )
+            {
+              tmp = 0.0;
+              for ( k=0; k<ip->b; ++k )
+                tmp += A[i+k*n];
+              D[i] = tmp / (gdouble) ip->b;
+            }
+          break;
+
+        case MATHS_PROG_OP_SINCOS:   ROW_LOOP ( maths_prog_sincos ( A[i], &B[i] ) );
+        case MATHS_PROG_OP_COSSIN:
+          for ( i=0; i<m; ++i )
+            B[i] = maths_prog_sincos ( A[i], &D[i] );
+          break;
+
+        case MATHS_PROG_OP_SINHCOSH: ROW_LOOP ( maths_prog_sinhcosh ( A[i], &B[i] ) );
+        case MATHS_PROG_OP_COSHSINH:
+          for ( i=0; i<m; ++i )
+            B[i] = maths_prog_sinhcosh ( A[i], &D[i] );
+          break;
+        }
+
+      if ( ip->spread )
+        for ( i=1; i<n; ++i )
+          D[i] = D[0];
+      else if ( ip->cache >= 0 )
+        memcpy ( cache + ip->cache*n, D, n*sizeof(gdouble) );
+    }
+
+#undef ROW_LOOP
+
+  for ( k=0; k<prog->nouts; ++k, ++ip )
+    if ( ip->vary & MATHS_PROG_VARY_X )
+      memcpy ( outs[k], row->regs + ip->dst*n, n*sizeof(gdouble) );
+    else
+      for ( i=0, tmp=row->regs[ip->dst*n]; i<n; ++i )
+        outs[k][i] = tmp;
+}
+
+
+/*
+ * Runs a single result program over a row.
+ */
+void
+maths_prog_exec_row ( const MATHS_PROGRAM *prog,
+                      MATHS_ROW           *row,
+                      gdouble             *out )
+{
+  maths_prog_exec_row_multi ( prog, row, &out );
+}
+
+
+/*
+ * Combines the parts of a separable program, the loops are kept free of
+ * branches so that the compiler can vectorize them.
+ */
+void
+maths_prog_combine ( const MATHS_PROGRAM *prog,
+                     const gdouble       *xs,
+                     const gdouble        y,
+                     gdouble             *out,
+                     const gint           n )
+{
+  gint i;
+
+  switch ( prog->sep_op )
+    {
+    case MATHS_PROG_OP_ADD:
+      for ( i=0; i<n; ++i )
+        out[i] = xs[i] + y;
+      break;
+
+    case MATHS_PROG_OP_MUL:
+      for ( i=0; i<n; ++i )
+        out[i] = xs[i] * y;
+      break;
+
+    case MATHS_PROG_OP_SUB:
+      if ( prog->sep_x_first )
+        for ( i=0; i<n; ++i )
+          out[i] = xs[i] - y;
+      else
+        for ( i=0; i<n; ++i )
+          out[i] = y - xs[i];
+      break;
+
+    case MATHS_PROG_OP_DIV:
+      if ( prog->sep_x_first )
+        for ( i=0; i<n; ++i )
+          out[i] = xs[i] / y;
+      else
+        for ( i=0; i<n; ++i )
+          out[i] = y / xs[i];
+      break;
+    }
+}
+
+
+/*
+ * Returns sin(a) and stores cos(a) in c: the compiler turns both calls into
+ * a single sincos() where the C library has it.
+ */
+gdouble
+maths_prog_sincos ( const gdouble  a,
+                    gdouble       *c )
+{
+  *c = cos ( a );
+  return sin ( a );
+}
+
+
+/*
+ * Returns sinh(a) and stores cosh(a) in c, both derived from expm1(|a|) as
+ * the C library does it; large and invalid arguments are left to sinh()
+ * and cosh().
+ */
+gdouble
+maths_prog_sinhcosh ( const gdouble  a,
+                      gdouble       *c )
+{
+  const gdouble v = fabs ( a );
+  gdouble t, w, s;
+
+  if ( !( v < 22.0 ) )
+    {
+      *c = cosh ( a );
+      return sinh ( a );
+    }
+
+  t = expm1 ( v );
+  w = 1.0 + t;
+
+  if ( v < 1.0 )
+    s = 0.5 * ( 2.0 * t - t * t / w );
+  else
+    s = 0.5 * ( t + t / w );
+
+  if ( v < 0.5 * G_LN2 )
+    *c = 1.0 + ( t * t ) / ( w + w );
+  else
+    *c = 0.5 * w + 0.5 / w;
+
+  return copysign ( s, a );
+}
+
+
+/*
+ * Allocates a row.
+ */
+MATHS_ROW *
+maths_row_new ( const gint n )
+{
+  MATHS_ROW *row;
+
+  row = (MATHS_ROW *) g_malloc ( sizeof(MATHS_ROW) );
+  row->n = n;
+  row->y = 0.0;
+  row->x = g_new0 ( gdouble, n );
+  row->r = g_new0 ( gdouble, n );
+  row->t = g_new0 ( gdouble, n );
+  row->chan = 0;
+  row->source = NULL;
+  row->regs = NULL;
+  row->regs_size = 0;
+  row->x0 = 0.0;
+  row->dx = 0.0;
+  row->x_n = 0;
+  row->x_version = 0;
+  row->caches = NULL;
+  row->ncaches = 0;
+
+  return row;
+}
+
+
+/*
+ * Sets the abscissas of a row, the x-only values cached for the row are
+ * dropped only if they change.
+ */
+void
+maths_row_set_x ( MATHS_ROW     *row,
+                  const gdouble  x0,
+                  const gdouble  dx )
+{
+  gdouble x;
+  gint i;
+
+  if ( ( row->x_n == row->n ) && ( row->x0 == x0 ) && ( row->dx == dx ) )
+    return;
+
+  for ( i=0, x=x0; i<row->n; ++i, x+=dx )
+    row->x[i] = x;
+
+  row->x0 = x0;
+  row->dx = dx;
+  row->x_n = row->n;
+  ++row->x_version;
+}
+
+
+/*
+ * Cartesian to polar conversion of a row (see coords_set_polar_from_cartesian).
+ * The radius and the angle are computed separately, so that a formula reading
+ * only one of them does not pay for the other.
+ */
+void
+maths_row_set_polar ( MATHS_ROW     *row,
+                      const gdouble  cx,
+                      const gdouble  py,
+                      const gint     usage )
+{
+  gdouble px;
+  gint i;
+
+  if ( usage & MATHS_PROG_USES_R )
+    for ( i=0; i<row->n; ++i )
+      {
+        px = row->x[i] - cx;
+
+        if ( ( px == 0.0 ) && ( py == 0.0 ) )
+          row->r[i] = 0.0;
+        else
+          row->r[i] = sqrt ( (px*px) + (py*py) );
+      }
+
+  if ( usage & MATHS_PROG_USES_T )
+    for ( i=0; i<row->n; ++i )
+      {
+        px = row->x[i] - cx;
+
+        if ( ( px == 0.0 ) && ( py == 0.0 ) )
+          row->t[i] = 0.0;
+        else
+          row->t[i] = atan2 ( px, py );
+      }
+}
+
+
+/*
+ * Destroys a row.
+ */
+void
+maths_row_free ( MATHS_ROW *row )
+{
+  gint i;
+
+  if ( row == NULL )
+    return;
+
+  g_free ( row->x );
+  g_free ( row->r );
+  g_free ( row->t );
+  g_free ( row->regs );
+
+  for ( i=0; i<row->ncaches; ++i )
+    g_free ( row->caches[i].values );
+
+  g_free ( row->caches );
+  g_free ( row );
+}
+
+
+/*
+ * Destroys a program.
+ */
+void
+maths_prog_free ( MATHS_PROGRAM *prog )
+{
+  if ( prog == NULL )
+    return;
+
+  if ( prog->code != NULL )
+    g_free ( prog->code );
+
+  maths_prog_free ( prog->sep_x );
+  maths_prog_free ( prog->sep_y );
+  maths_jit_free ( prog->jit );
+  g_free ( prog );
+}
@@ -0,0 +1,220 @@
+/*
+ * maths_prog.h
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef __MATHS_PROG_H__
+#define __MATHS_PROG_H__
+
+
+#ifndef __MATHS_TREE_H__
+#include "maths_tree.h"
+#endif
+
+
+/* Image sampled by the pixel functions (see render.h) */
+struct pixel_source_t;
+
+/* Native code of a program (see maths_jit.h) */
+struct maths_jit_t;
+
+
+/* Opcodes */
+enum
+{
+  MATHS_PROG_OP_CONST, MATHS_PROG_OP_LOAD, MATHS_PROG_OP_MOV,
+  MATHS_PROG_OP_ADD, MATHS_PROG_OP_SUB, MATHS_PROG_OP_MUL,
+  MATHS_PROG_OP_DIV, MATHS_PROG_OP_POW, MATHS_PROG_OP_MOD, MATHS_PROG_OP_MODK,
+  MATHS_PROG_OP_RED, MATHS_PROG_OP_GRAY, MATHS_PROG_OP_GREEN, MATHS_PROG_OP_BLUE,
+  MATHS_PROG_OP_ALPHA, MATHS_PROG_OP_RGB, MATHS_PROG_OP_RAND, MATHS_PROG_OP_ABS,
+  MATHS_PROG_OP_SIGN, MATHS_PROG_OP_SIN, MATHS_PROG_OP_SINH, MATHS_PROG_OP_ASIN,
+  MATHS_PROG_OP_ASINH, MATHS_PROG_OP_COS, MATHS_PROG_OP_COSH, MATHS_PROG_OP_ACOS,
+  MATHS_PROG_OP_ACOSH, MATHS_PROG_OP_TAN, MATHS_PROG_OP_TANH, MATHS_PROG_OP_ATAN,
+  MATHS_PROG_OP_ATAN2, MATHS_PROG_OP_ATANH, MATHS_PROG_OP_RAD, MATHS_PROG_OP_DEG,
+  MATHS_PROG_OP_SQRT, MATHS_PROG_OP_CBRT, MATHS_PROG_OP_LOG, MATHS_PROG_OP_LOG2,
+  MATHS_PROG_OP_LOG10, MATHS_PROG_OP_EXP, MATHS_PROG_OP_CEIL, MATHS_PROG_OP_ROUND,
+  MATHS_PROG_OP_MIN, MATHS_PROG_OP_MAX, MATHS_PROG_OP_AVG,
+  MATHS_PROG_OP_SINCOS, MATHS_PROG_OP_COSSIN, MATHS_PROG_OP_SINHCOSH, MATHS_PROG_OP_COSHSINH,
+  MATHS_PROG_OP_RET
+};
+
+
+/* Usage flags of a program
+   MATHS_PROG_USES_SOURCE:     samples the source image
+   MATHS_PROG_SAMPLES_AROUND:  samples it elsewhere than at (x,y)
+   MATHS_PROG_USES_R:          reads the 'r' variable
+   MATHS_PROG_USES_T:          reads the 't' variable
+   MATHS_PROG_USES_CHAN:       samples the channel being rendered, rgb() */
+enum
+{
+  MATHS_PROG_USES_SOURCE    = 1 << 0,
+  MATHS_PROG_SAMPLES_AROUND = 1 << 1,
+  MATHS_PROG_USES_R         = 1 << 2,
+  MATHS_PROG_USES_T         = 1 << 3,
+  MATHS_PROG_USES_CHAN      = 1 << 4
+};
+
+
+/* What the result of an instruction varies with, along the rows being rendered
+   (w and h are constant while a row is alive) */
+enum
+{
+  MATHS_PROG_VARY_NONE  = 0,
+  MATHS_PROG_VARY_X     = 1 << 0,
+  MATHS_PROG_VARY_Y     = 1 << 1,
+  MATHS_PROG_VARY_PIXEL = MATHS_PROG_VARY_X | MATHS_PROG_VARY_Y
+};
+
+
+/* Separability of a program
+   MATHS_PROG_SEP_NOT: varies with both x and y
+   MATHS_PROG_SEP_X:   varies with x only
+   MATHS_PROG_SEP_Y:   varies with y only, or not at all
+   MATHS_PROG_SEP_XY:  sep_op applied to a part varying with x only and
+                       a part varying with y only */
+enum
+{
+  MATHS_PROG_SEP_NOT, MATHS_PROG_SEP_X, MATHS_PROG_SEP_Y, MATHS_PROG_SEP_XY
+};
+
+
+/* Instruction: dst = opcode ( a, b )
+   For n-ary functions, the arguments are stored in registers a to a+b-1.
+   For loads, b is the MATHS_VAL_ID_* identifier of the variable.
+   Moves copy register a, they keep the values of common subexpressions.
+   MODK is a modulo by the constant integer 'value'.
+   SINCOS computes sin(a) into dst and cos(a) into the register b, COSSIN
+   does the opposite; SINHCOSH and COSHSINH do the same with sinh and cosh.
+   Over a row, instructions which do not vary with x run on a single lane:
+   'spread' copies that lane to the others when a per-pixel instruction needs
+   them. The results of x-only instructions used by per-pixel ones are kept in
+   the slot 'cache' of the row cache, so they are computed once per column. */
+typedef struct maths_instr_t
+{
+  gint            opcode;
+  gint            dst;
+  gint            a;
+  gint            b;
+  gdouble         value;
+  const gdouble  *var;
+  gint            vary;
+  gint            cache;
+  gboolean        spread;
+} MATHS_INSTR ;
+
+
+/* Program */
+typedef struct maths_program_t
+{
+  MATHS_INSTR             *code;
+  gint                     len;
+  gint                     nregs;
+  gint                     flags;
+  gint                     ncaches;
+  gint                     nouts;        /* number of results, the code ends with one RET each */
+  gint                     vary;
+  gint                     separable;
+  gint                     sep_op;
+  gboolean                 sep_x_first;  /* the x part is the left operand */
+  struct maths_program_t  *sep_x;
+  struct maths_program_t  *sep_y;
+  struct maths_jit_t      *jit;          /* native code of the per-pixel instructions */
+} MATHS_PROGRAM ;
+
+
+/* Results of the x-only instructions of a program, for given x lanes */
+typedef struct maths_row_cache_t
+{
+  const struct maths_program_t  *prog;
+  guint                          x_version;
+  gint                           size;
+  gdouble                       *values;
+} MATHS_ROW_CACHE ;
+
+
+/* Row of pixels evaluated at once: x, r and t hold one value per pixel.
+   A row also holds everything a program needs to run, so that each thread
+   evaluates its own rows without touching any global state.
+   x_version changes each time maths_row_set_x() changes the x lanes. */
+typedef struct maths_row_t
+{
+  gint                          n;
+  gdouble                       y;
+  gdouble                      *x;
+  gdouble                      *r;
+  gdouble                      *t;
+  gint                          chan;
+  const struct pixel_source_t  *source;
+  gdouble                      *regs;
+  gint                          regs_size;
+  gdouble                       x0;
+  gdouble                       dx;
+  gint                          x_n;
+  guint                         x_version;
+  MATHS_ROW_CACHE              *caches;
+  gint                          ncaches;
+} MATHS_ROW ;
+
+
+/* Lowers a maths tree into a register program */
+MATHS_PROGRAM *maths_prog_compile ( MATHS_TREE_ELEMENT *head );
+
+/* Runs a program and returns the value of its result register. 'regs' holds
+   the prog->nregs registers, each thread has its own */
+gdouble maths_prog_exec ( const MATHS_PROGRAM *prog, gdouble *regs );
+
+/* Lowers n maths trees into a program with n results */
+MATHS_PROGRAM *maths_prog_compile_multi ( MATHS_TREE_ELEMENT **heads, const gint n );
+
+/* Runs a program over a whole row, writing row->n results to out */
+void maths_prog_exec_row ( const MATHS_PROGRAM *prog, MATHS_ROW *row, gdouble *out );
+
+/* Runs a program with several results over a whole row, the result i goes to outs[i] */
+void maths_prog_exec_row_multi ( const MATHS_PROGRAM *prog, MATHS_ROW *row, gdouble **outs );
+
+/* Combines the parts of a MATHS_PROG_SEP_XY program: out[i] = xs[i] op y */
+void maths_prog_combine ( const MATHS_PROGRAM *prog, const gdouble *xs, const gdouble y, gdouble *out, const gint n );
+
+/* Returns sin(a) and stores cos(a) in c, both computed at once */
+gdouble maths_prog_sincos ( const gdouble a, gdouble *c );
+
+/* Returns sinh(a) and stores cosh(a) in c, from a single exponential */
+gdouble maths_prog_sinhcosh ( const gdouble a, gdouble *c );
+
+/* Allocates a row of n pixels */
+MATHS_ROW *maths_row_new ( const gint n );
+
+/* Sets the abscissas of a row: x0 for the first pixel, growing by dx */
+void maths_row_set_x ( MATHS_ROW *row, const gdouble x0, const gdouble dx );
+
+/* Computes the polar coordinates of a row, cx is the abscissa of the center
+   and py the ordinate of the row relatively to the center.
+   Only the coordinates flagged in 'usage' (MATHS_PROG_USES_R/T) are computed */
+void maths_row_set_polar ( MATHS_ROW *row, const gdouble cx, const gdouble py, const gint usage );
+
+/* Destroys a row */
+void maths_row_free ( MATHS_ROW *row );
+
+/* Destroys a program */
+void maths_prog_free ( MATHS_PROGRAM *prog );
+
+
+#endif
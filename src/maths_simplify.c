@@ -0,0 +1,545 @@
+/*
+ * maths_simplify.c
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <glib.h>
+#include "maths_op.h"
+#include "maths_val.h"
+#include "maths_func.h"
+#include "maths_simplify.h"
+
+
+/*
+ * Returns TRUE if an element is a constant, 'v' receives its value.
+ */
+static gboolean
+get_constant ( MATHS_TREE_ELEMENT *el,
+               gdouble            *v )
+{
+  MATHS_VALUE *val;
+
+  if ( ( el == NULL ) || ( el->exec != maths_val_exec ) )
+    return FALSE;
+
+  val = (MATHS_VALUE *) el->data;
+
+  if ( val->precalc_code == PRECALC_NOT )
+    return FALSE;
+
+  *v = *val->value;
+  return TRUE;
+}
+
+
+/*
+ * Returns TRUE if an element is a variable: x, y, r, t, w or h.
+ */
+static gboolean
+is_variable ( MATHS_TREE_ELEMENT *el )
+{
+  if ( ( el == NULL ) || ( el->exec != maths_val_exec ) )
+    return FALSE;
+
+  return ( ((MATHS_VALUE *) el->data)->precalc_code == PRECALC_NOT );
+}
+
+
+/*
+ * Returns the operator of an element, 0 if it is not an operation.
+ */
+static gchar
+get_operator ( MATHS_TREE_ELEMENT *el )
+{
+  if ( ( el == NULL ) || ( el->exec != maths_op_exec ) )
+    return '\0';
+
+  return *((MATHS_OPERATOR *) el->data)->name;
+}
+
+
+/*
+ * Returns the left operand of an operation, which replaces it.
+ */
+static MATHS_TREE_ELEMENT *
+keep_left ( MATHS_TREE_ELEMENT *el )
+{
+  return ((MATHS_OPERATOR *) el->data)->l;
+}
+
+
+/*
+ * Turns an operation into the operator 'name'.
+ */
+static void
+set_operator ( MATHS_OPERATOR *op,
+               const gchar     name )
+{
+  MATHS_OPERATOR *ref;
+
+  for ( ref=operators; ref->name!=NULL; ++ref )
+    if ( *ref->name == name )
+      {
+        op->name = ref->name;
+        op->desc = ref->desc;
+        op->precalc_code = ref->precalc_code;
+        op->operation = ref->operation;
+        return;
+      }
+}
+
+
+/* Node of the structural keys: what an element computes, its operands being
+   known by their keys */
+enum { KEY_VARIABLE, KEY_CONSTANT, KEY_OPERATOR, KEY_FUNCTION };
+
+typedef struct key_node_t
+{
+  gint           kind;
+  gint           code;     /* identifier of the variable or of the function,
+                              name of the operator */
+  gconstpointer  value;    /* storage of the variable */
+  guint64        bits;     /* bits of the constant */
+  gint           argc;
+  gint           args[1];  /* keys of the operands */
+} KEY_NODE ;
+
+
+/*
+ * Hashes a node.
+ */
+static guint
+key_node_hash ( gconstpointer data )
+{
+  const KEY_NODE *node = (const KEY_NODE *) data;
+  guint h;
+  gint i;
+
+  h = ( node->kind * 31 + node->code ) * 31 + g_direct_hash ( node->value );
+  h = h * 31 + (guint) ( node->bits ^ ( node->bits >> 32 ) );
+
+  for ( i=0; i<node->argc; ++i )
+    h = h * 31 + node->args[i];
+
+  return h;
+}
+
+
+/*
+ * Tells whether two nodes are the same.
+ */
+static gboolean
+key_node_equal ( gconstpointer a,
+                 gconstpointer b )
+{
+  const KEY_NODE *na = (const KEY_NODE *) a;
+  const KEY_NODE *nb = (const KEY_NODE *) b;
+
+  return ( ( na->kind == nb->kind ) && ( na->code == nb->code ) && ( na->value == nb->value )
+           && ( na->bits == nb->bits ) && ( na->argc == nb->argc )
+           && ( memcmp ( na->args, nb->args, na->argc * sizeof(gint) ) == 0 ) );
+}
+
+
+/*
+ * Allocates a node with room for 'argc' operands.
+ */
+static KEY_NODE *
+key_node_new ( const gint kind,
+               const gint code,
+               const gint argc )
+{
+  KEY_NODE *node;
+
+  node = (KEY_NODE *) g_malloc0 ( sizeof(KEY_NODE) + MAX ( argc - 1, 0 ) * sizeof(gint) );
+  node->kind = kind;
+  node->code = code;
+  node->argc = argc;
+
+  return node;
+}
+
+
+/*
+ * Returns the key of a node, a new one if it was never seen. The node is
+ * freed unless the table keeps it.
+ */
+static gint
+key_node_intern ( MATHS_KEYS *keys,
+                  KEY_NODE   *node )
+{
+  gpointer key;
+
+  if ( ( key = g_hash_table_lookup ( keys->nodes, node ) ) != NULL )
+    {
+      g_free ( node );
+      return GPOINTER_TO_INT ( key );
+    }
+
+  g_hash_table_insert ( keys->nodes, node, GINT_TO_POINTER ( ++keys->last ) );
+  return keys->last;
+}
+
+
+/*
+ * Returns the structural key of an element (recursive), memoised in 'keys'.
+ */
+gint
+maths_simplify_key ( MATHS_TREE_ELEMENT *el,
+                     MATHS_KEYS         *keys )
+{
+  KEY_NODE *node;
+  gpointer key;
+  gboolean unique = FALSE;
+  gint k, i;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return 0;
+
+  if ( g_hash_table_lookup_extended ( keys->elements, el, NULL, &key ) )
+    return GPOINTER_TO_INT ( key );
+
+  if ( el->exec == maths_val_exec )
+    {
+      MATHS_VALUE *val = (MATHS_VALUE *) el->data;
+
+      if ( val->precalc_code == PRECALC_NOT )
+        {
+          node = key_node_new ( KEY_VARIABLE, val->id, 0 );
+          node->value = val->value;
+        }
+      else
+        {
+          node = key_node_new ( KEY_CONSTANT, 0, 0 );
+          memcpy ( &node->bits, val->value, sizeof(node->bits) );
+        }
+    }
+  else if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+
+      node = key_node_new ( KEY_OPERATOR, *op->name, 2 );
+      node->args[0] = maths_simplify_key ( op->l, keys );
+      node->args[1] = maths_simplify_key ( op->r, keys );
+      unique = ( ( node->args[0] == 0 ) || ( node->args[1] == 0 ) );
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      node = key_node_new ( KEY_FUNCTION, func->id, func->argc );
+      unique = ( func->id == MATHS_FUNC_ID_RAND );
+
+      /* the arguments get their keys even if the call repeats nothing */
+      for ( i=0; i<func->argc; ++i )
+        if ( ( node->args[i] = maths_simplify_key ( func->argv[i], keys ) ) == 0 )
+          unique = TRUE;
+    }
+  else
+    return 0;
+
+  if ( unique )
+    {
+      g_free ( node );
+      k = 0;
+    }
+  else
+    k = key_node_intern ( keys, node );
+
+  g_hash_table_insert ( keys->elements, el, GINT_TO_POINTER ( k ) );
+
+  return k;
+}
+
+
+/*
+ * Returns the key of a call of the function 'id' on the element of key 'arg'.
+ */
+gint
+maths_simplify_call_key ( MATHS_KEYS *keys,
+                          const gint  id,
+                          const gint  arg )
+{
+  KEY_NODE *node = key_node_new ( KEY_FUNCTION, id, 1 );
+
+  node->args[0] = arg;
+
+  return key_node_intern ( keys, node );
+}
+
+
+/*
+ * Creates empty tables of keys.
+ */
+MATHS_KEYS *
+maths_simplify_keys_new ( void )
+{
+  MATHS_KEYS *keys = g_new ( MATHS_KEYS, 1 );
+
+  keys->elements = g_hash_table_new ( g_direct_hash, g_direct_equal );
+  keys->nodes = g_hash_table_new_full ( key_node_hash, key_node_equal, g_free, NULL );
+  keys->last = 0;
+
+  return keys;
+}
+
+
+/*
+ * Frees tables of keys.
+ */
+void
+maths_simplify_keys_free ( MATHS_KEYS *keys )
+{
+  g_hash_table_destroy ( keys->nodes );
+  g_hash_table_destroy ( keys->elements );
+  g_free ( keys );
+}
+
+
+/*
+ * Compares the structures of two elements: returns 0 if they compute the
+ * same value, the order of their keys otherwise. Elements calling rand() are
+ * never equal to anything.
+ */
+static gint
+compare_elements ( MATHS_TREE_ELEMENT *a,
+                   MATHS_TREE_ELEMENT *b,
+                   MATHS_KEYS         *keys,
+                   gboolean           *comparable )
+{
+  gint ka = maths_simplify_key ( a, keys );
+  gint kb = maths_simplify_key ( b, keys );
+
+  *comparable = ( ( ka != 0 ) && ( kb != 0 ) );
+
+  return ( *comparable ? ka - kb : 0 );
+}
+
+
+/*
+ * Simplifies an operation whose operands are already simplified (recursive
+ * on the operations it builds). Returns the element replacing it.
+ *  - constant operands are folded
+ *  - a - c becomes a + (-c)
+ *  - the constant operand of a sum or a product goes to the right
+ *  - (a + c1) + c2 becomes a + (c1+c2), the same goes for products
+ *  - (a + c) + b and a + (b + c) become (a + b) + c, the constants of a chain
+ *    of sums or products are gathered at its top and folded
+ *  - a + 0, a * 1, a / 1 and a ^ 1 become a, a ^ 0 becomes 1, a - a becomes 0
+ *    if a is a variable
+ *  - the operands of sums and products are sorted, so that the same terms
+ *    written in another order can be shared
+ */
+static MATHS_TREE_ELEMENT *
+simplify_op ( MATHS_TREE_ELEMENT *el,
+              MATHS_ARENA        *arena,
+              MATHS_KEYS         *keys )
+{
+  MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+  MATHS_OPERATOR *sub;
+  MATHS_TREE_ELEMENT *tmp;
+  gboolean lc, rc, comparable;
+  gdouble a, b, c;
+  gchar name;
+
+  /* the element and its operands may be rewritten */
+  g_hash_table_remove ( keys->elements, el );
+  g_hash_table_remove ( keys->elements, op->l );
+  g_hash_table_remove ( keys->elements, op->r );
+
+  name = *op->name;
+  lc = get_constant ( op->l, &a );
+  rc = get_constant ( op->r, &b );
+
+  /* the modulo by zero is left to the rendering */
+  if ( lc && rc )
+    {
+      if ( ( name == '%' ) && ( (gint) b == 0 ) )
+        return el;
+
+      c = op->operation ( a, b );
+      return maths_val_new_constant ( arena, c );
+    }
+
+  if ( ( name == '-' ) && rc )
+    {
+      set_operator ( op, '+' );
+      op->r = maths_val_new_constant ( arena, -b );
+      name = '+';
+      b = -b;
+    }
+
+  if ( ( ( name == '+' ) || ( name == '*' ) ) && lc )
+    {
+      tmp = op->l;
+      op->l = op->r;
+      op->r = tmp;
+      rc = TRUE;
+      b = a;
+    }
+
+  if ( rc )
+    {
+      switch ( name )
+        {
+        case '+':
+          if ( b == 0.0 )
+            return keep_left ( el );
+          break;
+
+        case '*':
+        case '/':
+          if ( b == 1.0 )
+            return keep_left ( el );
+          break;
+
+        case '^':
+          if ( b == 1.0 )
+            return keep_left ( el );
+
+          if ( b == 0.0 )
+            return maths_val_new_constant ( arena, 1.0 );
+          break;
+        }
+    }
+
+  /* a - a is not 0 when a is infinite or NaN, only the variables are known
+     to be finite */
+  if ( ( name == '-' ) && is_variable ( op->l )
+       && ( compare_elements ( op->l, op->r, keys, &comparable ) == 0 ) && comparable )
+    return maths_val_new_constant ( arena, 0.0 );
+
+  if ( ( name != '+' ) && ( name != '*' ) )
+    return el;
+
+  /* (a op c1) op c2 -> a op (c1 op c2) */
+  if ( rc && ( get_operator ( op->l ) == name ) )
+    {
+      sub = (MATHS_OPERATOR *) op->l->data;
+
+      if ( get_constant ( sub->r, &c ) )
+        {
+          sub->r = maths_val_new_constant ( arena, sub->operation ( c, b ) );
+          return simplify_op ( keep_left ( el ), arena, keys );
+        }
+    }
+
+  if ( rc )
+    return el;
+
+  if ( ( get_operator ( op->l ) == name ) && get_constant ( ((MATHS_OPERATOR *) op->l->data)->r, &c ) )
+    {
+      /* (a op c) op b -> (a op b) op c */
+      tmp = op->l;
+      sub = (MATHS_OPERATOR *) tmp->data;
+      op->l = sub->l;
+      sub->l = simplify_op ( el, arena, keys );
+      return simplify_op ( tmp, arena, keys );
+    }
+
+  if ( ( get_operator ( op->r ) == name ) && get_constant ( ((MATHS_OPERATOR *) op->r->data)->r, &c ) )
+    {
+      /* a op (b op c) -> (a op b) op c */
+      tmp = op->r;
+      sub = (MATHS_OPERATOR *) tmp->data;
+      op->r = sub->l;
+      sub->l = simplify_op ( el, arena, keys );
+      return simplify_op ( tmp, arena, keys );
+    }
+
+  if ( compare_elements ( op->l, op->r, keys, &comparable ) > 0 )
+    {
+      tmp = op->l;
+      op->l = op->r;
+      op->r = tmp;
+    }
+
+  return el;
+}
+
+
+/*
+ * Simplifies a tree (recursive).
+ */
+static MATHS_TREE_ELEMENT *
+simplify ( MATHS_TREE_ELEMENT *el,
+           MATHS_ARENA        *arena,
+           MATHS_KEYS         *keys )
+{
+  gdouble v;
+  gint i;
+
+  if ( ( el == NULL ) || ( el->data == NULL ) )
+    return el;
+
+  if ( el->exec == maths_op_exec )
+    {
+      MATHS_OPERATOR *op = (MATHS_OPERATOR *) el->data;
+
+      op->l = simplify ( op->l, arena, keys );
+      op->r = simplify ( op->r, arena, keys );
+
+      if ( ( op->l == NULL ) || ( op->r == NULL ) )
+        return el;
+
+      return simplify_op ( el, arena, keys );
+    }
+  else if ( el->exec == maths_func_exec )
+    {
+      MATHS_FUNCTION *func = (MATHS_FUNCTION *) el->data;
+
+      for ( i=0; i<func->argc; ++i )
+        func->argv[i] = simplify ( func->argv[i], arena, keys );
+
+      /* the arguments may have become constants */
+      if ( el->precalc ( el->data, arena ) == PRECALC_OK )
+        {
+          v = el->exec ( el->data );
+          return maths_val_new_constant ( arena, v );
+        }
+    }
+
+  return el;
+}
+
+
+/*
+ * Simplifies a tree, the keys of the elements being compared are kept
+ * along the way.
+ */
+MATHS_TREE_ELEMENT *
+maths_simplify ( MATHS_TREE_ELEMENT *el,
+                 MATHS_ARENA        *arena )
+{
+  MATHS_KEYS *keys = maths_simplify_keys_new ( );
+
+  el = simplify ( el, arena, keys );
+  maths_simplify_keys_free ( keys );
+
+  return el;
+}
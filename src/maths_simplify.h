@@ -0,0 +1,68 @@
+/*
+ * maths_simplify.h
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef __MATHS_SIMPLIFY_H__
+#define __MATHS_SIMPLIFY_H__
+
+
+#ifndef __MATHS_TREE_H__
+#include "maths_tree.h"
+#endif
+
+
+/* Rewrites a tree into a simpler one computing the same value: constants of
+   sums and products are gathered and folded, identity operations are removed.
+   The new elements are allocated in 'arena', those which are not part of the
+   result remain there until it is freed.
+   Returns the new head of the tree */
+MATHS_TREE_ELEMENT *maths_simplify ( MATHS_TREE_ELEMENT *el,
+                                     MATHS_ARENA        *arena );
+
+/* Structural keys of elements: two elements with the same key compute the
+   same value. An element is keyed by its operator, function or value and by
+   the keys of its operands, so that each one is keyed once. Keys are
+   positive, elements calling rand() have none (0) */
+typedef struct maths_keys_t
+{
+  GHashTable  *elements;  /* element -> key */
+  GHashTable  *nodes;     /* structure -> key */
+  gint         last;
+} MATHS_KEYS ;
+
+
+/* Creates empty tables of keys */
+MATHS_KEYS *maths_simplify_keys_new ( void );
+
+/* Returns the key of an element, the keys of the element and of its subtrees
+   are kept in 'keys', they are valid as long as the element is not modified */
+gint maths_simplify_key ( MATHS_TREE_ELEMENT *el, MATHS_KEYS *keys );
+
+/* Returns the key of a call of the function 'id' on an element of key 'arg',
+   whether or not a tree holds it */
+gint maths_simplify_call_key ( MATHS_KEYS *keys, const gint id, const gint arg );
+
+/* Frees tables of keys */
+void maths_simplify_keys_free ( MATHS_KEYS *keys );
+
+
+#endif
@@ -25,10 +25,14 @@
 #define __MATHS_TREE_H__
 
 
+#ifndef __MATHS_ARENA_H__
+#include "maths_arena.h"
+#endif
+
+
 typedef gdouble ( maths_tree_exec_f )     ( gpointer data );
 typedef gint    ( maths_tree_dump_xml_f ) ( FILE *output, gint index, gpointer data );
-typedef gint    ( maths_tree_precalc_f )  ( gpointer data );
-typedef void    ( maths_tree_free_f )     ( gpointer data );
+typedef gint    ( maths_tree_precalc_f )  ( gpointer data, MATHS_ARENA *arena );
 
 
 /* Precalculation opportunities
@@ -38,14 +42,14 @@ typedef void    ( maths_tree_free_f )     ( gpointer data );
 enum { PRECALC_NOT, PRECALC_TERM, PRECALC_OK };
 
 
-/* Element structure */
+/* Element structure, allocated from the arena of its formula along with
+   its data */
 typedef struct maths_tree_el_t
 {
   gpointer              *data;
   maths_tree_exec_f     *exec;
   maths_tree_dump_xml_f *dump_xml;
   maths_tree_precalc_f  *precalc;
-  maths_tree_free_f     *free;
 } MATHS_TREE_ELEMENT ;
 
 
@@ -36,20 +36,40 @@
 #include "plugin-intl.h"
 
 
-/* Allocation of a value */
+/* Allocation of a constant */
 MATHS_VALUE *
-maths_val_alloc ( void )
+maths_val_alloc ( MATHS_ARENA *arena )
 {
   MATHS_VALUE *val;
-  val = (MATHS_VALUE *) g_malloc ( sizeof(MATHS_VALUE) );
+  val = (MATHS_VALUE *) maths_arena_alloc ( arena, sizeof(MATHS_VALUE) );
   val->name = NULL;
   val->desc = NULL;
   val->precalc_code = PRECALC_TERM;
-  val->value = NULL;
+  val->value = &val->constant;
+  val->id = MATHS_VAL_ID_NONE;
+  val->constant = 0.0;
   return val;
 }
 
 
+/* Element of a constant */
+MATHS_TREE_ELEMENT *
+maths_val_new_constant ( MATHS_ARENA   *arena,
+                         const gdouble  v )
+{
+  MATHS_TREE_ELEMENT *el;
+
+  el = (MATHS_TREE_ELEMENT *) maths_arena_alloc ( arena, sizeof(MATHS_TREE_ELEMENT) );
+  el->data = ( gpointer ) maths_val_alloc ( arena );
+  el->exec = maths_val_exec;
+  el->dump_xml = maths_val_dump_xml;
+  el->precalc = maths_val_precalc;
+  ((MATHS_VALUE *) el->data)->constant = v;
+
+  return el;
+}
+
+
 /* Execution of a value */
 gdouble
 maths_val_exec ( gpointer data )
@@ -82,26 +102,14 @@ maths_val_dump_xml ( FILE *output,
 
 /* Precalculation **/
 gint
-maths_val_precalc ( gpointer data )
+maths_val_precalc ( gpointer     data,
+                    MATHS_ARENA *arena )
 {
   MATHS_VALUE *val = (MATHS_VALUE *) data;
   return ( val->precalc_code );
 }
 
 
-/* Memory desallocation of a value */
-void
-maths_val_free ( gpointer data )
-{
-  MATHS_VALUE *val = (MATHS_VALUE *) data;
-
-  /* if the value has been allocated */
-  if ( ( val->name == NULL ) && ( val->desc == NULL ) )
-    if ( val->value != NULL )
-      g_free ( val->value );
-}
-
-
 static gdouble dbl_pi = G_PI;
 static gdouble dbl_e = G_E;
 static gdouble dbl_j = M_GOLD_NUMBER;
@@ -223,15 +231,15 @@ values_set_alpha ( const gdouble val)
 */
 
 MATHS_VALUE values[] = 
-  { {"pi",    "Pi",          PRECALC_TERM, &dbl_pi},
-    {"e",     "e",           PRECALC_TERM, &dbl_e},
-    {"j",     "Gold Number", PRECALC_TERM, &dbl_j},
-    {"w",     "w",           PRECALC_NOT,  &dbl_w},
-    {"h",     "h",           PRECALC_NOT,  &dbl_h},
-    {"x",     "x",           PRECALC_NOT,  &dbl_x},
-    {"y",     "y",           PRECALC_NOT,  &dbl_y},
-    {"r",     "r",           PRECALC_NOT,  &dbl_r},
-    {"t",     "t",           PRECALC_NOT,  &dbl_t},
+  { {"pi",    "Pi",          PRECALC_TERM, &dbl_pi,    MATHS_VAL_ID_NONE},
+    {"e",     "e",           PRECALC_TERM, &dbl_e,     MATHS_VAL_ID_NONE},
+    {"j",     "Gold Number", PRECALC_TERM, &dbl_j,     MATHS_VAL_ID_NONE},
+    {"w",     "w",           PRECALC_NOT,  &dbl_w,     MATHS_VAL_ID_W},
+    {"h",     "h",           PRECALC_NOT,  &dbl_h,     MATHS_VAL_ID_H},
+    {"x",     "x",           PRECALC_NOT,  &dbl_x,     MATHS_VAL_ID_X},
+    {"y",     "y",           PRECALC_NOT,  &dbl_y,     MATHS_VAL_ID_Y},
+    {"r",     "r",           PRECALC_NOT,  &dbl_r,     MATHS_VAL_ID_R},
+    {"t",     "t",           PRECALC_NOT,  &dbl_t,     MATHS_VAL_ID_T},
     /*
     {"red",   "red",         PRECALC_NOT,  &dbl_red},
     {"gray",  "gray",        PRECALC_NOT,  &dbl_gray},
@@ -239,5 +247,5 @@ MATHS_VALUE values[] =
     {"blue",  "blue",        PRECALC_NOT,  &dbl_blue},
     {"alpha", "alpha",       PRECALC_NOT,  &dbl_alpha},
     */
-    {NULL, NULL,             PRECALC_NOT,   NULL}
+    {NULL, NULL,             PRECALC_NOT,   NULL,      MATHS_VAL_ID_NONE}
   };
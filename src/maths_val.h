@@ -41,15 +41,27 @@ typedef struct maths_value_t
   gchar    *desc;
   gint      precalc_code;
   gdouble  *value;
+  gint      id;
+  gdouble   constant;  /* value of a constant, 'value' points to it */
 } MATHS_VALUE ;
 
 
+/* Variable identifiers (constants use MATHS_VAL_ID_NONE) */
+enum
+{
+  MATHS_VAL_ID_NONE,
+  MATHS_VAL_ID_W, MATHS_VAL_ID_H,
+  MATHS_VAL_ID_X, MATHS_VAL_ID_Y,
+  MATHS_VAL_ID_R, MATHS_VAL_ID_T
+};
+
+
 /* Values prototypes */
-MATHS_VALUE *maths_val_alloc    ( void );
-gdouble      maths_val_exec     ( gpointer data );
-gint         maths_val_dump_xml ( FILE *output, gint index, gpointer data );
-gint         maths_val_precalc  ( gpointer data );
-void         maths_val_free     ( gpointer data );
+MATHS_VALUE        *maths_val_alloc        ( MATHS_ARENA *arena );
+MATHS_TREE_ELEMENT *maths_val_new_constant ( MATHS_ARENA *arena, const gdouble v );
+gdouble             maths_val_exec         ( gpointer data );
+gint                maths_val_dump_xml     ( FILE *output, gint index, gpointer data );
+gint                maths_val_precalc      ( gpointer data, MATHS_ARENA *arena );
 
 
 /* Provided for convenience */
@@ -31,6 +31,8 @@
 #include "error.h"
 #include "formula.h"
 #include "maths_val.h"
+#include "maths_func.h"
+#include "scheduler.h"
 #include "render.h"
 #include "plugin-intl.h"
 
@@ -63,52 +65,46 @@ destroy_formulas ( PlugInDrawableVals *dvals,
 /*
  * Get the red, gray, green, blue, alpha channel value at (x,y) coords
  */
-guchar *in_img_buf;
-gint nb_chan;
-gint width;
-gint height;
-gdouble aspect_ratio_w;
-gdouble aspect_ratio_h;
-gint row_stride;
+static PIXEL_SOURCE source;
+gint current_chan;
 
 #define RED   0
 #define GRAY  0
 #define GREEN 1
 #define BLUE  2
-#define ALPHA() (nb_chan-1)
-
-gint current_chan;
+#define ALPHA(S) ((S)->nb_chan-1)
 
 /* assignment to the x coord */
 #define ASSIGN_X(X)  {                                \
-    x = (gint) (X / aspect_ratio_w);                  \
+    x = (gint) (X / src->aspect_ratio_w) - src->x0;   \
     if ( x < 0 )                                      \
       x = 0;                                          \
-    else if ( x >= width )                            \
-      x = width - 1; }
+    else if ( x >= src->width )                       \
+      x = src->width - 1; }
 
 /* assignment to the y coord */
 #define ASSIGN_Y(Y)   {                               \
-    y = (gint) (Y / aspect_ratio_h);                  \
+    y = (gint) (Y / src->aspect_ratio_h) - src->y0;   \
     if ( y < 0 )                                      \
       y = 0;                                          \
-    else if ( y >= height )                           \
-      y = height - 1; }
+    else if ( y >= src->height )                      \
+      y = src->height - 1; }
 
 /* read a channel's value */
-#define READ_CHAN(C) ((gdouble) *( in_img_buf + x*nb_chan + y*row_stride + C))
+#define READ_CHAN(C) ((gdouble) *( src->buf + x*src->nb_chan + y*src->row_stride + C))
 
 /* red */
 gdouble
-get_red_at ( gdouble xoff,
-             gdouble yoff )
+source_get_red ( const PIXEL_SOURCE *src,
+                 gdouble             xoff,
+                 gdouble             yoff )
 {
   gint x, y;
 
   ASSIGN_X ( xoff );
   ASSIGN_Y ( yoff );
 
-  if ( nb_chan < 3 ) /* gray image */
+  if ( src->nb_chan < 3 ) /* gray image */
     return READ_CHAN(GRAY);
   else
     return READ_CHAN(RED);
@@ -116,15 +112,16 @@ get_red_at ( gdouble xoff,
 
 /* gray */
 gdouble
-get_gray_at ( gdouble xoff,
-              gdouble yoff )
+source_get_gray ( const PIXEL_SOURCE *src,
+                  gdouble             xoff,
+                  gdouble             yoff )
 {
   gint x, y;
 
   ASSIGN_X ( xoff );
   ASSIGN_Y ( yoff );
 
-  if ( nb_chan > 2 ) /* rgb image */
+  if ( src->nb_chan > 2 ) /* rgb image */
     return (READ_CHAN(RED) + READ_CHAN(GREEN) + READ_CHAN(BLUE)) / 3.0;
   else
     return READ_CHAN(GRAY);
@@ -132,15 +129,16 @@ get_gray_at ( gdouble xoff,
 
 /* green */
 gdouble
-get_green_at ( gdouble xoff,
-               gdouble yoff )
+source_get_green ( const PIXEL_SOURCE *src,
+                   gdouble             xoff,
+                   gdouble             yoff )
 {
   gint x, y;
 
   ASSIGN_X ( xoff );
   ASSIGN_Y ( yoff );
 
-  if ( nb_chan < 3 ) /* gray image */
+  if ( src->nb_chan < 3 ) /* gray image */
     return READ_CHAN(GRAY);
   else
     return READ_CHAN(GREEN);
@@ -148,15 +146,16 @@ get_green_at ( gdouble xoff,
 
 /* blue */
 gdouble
-get_blue_at ( gdouble xoff,
-              gdouble yoff )
+source_get_blue ( const PIXEL_SOURCE *src,
+                  gdouble             xoff,
+                  gdouble             yoff )
 {
   gint x, y;
 
   ASSIGN_X ( xoff );
   ASSIGN_Y ( yoff );
 
-  if ( nb_chan < 3 ) /* gray image */
+  if ( src->nb_chan < 3 ) /* gray image */
     return READ_CHAN(GRAY);
   else
     return READ_CHAN(BLUE);
@@ -164,31 +163,584 @@ get_blue_at ( gdouble xoff,
 
 /* alpha */
 gdouble
-get_alpha_at ( gdouble xoff,
-               gdouble yoff )
+source_get_alpha ( const PIXEL_SOURCE *src,
+                   gdouble             xoff,
+                   gdouble             yoff )
 {
   gint x, y;
 
   ASSIGN_X ( xoff );
   ASSIGN_Y ( yoff );
 
-  if ( nb_chan & 1 ) /* no alpha if nb_chan == 1 or nb_chan == 3 */
+  if ( src->nb_chan & 1 ) /* no alpha if nb_chan == 1 or nb_chan == 3 */
     return 255.0;
 
-  return READ_CHAN(ALPHA());
+  return READ_CHAN(ALPHA(src));
 }
 
-/* red, green or blue channel according to current channel */
+/* any channel */
 gdouble
-get_rgb_at ( gdouble xoff,
-             gdouble yoff )
+source_get_chan ( const PIXEL_SOURCE *src,
+                  gint                chan,
+                  gdouble             xoff,
+                  gdouble             yoff )
 {
   gint x, y;
 
   ASSIGN_X ( xoff );
   ASSIGN_Y ( yoff );
 
-  return READ_CHAN(current_chan);
+  return READ_CHAN(chan);
+}
+
+
+/*
+ * Same as above, on the source being rendered (used by the maths tree)
+ */
+gdouble
+get_red_at ( gdouble xoff,
+             gdouble yoff )
+{
+  return source_get_red ( &source, xoff, yoff );
+}
+
+gdouble
+get_gray_at ( gdouble xoff,
+              gdouble yoff )
+{
+  return source_get_gray ( &source, xoff, yoff );
+}
+
+gdouble
+get_green_at ( gdouble xoff,
+               gdouble yoff )
+{
+  return source_get_green ( &source, xoff, yoff );
+}
+
+gdouble
+get_blue_at ( gdouble xoff,
+              gdouble yoff )
+{
+  return source_get_blue ( &source, xoff, yoff );
+}
+
+gdouble
+get_alpha_at ( gdouble xoff,
+               gdouble yoff )
+{
+  return source_get_alpha ( &source, xoff, yoff );
+}
+
+/* red, green or blue channel according to current channel */
+gdouble
+get_rgb_at ( gdouble xoff,
+             gdouble yoff )
+{
+  return source_get_chan ( &source, current_chan, xoff, yoff );
+}
+
+
+/*
+ * Prepares the coordinates of a row: x starts at x0 and grows by dx,
+ * (cx, py) are used to compute the polar coordinates the formulas use.
+ */
+static void
+set_row ( MATHS_ROW     *row,
+          const gdouble  y,
+          const gdouble  x0,
+          const gdouble  dx,
+          const gdouble  cx,
+          const gdouble  py,
+          const gint     usage )
+{
+  row->y = y;
+  maths_row_set_x ( row, x0, dx );
+  maths_row_set_polar ( row, cx, py, usage );
+}
+
+
+/*
+ * Evaluates the formula of a channel over a row, and stores the result into
+ * the interleaved pixels.
+ */
+static void
+render_row_chan ( FORMULA    *f,
+                  MATHS_ROW  *row,
+                  gdouble    *buf,
+                  guchar     *out,
+                  const gint  chan,
+                  const gint  bpp )
+{
+  gint i;
+
+  row->chan = chan;
+
+  /* the tree reads the channel from the global state, it is never shared
+     between threads (see formula_is_reentrant) */
+  if ( f->prog == NULL )
+    current_chan = chan;
+
+  formula_execute_row ( f, row, buf );
+
+  for ( i=0; i<row->n; ++i, out+=bpp )
+    *out = (guchar) buf[i];
+}
+
+
+/*
+ * State shared by the workers rendering a pixel region.
+ */
+typedef struct render_job_t
+{
+  FORMULA     *chans[4];   /* formula of each channel of the drawable */
+  gint         nb_chan;
+  gint         usage;      /* usage flags of the formulas */
+  gboolean     flip_y;     /* the ordinate of gray images grows upwards */
+  gint         width;
+  gint         height;
+  gint         x1;         /* rendered area */
+  gint         y1;
+  gint         x0;         /* current region */
+  gint         y0;
+  gint         region_width;
+  guchar      *out;
+  gint         row_stride;
+  MATHS_ROW  **rows;       /* one row and one buffer per worker */
+  gdouble    **bufs;       /* with room for a row of each channel */
+  gdouble     *col_values[4];  /* parts of the separable formulas, one value */
+  gdouble     *row_values[4];  /* per column and per row of the rendered area */
+  guchar      *luts[4];        /* lookup tables of the pointwise formulas */
+  gint         lut_inputs[4][4];  /* channels of the source indexing them */
+  gint         lut_k[4];        /* number of these channels */
+  MATHS_PROGRAM  *fused;        /* single program of the other channels */
+  gint         fused_chans[4];  /* channel of each of its results */
+  gint         nfused;
+} RENDER_JOB ;
+
+
+/*
+ * Evaluates the parts of a separable formula: the part varying with x for
+ * each column of the rendered area, the part varying with y for each row.
+ */
+static void
+prepare_separable ( RENDER_JOB *job,
+                    const gint  c,
+                    const gint  x2,
+                    const gint  y2 )
+{
+  const MATHS_PROGRAM *prog = job->chans[c]->prog;
+  const MATHS_PROGRAM *xpart = NULL;
+  const MATHS_PROGRAM *ypart = NULL;
+  MATHS_ROW *row;
+  gint y;
+
+  job->col_values[c] = NULL;
+  job->row_values[c] = NULL;
+
+  if ( prog == NULL )
+    return;
+
+  switch ( prog->separable )
+    {
+    case MATHS_PROG_SEP_X:  xpart = prog; break;
+    case MATHS_PROG_SEP_Y:  ypart = prog; break;
+    case MATHS_PROG_SEP_XY: xpart = prog->sep_x; ypart = prog->sep_y; break;
+    default:
+      return;
+    }
+
+  if ( xpart != NULL )
+    {
+      job->col_values[c] = g_new ( gdouble, x2 - job->x1 );
+      row = maths_row_new ( x2 - job->x1 );
+      maths_row_set_x ( row, (gdouble) job->x1, 1.0 );
+      maths_prog_exec_row ( xpart, row, job->col_values[c] );
+      maths_row_free ( row );
+    }
+
+  if ( ypart != NULL )
+    {
+      job->row_values[c] = g_new ( gdouble, y2 - job->y1 );
+      row = maths_row_new ( 1 );
+
+      for ( y=job->y1; y<y2; ++y )
+        {
+          row->y = (gdouble) y;
+          maths_prog_exec_row ( ypart, row, job->row_values[c] + (y - job->y1) );
+        }
+
+      maths_row_free ( row );
+    }
+}
+
+
+/*
+ * Renders a row of a separable formula from its precomputed parts.
+ */
+static void
+render_row_separable ( RENDER_JOB *job,
+                       const gint  c,
+                       const gint  x,
+                       const gint  y,
+                       const gint  n,
+                       gdouble    *buf,
+                       guchar     *out )
+{
+  const MATHS_PROGRAM *prog = job->chans[c]->prog;
+  const gint bpp = job->nb_chan;
+  const gdouble *xs = NULL;
+  guchar value;
+  gint i;
+
+  if ( job->col_values[c] != NULL )
+    xs = job->col_values[c] + (x - job->x1);
+
+  switch ( prog->separable )
+    {
+    case MATHS_PROG_SEP_X:
+      for ( i=0; i<n; ++i, out+=bpp )
+        *out = (guchar) xs[i];
+      break;
+
+    case MATHS_PROG_SEP_Y:
+      value = (guchar) job->row_values[c][y - job->y1];
+
+      if ( bpp == 1 )
+        memset ( out, value, n );
+      else
+        for ( i=0; i<n; ++i, out+=bpp )
+          *out = value;
+      break;
+
+    case MATHS_PROG_SEP_XY:
+      maths_prog_combine ( prog, xs, job->row_values[c][y - job->y1], buf, n );
+
+      for ( i=0; i<n; ++i, out+=bpp )
+        *out = (guchar) buf[i];
+      break;
+    }
+}
+
+
+/*
+ * Finds the channels of the source read by the pixel functions 'funcs' when
+ * they render the channel 'c', returns how many there are.
+ */
+static gint
+get_lut_inputs ( const gint  funcs,
+                 const gint  nb_chan,
+                 const gint  c,
+                 gint       *inputs )
+{
+  gboolean read[4] = { FALSE, FALSE, FALSE, FALSE };
+  gint i, k;
+
+  if ( funcs & ( 1 << MATHS_FUNC_ID_RED ) )
+    read[RED] = TRUE;
+
+  if ( funcs & ( 1 << MATHS_FUNC_ID_GREEN ) )
+    read[( nb_chan < 3 ) ? GRAY : GREEN] = TRUE;
+
+  if ( funcs & ( 1 << MATHS_FUNC_ID_BLUE ) )
+    read[( nb_chan < 3 ) ? GRAY : BLUE] = TRUE;
+
+  if ( funcs & ( 1 << MATHS_FUNC_ID_GRAY ) )
+    {
+      if ( nb_chan > 2 )
+        read[RED] = read[GREEN] = read[BLUE] = TRUE;
+      else
+        read[GRAY] = TRUE;
+    }
+
+  /* alpha() is constant on images without alpha */
+  if ( ( funcs & ( 1 << MATHS_FUNC_ID_ALPHA ) ) && !( nb_chan & 1 ) )
+    read[nb_chan-1] = TRUE;
+
+  if ( funcs & ( 1 << MATHS_FUNC_ID_RGB ) )
+    read[c] = TRUE;
+
+  for ( i=0, k=0; i<nb_chan; ++i )
+    if ( read[i] )
+      inputs[k++] = i;
+
+  return k;
+}
+
+
+/*
+ * State shared by the workers filling a lookup table.
+ */
+typedef struct lut_job_t
+{
+  const MATHS_PROGRAM  *prog;
+  const gint           *inputs;
+  gint                  k;
+  gint                  nb_chan;
+  guchar               *lut;
+  MATHS_ROW           **rows;     /* one row, one buffer and one source */
+  gdouble             **bufs;     /* of LUT_BLOCK pixels per worker */
+  PIXEL_SOURCE         *sources;
+} LUT_JOB ;
+
+#define LUT_BLOCK 256
+
+
+/*
+ * Fills a block of a lookup table, called by the scheduler: each entry is
+ * evaluated on a pixel whose input channels hold the bytes of its index.
+ */
+static void
+fill_lut_block ( gint     worker,
+                 gint     block,
+                 gpointer data )
+{
+  LUT_JOB *lj = (LUT_JOB *) data;
+  guchar *pixels = (guchar *) lj->sources[worker].buf;
+  gdouble *buf = lj->bufs[worker];
+  guchar *lut = lj->lut + block * LUT_BLOCK;
+  gint i, j, entry;
+
+  for ( i=0; i<LUT_BLOCK; ++i )
+    {
+      entry = block * LUT_BLOCK + i;
+
+      for ( j=0; j<lj->k; ++j )
+        pixels[i*lj->nb_chan + lj->inputs[j]] = (guchar) ( entry >> (8*j) );
+    }
+
+  maths_prog_exec_row ( lj->prog, lj->rows[worker], buf );
+
+  for ( i=0; i<LUT_BLOCK; ++i )
+    lut[i] = (guchar) buf[i];
+}
+
+
+/*
+ * Turns the formula of a channel into a lookup table when it only reads the
+ * pixel being rendered, and when filling the table costs less than
+ * evaluating the formula on each of the 'npixels' pixels.
+ */
+static void
+prepare_lut ( RENDER_JOB   *job,
+              const gint    c,
+              SCHEDULER    *sched,
+              const gint    nworkers,
+              const gint64  npixels )
+{
+  LUT_JOB lj;
+  gint w, funcs, size;
+
+  job->luts[c] = NULL;
+  job->lut_k[c] = 0;
+
+  if ( !formula_is_pointwise ( job->chans[c], &funcs ) )
+    return;
+
+  job->lut_k[c] = get_lut_inputs ( funcs, job->nb_chan, c, job->lut_inputs[c] );
+
+  if ( ( job->lut_k[c] < 1 ) || ( job->lut_k[c] > 3 ) || ( (gint64) 1 << (8*job->lut_k[c]) ) >= npixels )
+    {
+      job->lut_k[c] = 0;
+      return;
+    }
+
+  size = 1 << (8*job->lut_k[c]);
+  job->luts[c] = g_new ( guchar, size );
+
+  lj.prog = job->chans[c]->prog;
+  lj.inputs = job->lut_inputs[c];
+  lj.k = job->lut_k[c];
+  lj.nb_chan = job->nb_chan;
+  lj.lut = job->luts[c];
+  lj.rows = g_new ( MATHS_ROW *, nworkers );
+  lj.bufs = g_new ( gdouble *, nworkers );
+  lj.sources = g_new ( PIXEL_SOURCE, nworkers );
+
+  for ( w=0; w<nworkers; ++w )
+    {
+      lj.sources[w].buf = g_new0 ( guchar, LUT_BLOCK * job->nb_chan );
+      lj.sources[w].nb_chan = job->nb_chan;
+      lj.sources[w].width = LUT_BLOCK;
+      lj.sources[w].height = 1;
+      lj.sources[w].row_stride = LUT_BLOCK * job->nb_chan;
+      lj.sources[w].x0 = 0;
+      lj.sources[w].y0 = 0;
+      lj.sources[w].aspect_ratio_w = 1.0;
+      lj.sources[w].aspect_ratio_h = 1.0;
+
+      lj.rows[w] = maths_row_new ( LUT_BLOCK );
+      lj.rows[w]->source = &lj.sources[w];
+      lj.rows[w]->chan = c;
+      lj.rows[w]->y = 0.0;
+      maths_row_set_x ( lj.rows[w], 0.0, 1.0 );
+      lj.bufs[w] = g_new ( gdouble, LUT_BLOCK );
+    }
+
+  scheduler_run ( sched, size / LUT_BLOCK, fill_lut_block, &lj, NULL );
+
+  for ( w=0; w<nworkers; ++w )
+    {
+      g_free ( (guchar *) lj.sources[w].buf );
+      maths_row_free ( lj.rows[w] );
+      g_free ( lj.bufs[w] );
+    }
+
+  g_free ( lj.sources );
+  g_free ( lj.rows );
+  g_free ( lj.bufs );
+}
+
+
+/*
+ * Renders a row of a channel through its lookup table.
+ */
+static void
+render_row_lut ( RENDER_JOB *job,
+                 const gint  c,
+                 const gint  x,
+                 const gint  y,
+                 const gint  n,
+                 guchar     *out )
+{
+  const guchar *lut = job->luts[c];
+  const gint *in = job->lut_inputs[c];
+  const gint bpp = job->nb_chan;
+  const guchar *p;
+  gint i;
+
+  p = source.buf + (y - source.y0)*source.row_stride + (x - source.x0)*source.nb_chan;
+
+  switch ( job->lut_k[c] )
+    {
+    case 1:
+      for ( i=0; i<n; ++i, p+=bpp, out+=bpp )
+        *out = lut[p[in[0]]];
+      break;
+
+    case 2:
+      for ( i=0; i<n; ++i, p+=bpp, out+=bpp )
+        *out = lut[p[in[0]] | (p[in[1]] << 8)];
+      break;
+
+    case 3:
+      for ( i=0; i<n; ++i, p+=bpp, out+=bpp )
+        *out = lut[p[in[0]] | (p[in[1]] << 8) | (p[in[2]] << 16)];
+      break;
+    }
+}
+
+
+/*
+ * Lowers the formulas of the channels which are neither separable nor turned
+ * into lookup tables into a single program, so that a pixel is set up once
+ * for all of them and what they have in common is computed once.
+ */
+static void
+prepare_fused ( RENDER_JOB *job )
+{
+  FORMULA *fs[4];
+  gint c;
+
+  job->fused = NULL;
+  job->nfused = 0;
+
+  for ( c=0; c<job->nb_chan; ++c )
+    if ( ( job->luts[c] == NULL ) && ( job->col_values[c] == NULL ) && ( job->row_values[c] == NULL ) )
+      {
+        job->fused_chans[job->nfused] = c;
+        fs[job->nfused++] = job->chans[c];
+      }
+
+  if ( job->nfused < 2 )
+    return;
+
+  job->fused = formula_fuse ( fs, job->nfused );
+}
+
+
+/*
+ * Evaluates the fused channels over a row, and stores the results into the
+ * interleaved pixels.
+ */
+static void
+render_row_fused ( RENDER_JOB *job,
+                   MATHS_ROW  *row,
+                   gdouble    *buf,
+                   guchar     *out )
+{
+  const gint bpp = job->nb_chan;
+  gdouble *outs[4];
+  guchar *ptr;
+  gint i, k;
+
+  for ( k=0; k<job->nfused; ++k )
+    outs[k] = buf + k*row->n;
+
+  maths_prog_exec_row_multi ( job->fused, row, outs );
+
+  for ( k=0; k<job->nfused; ++k )
+    for ( i=0, ptr=out+job->fused_chans[k]; i<row->n; ++i, ptr+=bpp )
+      *ptr = (guchar) outs[k][i];
+}
+
+
+/*
+ * Renders a row of the current region, called by the scheduler.
+ */
+static void
+render_region_row ( gint     worker,
+                    gint     line,
+                    gpointer data )
+{
+  RENDER_JOB *job = (RENDER_JOB *) data;
+  MATHS_ROW *row = job->rows[worker];
+  guchar *out_ptr = job->out + line*job->row_stride;
+  gint y, py, c;
+
+  y = job->y0 + line;
+  py = y - (job->height>>1);
+
+  row->n = job->region_width;
+  set_row ( row, (gdouble) y, (gdouble) job->x0, 1.0, (job->width>>1), job->flip_y ? -py : py, job->usage );
+
+  if ( job->fused != NULL )
+    render_row_fused ( job, row, job->bufs[worker], out_ptr );
+
+  for ( c=0; c<job->nb_chan; ++c )
+    if ( job->luts[c] != NULL )
+      render_row_lut ( job, c, job->x0, y, row->n, out_ptr+c );
+    else if ( ( job->col_values[c] != NULL ) || ( job->row_values[c] != NULL ) )
+      render_row_separable ( job, c, job->x0, y, row->n, job->bufs[worker], out_ptr+c );
+    else if ( job->fused == NULL )
+      render_row_chan ( job->chans[c], row, job->bufs[worker], out_ptr+c, c, job->nb_chan );
+}
+
+
+/*
+ * Returns the backend the user asked for with (formulas-backend "...") in
+ * the gimprc: "native" for the system compiler, "bytecode" for the register
+ * program, "tree" for the tree walk. The JIT otherwise.
+ */
+static gint
+get_backend ( void )
+{
+  gchar *value = gimp_gimprc_query ( "formulas-backend" );
+  gint backend = FORMULA_BACKEND_JIT;
+
+  if ( value == NULL )
+    return backend;
+
+  if ( strcmp ( value, "native" ) == 0 )
+    backend = FORMULA_BACKEND_NATIVE;
+  else if ( strcmp ( value, "bytecode" ) == 0 )
+    backend = FORMULA_BACKEND_BYTECODE;
+  else if ( strcmp ( value, "tree" ) == 0 )
+    backend = FORMULA_BACKEND_TREE;
+
+  g_free ( value );
+
+  return backend;
 }
 
 
@@ -200,9 +752,15 @@ render_to_gimpdrawable ( const gint32        image_ID,
                          PlugInDrawableVals *dvals,
                          PlugInVals         *vals )
 {
-  guchar *in_image, *in_ptr;
-  guchar *out_image, *out_ptr;
-  gint x, y;
+  guchar *in_image = NULL;
+  gint c, nworkers, usage, tile_width, backend;
+  gint x1, y1, x2, y2;
+  gboolean stream_source;
+  gint64 done, total;
+  gdouble reported;
+  gpointer pr;
+  RENDER_JOB job;
+  SCHEDULER *sched;
   GimpPixelRgn in_pr;
   GimpPixelRgn out_pr;
   FORMULA *red_chan = NULL;
@@ -211,33 +769,27 @@ render_to_gimpdrawable ( const gint32        image_ID,
   FORMULA *gray_chan = NULL;
   FORMULA *alpha_chan = NULL;
 
-  in_image = g_new ( guchar, dvals->size );
-  out_image = g_new ( guchar, dvals->size );
-  in_ptr = in_image;
-  in_img_buf = in_image;
-  out_ptr = out_image;
+  /* the preview keeps the JIT, a first compilation would make it lag */
+  backend = get_backend ( );
 
-  aspect_ratio_w = 1.0;
-  aspect_ratio_h = 1.0;
-
-  /* formulas building */
+  /* formulas building, those of the preview are already compiled */
   if ( dvals->is_rgb )
     {
-      if ((red_chan = formula_new(vals->str_red_chan, TRUE)) == NULL)
+      if ((red_chan = formula_get(vals->str_red_chan, backend, TRUE)) == NULL)
         {
           error ( NULL, _("Unable to evaluate the formula of the red channel.") );
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
           return ;
         }
 
-      if ((green_chan = formula_new(vals->str_green_chan, TRUE)) == NULL)
+      if ((green_chan = formula_get(vals->str_green_chan, backend, TRUE)) == NULL)
         {
           error ( NULL, _("Unable to evaluate the formula of the green channel.") );
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
           return ;
         }
 
-      if ((blue_chan = formula_new(vals->str_blue_chan, TRUE)) == NULL)
+      if ((blue_chan = formula_get(vals->str_blue_chan, backend, TRUE)) == NULL)
         {
           error ( NULL, _("Unable to evaluate the formula of the blue channel.") );
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
@@ -246,7 +798,7 @@ render_to_gimpdrawable ( const gint32        image_ID,
     }
   else
     {
-      if ((gray_chan = formula_new(vals->str_gray_chan, TRUE)) == NULL)
+      if ((gray_chan = formula_get(vals->str_gray_chan, backend, TRUE)) == NULL)
         {
           error ( NULL, _("Unable to evaluate the formula of the gray channel.") );
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
@@ -256,7 +808,7 @@ render_to_gimpdrawable ( const gint32        image_ID,
 
   if ( dvals->has_alpha )
     {
-      if ((alpha_chan = formula_new(vals->str_alpha_chan, TRUE)) == NULL)
+      if ((alpha_chan = formula_get(vals->str_alpha_chan, backend, TRUE)) == NULL)
         {
           error ( NULL, _("Unable to evaluate the formula of the alpha channel.") );
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
@@ -265,144 +817,150 @@ render_to_gimpdrawable ( const gint32        image_ID,
     }
 
   gimp_progress_init ( _("Formulas' Rendering...") );
-  gimp_pixel_rgn_init ( &in_pr, dvals->drawable, 0, 0, dvals->width, dvals->height, FALSE, FALSE );
-  gimp_pixel_rgn_get_rect ( &in_pr, in_image, 0, 0, dvals->width, dvals->height );
 
-  width = dvals->width;
   values_set_w ( (gdouble) dvals->width );
-
-  height = dvals->height;
   values_set_h ( (gdouble) dvals->height );
 
-  /* we separate the loops, so we don't waste time testing for alpha and RGB */
-  if (dvals->is_rgb)
+  /* channels of the drawable, in the order of its pixels */
+  job.nb_chan = 0;
+
+  if ( dvals->is_rgb )
     {
-      gdouble gray;
+      job.chans[job.nb_chan++] = red_chan;
+      job.chans[job.nb_chan++] = green_chan;
+      job.chans[job.nb_chan++] = blue_chan;
+    }
+  else
+    job.chans[job.nb_chan++] = gray_chan;
 
-      /* formula optimisation */
-      formula_precalc ( red_chan );
-      formula_precalc ( green_chan );
-      formula_precalc ( blue_chan );
+  if ( dvals->has_alpha )
+    job.chans[job.nb_chan++] = alpha_chan;
 
-      if ( dvals->has_alpha )
-        {
-          /* RGBA image */
-          nb_chan = 4;
-          row_stride = width * 4;
+  usage = 0;
 
-          formula_precalc (  alpha_chan );
+  for ( c=0; c<job.nb_chan; ++c )
+    usage |= formula_get_usage ( job.chans[c] );
 
-          for ( y=0; y<dvals->height; ++y )
-            {
-              values_set_y((gdouble) y);
-
-              for ( x=0; x<dvals->width; ++x )
-                {
-                  gray = 0.0;
-                  values_set_x((gdouble) x);
-                  coords_set_polar_from_cartesian ( (x-(dvals->width>>1)), (y-(dvals->height>>1)) );
-                  current_chan = RED;
-                  *out_ptr = (guchar) (formula_execute(red_chan)); ++out_ptr;
-                  current_chan = GREEN;
-                  *out_ptr = (guchar) (formula_execute(green_chan)); ++out_ptr;
-                  current_chan = BLUE;
-                  *out_ptr = (guchar) (formula_execute(blue_chan)); ++out_ptr;
-                  current_chan = ALPHA();
-                  *out_ptr = (guchar) (formula_execute(alpha_chan)); ++out_ptr;
-                }
-
-              if ( (y & 8) == 0 )
-                gimp_progress_update((double) y / (double) dvals->height);
-            }
-        }
-      else
-        {
-          /* RGB image */
-          nb_chan = 3;
-          row_stride = width * 3;
+  job.usage = usage;
 
-          for ( y=0; y<dvals->height; ++y )
-            {
-              values_set_y((double) y);
-
-              for ( x=0; x<dvals->width; ++x )
-                {
-                  gray = 0.0;
-                  values_set_x((gdouble) x);
-                  coords_set_polar_from_cartesian ( (x-(dvals->width>>1)), (y-(dvals->height>>1)) );
-                  current_chan = RED;
-                  *out_ptr = (guchar) (formula_execute(red_chan)); ++out_ptr;
-                  current_chan = GREEN;
-                  *out_ptr = (guchar) (formula_execute(green_chan)); ++out_ptr;
-                  current_chan = BLUE;
-                  *out_ptr = (guchar) (formula_execute(blue_chan)); ++out_ptr;
-                }
-
-              if ( (y & 8) == 0 )
-                gimp_progress_update((double) y / (double) dvals->height);
-            }
-        }
+  job.flip_y = !dvals->is_rgb;
+  job.width = dvals->width;
+  job.height = dvals->height;
+
+  /* formulas walking their tree share global values, they run on one thread */
+  nworkers = scheduler_get_n_workers ( );
+
+  for ( c=0; c<job.nb_chan; ++c )
+    if ( !formula_is_reentrant ( job.chans[c] ) )
+      nworkers = 1;
+
+  /* a region never spans more than one tile */
+  tile_width = gimp_tile_width ( );
+  job.rows = g_new ( MATHS_ROW *, nworkers );
+  job.bufs = g_new ( gdouble *, nworkers );
+
+  for ( c=0; c<nworkers; ++c )
+    {
+      job.rows[c] = maths_row_new ( tile_width );
+      job.rows[c]->source = &source;
+      job.bufs[c] = g_new ( gdouble, 4 * tile_width );
+    }
+
+  sched = scheduler_new ( nworkers );
+
+  source.nb_chan = job.nb_chan;
+  source.aspect_ratio_w = 1.0;
+  source.aspect_ratio_h = 1.0;
+
+  /* only the bounding box of the selection is rendered, the coordinates
+     remain relative to the whole drawable */
+  gimp_drawable_mask_bounds ( dvals->drawable->drawable_id, &x1, &y1, &x2, &y2 );
+
+  /* separable formulas are evaluated once per column and once per row */
+  job.x1 = x1;
+  job.y1 = y1;
+
+  for ( c=0; c<job.nb_chan; ++c )
+    prepare_separable ( &job, c, x2, y2 );
+
+  /* formulas of the pixel values alone are turned into lookup tables */
+  for ( c=0; c<job.nb_chan; ++c )
+    prepare_lut ( &job, c, sched, nworkers, (gint64) (x2 - x1) * (y2 - y1) );
+
+  /* the remaining channels are evaluated together */
+  prepare_fused ( &job );
+
+  gimp_tile_cache_ntiles ( 2 * ( (x2 - x1) / tile_width + 1 ) );
+  gimp_pixel_rgn_init ( &in_pr, dvals->drawable, x1, y1, x2 - x1, y2 - y1, FALSE, FALSE );
+  gimp_pixel_rgn_init ( &out_pr, dvals->drawable, x1, y1, x2 - x1, y2 - y1, TRUE, TRUE );
+
+  stream_source = FALSE;
+
+  if ( !( usage & MATHS_PROG_USES_SOURCE ) )
+    {
+      /* nothing samples the source, we don't even read it */
+      source.buf = NULL;
+      pr = gimp_pixel_rgns_register ( 1, &out_pr );
+    }
+  else if ( usage & MATHS_PROG_SAMPLES_AROUND )
+    {
+      /* the formulas may sample any pixel, so we need the whole source */
+      in_image = g_new ( guchar, dvals->size );
+      gimp_pixel_rgn_init ( &in_pr, dvals->drawable, 0, 0, dvals->width, dvals->height, FALSE, FALSE );
+      gimp_pixel_rgn_get_rect ( &in_pr, in_image, 0, 0, dvals->width, dvals->height );
+
+      source.buf = in_image;
+      source.width = dvals->width;
+      source.height = dvals->height;
+      source.row_stride = dvals->width * job.nb_chan;
+      source.x0 = 0;
+      source.y0 = 0;
+
+      pr = gimp_pixel_rgns_register ( 1, &out_pr );
     }
   else
     {
-      /* formula optimisation */
-      formula_precalc ( gray_chan );
+      stream_source = TRUE;
+      pr = gimp_pixel_rgns_register ( 2, &in_pr, &out_pr );
+    }
 
-      if ( dvals->has_alpha )
+  /* the regions are rendered one after the other, their rows in parallel */
+  done = 0;
+  total = (gint64) (x2 - x1) * (y2 - y1);
+  reported = 0.0;
+
+  for ( ; pr != NULL; pr = gimp_pixel_rgns_process ( pr ) )
+    {
+      if ( stream_source )
         {
-          /* GrayA image */
-          nb_chan = 2;
-          row_stride = width * 2;
+          source.buf = in_pr.data;
+          source.width = in_pr.w;
+          source.height = in_pr.h;
+          source.row_stride = in_pr.rowstride;
+          source.x0 = in_pr.x;
+          source.y0 = in_pr.y;
+        }
 
-          formula_precalc (  alpha_chan );
+      job.x0 = out_pr.x;
+      job.y0 = out_pr.y;
+      job.region_width = out_pr.w;
+      job.out = out_pr.data;
+      job.row_stride = out_pr.rowstride;
 
-          for ( y=0; y<dvals->height; ++y )
-            {
-              values_set_y((double) y);
-
-              for ( x=0; x<dvals->width; ++x )
-                {
-                  values_set_x((gdouble) x);
-                  coords_set_polar_from_cartesian ( (x-(dvals->width>>1)), -(y-(dvals->height>>1)) );
-                  current_chan = GRAY;
-                  *out_ptr = (guchar) (formula_execute(gray_chan)); ++out_ptr;
-                  current_chan = ALPHA();
-                  *out_ptr = (guchar) (formula_execute(alpha_chan)); ++out_ptr;
-                }
-
-              if ( (y & 8) == 0 )
-                gimp_progress_update((double) y / (double) dvals->height);
-            }
-        }
-      else
-        {
-          /* Gray image */
-          nb_chan = 1;
-          row_stride = width;
+      scheduler_run ( sched, out_pr.h, render_region_row, &job, NULL );
 
-          for( y=0; y<dvals->height; ++y )
-            {
-              values_set_y((double) y);
-
-              for ( x=0; x<dvals->width; ++x )
-                {
-                  values_set_x ( (gdouble) x );
-                  coords_set_polar_from_cartesian ( (x-(dvals->width>>1)), -(y-(dvals->height>>1)) );
-                  current_chan = GRAY;
-                  *out_ptr = (guchar) (formula_execute(gray_chan)); ++out_ptr;
-                }
-
-              if ( (y & 8) == 0 )
-                gimp_progress_update((double) y / (double) dvals->height);
-            }
+      done += out_pr.w * out_pr.h;
+
+      if ( (gdouble) done / (gdouble) total - reported >= 0.01 )
+        {
+          reported = (gdouble) done / (gdouble) total;
+          gimp_progress_update ( reported );
         }
     }
 
-  gimp_pixel_rgn_init ( &out_pr, dvals->drawable, 0, 0, dvals->width, dvals->height, TRUE, TRUE );
-  gimp_pixel_rgn_set_rect ( &out_pr, out_image, 0, 0, dvals->width, dvals->height );
   gimp_drawable_flush ( dvals->drawable );
   gimp_drawable_merge_shadow ( dvals->drawable->drawable_id, TRUE );
-  gimp_drawable_update ( dvals->drawable->drawable_id, 0, 0, dvals->width, dvals->height );
+  gimp_drawable_update ( dvals->drawable->drawable_id, x1, y1, x2 - x1, y2 - y1 );
   gimp_progress_update ( 1.0 );
 #if GIMP_MINOR_VERSION >= 4
   gimp_progress_end ( );
@@ -410,155 +968,740 @@ render_to_gimpdrawable ( const gint32        image_ID,
 
   /* cleaning ... */
   destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
-  g_free ( out_image );
+  for ( c=0; c<nworkers; ++c )
+    {
+      maths_row_free ( job.rows[c] );
+      g_free ( job.bufs[c] );
+    }
+
+  for ( c=0; c<job.nb_chan; ++c )
+    {
+      g_free ( job.col_values[c] );
+      g_free ( job.row_values[c] );
+      g_free ( job.luts[c] );
+    }
+
+  maths_prog_free ( job.fused );
+  g_free ( job.rows );
+  g_free ( job.bufs );
+  scheduler_destroy ( sched );
   g_free ( in_image );
 }
 
 
 /*
- * Renders the formulas (preview).
+ * Tiles of the preview. The channels of the tiles already rendered are
+ * kept, so that only those whose formula has changed are rendered again,
+ * and panning back to them costs nothing.
+ */
+
+/* Size of the square tiles the preview is made of */
+#define PREVIEW_TILE_SIZE 64
+
+/* Step between the samples of the first pass of a tile, each of the
+   next passes halves it */
+#define PREVIEW_STEP 8
+
+/* Number of channel tiles and of source tiles kept */
+#define PREVIEW_TILES        192
+#define PREVIEW_SOURCE_TILES 64
+
+
+/* Channel of a tile */
+typedef struct preview_tile_t
+{
+  FORMULA  *f;           /* formula it is rendered with */
+  gint      plane;
+  gint      level;
+  gint      tx;          /* position in the grid of tiles of the level */
+  gint      ty;
+  gint      src_x0;      /* extent of the source sampled, 0s if it does not */
+  gint      src_y0;      /* matter */
+  gint      src_width;
+  gint      src_height;
+  gint      step;        /* samples are evaluated every step pixels, 0 if none */
+  guchar    values[PREVIEW_TILE_SIZE*PREVIEW_TILE_SIZE];
+} PREVIEW_TILE ;
+
+
+/* Pixels of the drawable under a tile, at the scale of its level */
+typedef struct source_tile_t
+{
+  gint      level;
+  gint      tx;
+  gint      ty;
+  guchar   *pixels;
+} SOURCE_TILE ;
+
+
+/* The most recently used tiles first. The channel tiles belong to the
+   thread rendering the preview, the source tiles to the main thread */
+static GList *tiles = NULL;
+static guint  tiles_len = 0;
+static GList *source_tiles = NULL;
+static guint  source_tiles_len = 0;
+
+
+/*
+ * Frees the tiles kept for the preview.
  */
 void
-render_to_pixbuf ( GdkPixbuf          *pixbuf,
-                   GdkPixbuf          *original,
-                   PlugInDrawableVals *dvals,
-                   PlugInVals         *vals,
-                   const gdouble      caspect_ratio_w,
-                   const gdouble      caspect_ratio_h,
-                   const gboolean     report_errors )
+render_free_preview ( void )
+{
+  PREVIEW_TILE *t;
+  SOURCE_TILE *st;
+  GList *link;
+
+  for ( link=tiles; link!=NULL; link=link->next )
+    {
+      t = (PREVIEW_TILE *) link->data;
+      formula_destroy ( t->f );
+      g_free ( t );
+    }
+
+  for ( link=source_tiles; link!=NULL; link=link->next )
+    {
+      st = (SOURCE_TILE *) link->data;
+      g_free ( st->pixels );
+      g_free ( st );
+    }
+
+  g_list_free ( tiles );
+  g_list_free ( source_tiles );
+  tiles = NULL;
+  source_tiles = NULL;
+  tiles_len = 0;
+  source_tiles_len = 0;
+}
+
+
+/*
+ * Gets the size of the area of the drawable a pixel of a view stands for.
+ */
+static void
+get_view_scale ( PlugInDrawableVals *dvals,
+                 const RENDER_VIEW  *view,
+                 gdouble            *scale_w,
+                 gdouble            *scale_h )
+{
+  *scale_w = (gdouble) dvals->width / (gdouble) ( view->width << view->level );
+  *scale_h = (gdouble) dvals->height / (gdouble) ( view->height << view->level );
+}
+
+
+/*
+ * Fetches the pixels of the drawable under a tile, the GIMP scales them
+ * down to the level. Returns NULL if it fails.
+ */
+static guchar *
+fetch_source_tile ( PlugInDrawableVals *dvals,
+                    const gint          bpp,
+                    const gdouble       scale_w,
+                    const gdouble       scale_h,
+                    const gint          tx,
+                    const gint          ty )
+{
+  guchar *thumb, *pixels, *ptr;
+  gint    x1, y1, x2, y2, width, height, thumb_bpp, i, j, sx, sy;
+
+  /* area of the drawable under the tile */
+  x1 = MIN ( (gint) ( tx * PREVIEW_TILE_SIZE * scale_w ), dvals->width - 1 );
+  y1 = MIN ( (gint) ( ty * PREVIEW_TILE_SIZE * scale_h ), dvals->height - 1 );
+  x2 = CLAMP ( (gint) ( (tx+1) * PREVIEW_TILE_SIZE * scale_w ), x1 + 1, dvals->width );
+  y2 = CLAMP ( (gint) ( (ty+1) * PREVIEW_TILE_SIZE * scale_h ), y1 + 1, dvals->height );
+
+  /* only this area is read, the GIMP hands it already scaled */
+  width = MIN ( PREVIEW_TILE_SIZE, x2 - x1 );
+  height = MIN ( PREVIEW_TILE_SIZE, y2 - y1 );
+  thumb = gimp_drawable_get_sub_thumbnail_data ( dvals->drawable->drawable_id, x1, y1, x2 - x1, y2 - y1,
+                                                 &width, &height, &thumb_bpp );
+
+  if ( ( thumb == NULL ) || ( thumb_bpp != bpp ) )
+    {
+#ifdef VERBOSE
+      error ( "fetch_source_tile", _("unable to read the drawable") );
+#endif
+      g_free ( thumb );
+      return NULL;
+    }
+
+  /* each pixel of the tile takes the one of the thumbnail it falls in, they
+     are blown up when zoomed in past the scale of the drawable */
+  pixels = g_new ( guchar, PREVIEW_TILE_SIZE * PREVIEW_TILE_SIZE * bpp );
+
+  for ( ptr=pixels, j=0; j<PREVIEW_TILE_SIZE; ++j )
+    {
+      sy = (gint) ( ( ( ty * PREVIEW_TILE_SIZE + j ) * scale_h - y1 ) * height / ( y2 - y1 ) );
+      sy = CLAMP ( sy, 0, height - 1 );
+
+      for ( i=0; i<PREVIEW_TILE_SIZE; ++i, ptr+=bpp )
+        {
+          sx = (gint) ( ( ( tx * PREVIEW_TILE_SIZE + i ) * scale_w - x1 ) * width / ( x2 - x1 ) );
+          sx = CLAMP ( sx, 0, width - 1 );
+          memcpy ( ptr, thumb + ( sy * width + sx ) * bpp, bpp );
+        }
+    }
+
+  g_free ( thumb );
+  return pixels;
+}
+
+
+/*
+ * Looks the pixels of the drawable under a tile up, they are fetched if
+ * they are not kept yet. Returns NULL if they can not be read.
+ */
+static SOURCE_TILE *
+find_source_tile ( PlugInDrawableVals *dvals,
+                   const gint          bpp,
+                   const RENDER_VIEW  *view,
+                   const gdouble       scale_w,
+                   const gdouble       scale_h,
+                   const gint          tx,
+                   const gint          ty )
+{
+  SOURCE_TILE *st;
+  GList *link;
+  guchar *pixels;
+
+  for ( link=source_tiles; link!=NULL; link=link->next )
+    {
+      st = (SOURCE_TILE *) link->data;
+
+      if ( ( st->level == view->level ) && ( st->tx == tx ) && ( st->ty == ty ) )
+        {
+          source_tiles = g_list_delete_link ( source_tiles, link );
+          source_tiles = g_list_prepend ( source_tiles, st );
+          return st;
+        }
+    }
+
+  if ( ( pixels = fetch_source_tile ( dvals, bpp, scale_w, scale_h, tx, ty ) ) == NULL )
+    return NULL;
+
+  /* the least recently used tile is dropped */
+  if ( source_tiles_len >= PREVIEW_SOURCE_TILES )
+    {
+      link = g_list_last ( source_tiles );
+      st = (SOURCE_TILE *) link->data;
+      source_tiles = g_list_delete_link ( source_tiles, link );
+      g_free ( st->pixels );
+    }
+  else
+    {
+      st = g_new ( SOURCE_TILE, 1 );
+      ++source_tiles_len;
+    }
+
+  st->level = view->level;
+  st->tx = tx;
+  st->ty = ty;
+  st->pixels = pixels;
+  source_tiles = g_list_prepend ( source_tiles, st );
+
+  return st;
+}
+
+
+/*
+ * Gets the formulas of the preview planes: red, green and blue, or gray.
+ * The preview has no alpha, its formula is only checked.
+ * Returns FALSE if one of them is invalid.
+ */
+static gboolean
+get_preview_formulas ( PlugInDrawableVals *dvals,
+                       PlugInVals         *vals,
+                       FORMULA           **chans,
+                       const gboolean      report_errors )
 {
   FORMULA *red_chan = NULL;
   FORMULA *green_chan = NULL;
   FORMULA *blue_chan = NULL;
   FORMULA *gray_chan = NULL;
   FORMULA *alpha_chan = NULL;
-  guchar  *pixbuf_pixels, *row_ptr, *ptr;
-  gdouble  x, y;
-  gint     img_width, img_height;
-
-  pixbuf_pixels = gdk_pixbuf_get_pixels ( pixbuf );
-  in_img_buf = gdk_pixbuf_get_pixels ( original );
-
-  aspect_ratio_w = caspect_ratio_w;
-  aspect_ratio_h = caspect_ratio_h;
-  row_stride = gdk_pixbuf_get_rowstride ( pixbuf );
 
   /* formulas building */
   if ( dvals->is_rgb )
     {
-      if ((red_chan = formula_new(vals->str_red_chan, report_errors)) == NULL)
+      if ((red_chan = formula_get(vals->str_red_chan, FORMULA_BACKEND_JIT, report_errors)) == NULL)
         {
           if ( report_errors )
             error ( NULL, _("Unable to evaluate the formula of the red channel.") );
 
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
-          return ;
+          return FALSE;
         }
 
-      if ((green_chan = formula_new(vals->str_green_chan, report_errors)) == NULL)
+      if ((green_chan = formula_get(vals->str_green_chan, FORMULA_BACKEND_JIT, report_errors)) == NULL)
         {
           if ( report_errors )
             error ( NULL, _("Unable to evaluate the formula of the green channel.") );
 
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
-          return ;
+          return FALSE;
         }
 
-      if ((blue_chan = formula_new(vals->str_blue_chan, report_errors)) == NULL)
+      if ((blue_chan = formula_get(vals->str_blue_chan, FORMULA_BACKEND_JIT, report_errors)) == NULL)
         {
           if ( report_errors )
             error ( NULL, _("Unable to evaluate the formula of the blue channel.") );
 
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
-          return ;
+          return FALSE;
         }
+
+      chans[RED] = red_chan;
+      chans[GREEN] = green_chan;
+      chans[BLUE] = blue_chan;
     }
   else
     {
-      if ((gray_chan = formula_new(vals->str_gray_chan, report_errors)) == NULL)
+      if ((gray_chan = formula_get(vals->str_gray_chan, FORMULA_BACKEND_JIT, report_errors)) == NULL)
         {
           if ( report_errors )
             error ( NULL, _("Unable to evaluate the formula of the gray channel.") );
 
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
-          return ;
+          return FALSE;
         }
+
+      chans[GRAY] = gray_chan;
     }
 
   if ( dvals->has_alpha )
     {
-      if ((alpha_chan = formula_new(vals->str_alpha_chan, report_errors)) == NULL)
+      if ((alpha_chan = formula_get(vals->str_alpha_chan, FORMULA_BACKEND_JIT, report_errors)) == NULL)
         {
           if ( report_errors )
             error(NULL, _("Unable to evaluate the formula of the alpha channel."));
 
           destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
-          return ;
+          return FALSE;
         }
+
+      formula_destroy ( alpha_chan );
     }
 
-  /* we set the 'w' and 'h' values according to the original picture */
-  img_width = ( gint )( caspect_ratio_w * (gdouble) dvals->width );
-  img_height = ( gint ) ( caspect_ratio_h * (gdouble) dvals->height );
-  values_set_w ( img_width );
-  values_set_h ( img_height );
+  return TRUE;
+}
 
-  /* width and height are relative to the preview pixbuf */
-  width = dvals->width;
-  height = dvals->height;
 
-  nb_chan = 3;
+/*
+ * Fetches the pixels of the drawable under the tiles of a view, and under
+ * those around for the formulas sampling next to the pixel they render.
+ * Farther samples are clamped to the edges of this area.
+ * Nothing is fetched if the formulas are known not to read the drawable.
+ */
+PIXEL_SOURCE *
+render_preview_source ( PlugInDrawableVals *dvals,
+                        PlugInVals         *vals,
+                        const RENDER_VIEW  *view )
+{
+  PIXEL_SOURCE *src;
+  SOURCE_TILE  *st;
+  FORMULA      *f;
+  gchar        *strs[3];
+  guchar       *buf;
+  gdouble       scale_w, scale_h;
+  gint          bpp, usage, tx1, ty1, tx2, ty2, tx, ty, j, k;
+
+  strs[0] = ( dvals->is_rgb ? vals->str_red_chan : vals->str_gray_chan );
+  strs[1] = vals->str_green_chan;
+  strs[2] = vals->str_blue_chan;
+
+  /* compiling would freeze the dialog, the formulas are only looked up: the
+     preview thread compiles them. Until then, they may read the drawable */
+  for ( usage=0, k=0; k<( dvals->is_rgb ? 3 : 1 ); ++k )
+    if ( ( f = formula_lookup ( strs[k], FORMULA_BACKEND_JIT ) ) == NULL )
+      usage |= MATHS_PROG_USES_SOURCE;
+    else
+      {
+        usage |= formula_get_usage ( f );
+        formula_destroy ( f );
+      }
+
+  if ( !( usage & MATHS_PROG_USES_SOURCE ) )
+    return NULL;
+
+  bpp = ( dvals->is_rgb ? 3 : 1 ) + ( dvals->has_alpha ? 1 : 0 );
+  get_view_scale ( dvals, view, &scale_w, &scale_h );
+
+  tx1 = MAX ( view->x / PREVIEW_TILE_SIZE - 1, 0 );
+  ty1 = MAX ( view->y / PREVIEW_TILE_SIZE - 1, 0 );
+  tx2 = MIN ( ( view->x + view->width - 1 ) / PREVIEW_TILE_SIZE + 1, ( ( view->width << view->level ) - 1 ) / PREVIEW_TILE_SIZE );
+  ty2 = MIN ( ( view->y + view->height - 1 ) / PREVIEW_TILE_SIZE + 1, ( ( view->height << view->level ) - 1 ) / PREVIEW_TILE_SIZE );
+
+  src = g_new ( PIXEL_SOURCE, 1 );
+  src->nb_chan = bpp;
+  src->width = ( tx2 - tx1 + 1 ) * PREVIEW_TILE_SIZE;
+  src->height = ( ty2 - ty1 + 1 ) * PREVIEW_TILE_SIZE;
+  src->row_stride = src->width * bpp;
+  src->x0 = tx1 * PREVIEW_TILE_SIZE;
+  src->y0 = ty1 * PREVIEW_TILE_SIZE;
+  src->aspect_ratio_w = scale_w;
+  src->aspect_ratio_h = scale_h;
+
+  buf = g_new0 ( guchar, src->height * src->row_stride );
+  src->buf = buf;
+
+  for ( ty=ty1; ty<=ty2; ++ty )
+    for ( tx=tx1; tx<=tx2; ++tx )
+      {
+        if ( ( st = find_source_tile ( dvals, bpp, view, scale_w, scale_h, tx, ty ) ) == NULL )
+          continue;
+
+        for ( j=0; j<PREVIEW_TILE_SIZE; ++j )
+          memcpy ( buf + ( ( ty - ty1 ) * PREVIEW_TILE_SIZE + j ) * src->row_stride + ( tx - tx1 ) * PREVIEW_TILE_SIZE * bpp,
+                   st->pixels + j * PREVIEW_TILE_SIZE * bpp, PREVIEW_TILE_SIZE * bpp );
+      }
+
+  return src;
+}
 
-  /* rendering ... */
-  if ( dvals->is_rgb )
+
+/*
+ * Frees the source of a preview.
+ */
+void
+render_free_preview_source ( PIXEL_SOURCE *src )
+{
+  if ( src == NULL )
+    return;
+
+  g_free ( (guchar *) src->buf );
+  g_free ( src );
+}
+
+
+/*
+ * Looks the tile of a channel up, the tile found becomes the most recently
+ * used one. If there is none and 'create' is TRUE, a tile with no sample
+ * replaces the least recently used one, NULL is returned otherwise.
+ * 'src' is the source the tile is rendered from when its samples depend on
+ * it, NULL otherwise.
+ */
+static PREVIEW_TILE *
+find_tile ( FORMULA             *f,
+            const gint           plane,
+            const gint           level,
+            const gint           tx,
+            const gint           ty,
+            const PIXEL_SOURCE  *src,
+            const gboolean       create )
+{
+  PREVIEW_TILE *t;
+  GList *link;
+  gint x0, y0, width, height;
+
+  x0 = y0 = width = height = 0;
+
+  if ( src != NULL )
+    {
+      x0 = src->x0;
+      y0 = src->y0;
+      width = src->width;
+      height = src->height;
+    }
+
+  /* formulas come from a cache, the same formula is the same object */
+  for ( link=tiles; link!=NULL; link=link->next )
     {
-      const gint col_size = dvals->height*row_stride;
-      const gint row_size = dvals->width*3*sizeof(guchar);
+      t = (PREVIEW_TILE *) link->data;
 
-      for ( row_ptr=pixbuf_pixels, y=0.0;
-            row_ptr<(pixbuf_pixels+col_size);
-            row_ptr+=row_stride, y+=caspect_ratio_h )
+      if ( ( t->f == f ) && ( t->plane == plane ) && ( t->level == level ) && ( t->tx == tx ) && ( t->ty == ty )
+           && ( t->src_x0 == x0 ) && ( t->src_y0 == y0 ) && ( t->src_width == width ) && ( t->src_height == height ) )
         {
-          values_set_y ( y );
-
-          for ( ptr=row_ptr, x=0.0;
-                ptr<(row_ptr+row_size);
-                x+=caspect_ratio_w )
-            {
-              values_set_x ( x );
-              coords_set_polar_from_cartesian ( (x-(img_width>>1)), -(y-(img_height>>1)) );
-              current_chan = RED;
-              *ptr = (guchar) (formula_execute(red_chan)); ++ptr;
-              current_chan = GREEN;
-              *ptr = (guchar) (formula_execute(green_chan)); ++ptr;
-              current_chan = BLUE;
-              *ptr = (guchar) (formula_execute(blue_chan)); ++ptr;
-            }
+          tiles = g_list_delete_link ( tiles, link );
+          tiles = g_list_prepend ( tiles, t );
+          return t;
         }
     }
+
+  if ( !create )
+    return NULL;
+
+  if ( tiles_len >= PREVIEW_TILES )
+    {
+      link = g_list_last ( tiles );
+      t = (PREVIEW_TILE *) link->data;
+      tiles = g_list_delete_link ( tiles, link );
+      formula_destroy ( t->f );
+    }
   else
     {
-      const gint col_size = dvals->height*row_stride;
-      const gint row_size = dvals->width*3*sizeof(guchar);
+      t = g_new ( PREVIEW_TILE, 1 );
+      ++tiles_len;
+    }
 
-      for ( row_ptr=pixbuf_pixels, y=0.0;
-            row_ptr<(pixbuf_pixels+col_size);
-            row_ptr+=row_stride, y+=caspect_ratio_h )
-        {
-          values_set_y ( y );
+  /* the tile keeps its formula, another one can not take its address */
+  t->f = formula_ref ( f );
+  t->plane = plane;
+  t->level = level;
+  t->tx = tx;
+  t->ty = ty;
+  t->src_x0 = x0;
+  t->src_y0 = y0;
+  t->src_width = width;
+  t->src_height = height;
+  t->step = 0;
+  tiles = g_list_prepend ( tiles, t );
+
+  return t;
+}
+
+
+/*
+ * Copies the part of a tile shown by a view into its pixels, each sample of
+ * a channel filling the step x step block which follows it. 'rect' receives
+ * the pixels copied: x1, y1, x2, y2.
+ */
+static void
+compose_tile ( const RENDER_VIEW  *view,
+               PREVIEW_TILE      **planes,
+               const gint          nb_planes,
+               guchar             *pixels,
+               const gint          row_stride,
+               gint               *rect )
+{
+  const PREVIEW_TILE *t;
+  guchar *ptr;
+  gint x0, y0, a, b, i, j, k;
+
+  x0 = planes[0]->tx * PREVIEW_TILE_SIZE;
+  y0 = planes[0]->ty * PREVIEW_TILE_SIZE;
+
+  rect[0] = MAX ( x0, view->x ) - view->x;
+  rect[1] = MAX ( y0, view->y ) - view->y;
+  rect[2] = MIN ( x0 + PREVIEW_TILE_SIZE, view->x + view->width ) - view->x;
+  rect[3] = MIN ( y0 + PREVIEW_TILE_SIZE, view->y + view->height ) - view->y;
+
+  for ( j=rect[1]; j<rect[3]; ++j )
+    {
+      b = view->y + j - y0;
+      ptr = pixels + j * row_stride + rect[0] * 3;
 
-          for ( ptr=row_ptr, x=0.0;
-                ptr<(row_ptr+row_size);
-                x+=caspect_ratio_w )
+      for ( i=rect[0]; i<rect[2]; ++i )
+        {
+          a = view->x + i - x0;
+
+          if ( nb_planes == 3 )
+            for ( k=0; k<3; ++k )
+              {
+                t = planes[k];
+                *ptr++ = t->values[( b - b % t->step ) * PREVIEW_TILE_SIZE + a - a % t->step];
+              }
+          else
             {
-              values_set_x ( x );
-              coords_set_polar_from_cartesian ( (x-(img_width>>1)), -(y-(img_height>>1)) );
-              current_chan = GRAY;
-              memset(ptr, (guchar) (formula_execute(gray_chan)), 3*sizeof(guchar));
+              t = planes[GRAY];
+              memset ( ptr, t->values[( b - b % t->step ) * PREVIEW_TILE_SIZE + a - a % t->step], 3*sizeof(guchar) );
               ptr += 3;
             }
         }
     }
+}
 
-  destroy_formulas ( dvals, red_chan, green_chan, blue_chan, gray_chan, alpha_chan );
+
+/*
+ * Reports the errors of the formulas of the preview.
+ */
+gboolean
+render_check_preview ( PlugInDrawableVals *dvals,
+                       PlugInVals         *vals )
+{
+  FORMULA *chans[3];
+  gint k;
+
+  if ( !get_preview_formulas ( dvals, vals, chans, TRUE ) )
+    return FALSE;
+
+  for ( k=0; k<( dvals->is_rgb ? 3 : 1 ); ++k )
+    formula_destroy ( chans[k] );
+
+  return TRUE;
+}
+
+
+/*
+ * Renders the formulas over the tiles of a view (may run on a thread of its
+ * own). The tiles are refined in passes: the first one evaluates every
+ * PREVIEW_STEP-th pixel of every PREVIEW_STEP-th row, each next pass the
+ * pixels between those already evaluated, the last one the remaining pixels.
+ * 'progress' is told of the pixels shown after each tile, and stops the
+ * rendering when it returns FALSE.
+ */
+gboolean
+render_preview ( PlugInDrawableVals   *dvals,
+                 PlugInVals           *vals,
+                 const RENDER_VIEW    *view,
+                 const PIXEL_SOURCE   *src,
+                 guchar               *pixels,
+                 const gint            row_stride,
+                 RENDER_PROGRESS_FUNC  progress,
+                 gpointer              data )
+{
+  guchar  *ptr;
+  gdouble  scale_w, scale_h, y, py;
+  gint     usage, nb_planes, nstale, pass, tx1, ty1, tx2, ty2, tx, ty, i, j, k, r;
+  gint     first[2], step[2], rect[4];
+  gboolean done = TRUE;
+  gboolean fuse_tried = FALSE;
+  MATHS_ROW *rows[2];
+  MATHS_ROW *row;
+  gdouble   *row_buf;
+  gdouble   *outs[3];
+  FORMULA   *chans[3];
+  FORMULA   *stale[3];
+  gint       stale_planes[3];
+  PREVIEW_TILE  *planes[3];
+  const PIXEL_SOURCE *around[3];
+  MATHS_PROGRAM *fused = NULL;
+
+  /* errors are reported by render_check_preview(), from the main thread */
+  if ( !get_preview_formulas ( dvals, vals, chans, FALSE ) )
+    return FALSE;
+
+  /* without source, no formula reads the drawable */
+  if ( src != NULL )
+    source = *src;
+  else
+    memset ( &source, 0, sizeof ( source ) );
+
+  /* we set the 'w' and 'h' values according to the original picture */
+  values_set_w ( dvals->width );
+  values_set_h ( dvals->height );
+
+  get_view_scale ( dvals, view, &scale_w, &scale_h );
+  nb_planes = ( dvals->is_rgb ? 3 : 1 );
+  usage = 0;
+
+  /* samples beyond the source are clamped to its edges, the tiles of a
+     formula sampling around depend on where the view was */
+  for ( k=0; k<nb_planes; ++k )
+    {
+      usage |= formula_get_usage ( chans[k] );
+      around[k] = ( ( formula_get_usage ( chans[k] ) & MATHS_PROG_SAMPLES_AROUND ) ? src : NULL );
+    }
+
+  /* tiles of the view */
+  tx1 = view->x / PREVIEW_TILE_SIZE;
+  ty1 = view->y / PREVIEW_TILE_SIZE;
+  tx2 = ( view->x + view->width - 1 ) / PREVIEW_TILE_SIZE;
+  ty2 = ( view->y + view->height - 1 ) / PREVIEW_TILE_SIZE;
+
+  /* the tiles already rendered are shown first */
+  for ( ty=ty1; done && ( ty<=ty2 ); ++ty )
+    for ( tx=tx1; done && ( tx<=tx2 ); ++tx )
+      {
+        for ( k=0; k<nb_planes; ++k )
+          if ( ( ( planes[k] = find_tile ( chans[k], k, view->level, tx, ty, around[k], FALSE ) ) == NULL )
+               || ( planes[k]->step == 0 ) )
+            break;
+
+        if ( k < nb_planes )
+          continue;
+
+        compose_tile ( view, planes, nb_planes, pixels, row_stride, rect );
+
+        if ( progress != NULL )
+          done = progress ( rect[0], rect[1], rect[2], rect[3], data );
+      }
+
+  /* rendering ... */
+  row_buf = g_new ( gdouble, 3 * PREVIEW_TILE_SIZE );
+
+  for ( k=0; k<3; ++k )
+    outs[k] = row_buf + k*PREVIEW_TILE_SIZE;
+
+  for ( r=0; r<2; ++r )
+    {
+      rows[r] = maths_row_new ( PREVIEW_TILE_SIZE );
+      rows[r]->source = &source;
+    }
+
+  for ( pass=PREVIEW_STEP; done && ( pass >= 1 ); pass >>= 1 )
+    {
+      /* the rows of the previous pass already have every other sample of
+         this one, the others have none */
+      first[0] = 0;
+      step[0] = pass;
+      first[1] = pass;
+      step[1] = 2 * pass;
+
+      for ( ty=ty1; done && ( ty<=ty2 ); ++ty )
+        for ( tx=tx1; done && ( tx<=tx2 ); ++tx )
+          {
+            nstale = 0;
+
+            for ( k=0; k<nb_planes; ++k )
+              {
+                planes[k] = find_tile ( chans[k], k, view->level, tx, ty, around[k], TRUE );
+
+                if ( ( planes[k]->step == 0 ) || ( planes[k]->step > pass ) )
+                  {
+                    stale_planes[nstale] = k;
+                    stale[nstale++] = chans[k];
+                  }
+              }
+
+            if ( nstale == 0 )
+              continue;
+
+            /* the channels are evaluated together when none is kept */
+            if ( ( nstale == nb_planes ) && ( nstale > 1 ) && !fuse_tried )
+              {
+                fused = formula_fuse ( chans, nb_planes );
+                fuse_tried = TRUE;
+              }
+
+            for ( r=0; r<2; ++r )
+              {
+                rows[r]->n = ( PREVIEW_TILE_SIZE - first[r] + step[r] - 1 ) / step[r];
+                maths_row_set_x ( rows[r], ( tx * PREVIEW_TILE_SIZE + first[r] ) * scale_w, step[r] * scale_w );
+              }
+
+            for ( j=0; j<PREVIEW_TILE_SIZE; j+=pass )
+              {
+                r = ( ( pass < PREVIEW_STEP ) && ( j % (2*pass) == 0 ) );
+                row = rows[r];
+                y = ( ty * PREVIEW_TILE_SIZE + j ) * scale_h;
+                row->y = y;
+                /* the ordinate of gray images grows upwards, as in the rendering */
+                py = y - (dvals->height>>1);
+                maths_row_set_polar ( row, (dvals->width>>1), ( dvals->is_rgb ? py : -py ), usage );
+
+                if ( ( fused != NULL ) && ( nstale == nb_planes ) )
+                  {
+                    maths_prog_exec_row_multi ( fused, row, outs );
+
+                    for ( k=0; k<nstale; ++k )
+                      for ( ptr=planes[k]->values+j*PREVIEW_TILE_SIZE+first[r], i=0; i<row->n; ++i, ptr+=step[r] )
+                        *ptr = (guchar) outs[k][i];
+                  }
+                else
+                  for ( k=0; k<nstale; ++k )
+                    render_row_chan ( stale[k], row, row_buf,
+                                      planes[stale_planes[k]]->values+j*PREVIEW_TILE_SIZE+first[r],
+                                      ( dvals->is_rgb ? stale_planes[k] : GRAY ), step[r] );
+              }
+
+            for ( k=0; k<nstale; ++k )
+              planes[stale_planes[k]]->step = pass;
+
+            compose_tile ( view, planes, nb_planes, pixels, row_stride, rect );
+
+            if ( progress != NULL )
+              done = progress ( rect[0], rect[1], rect[2], rect[3], data );
+          }
+    }
+
+  maths_row_free ( rows[0] );
+  maths_row_free ( rows[1] );
+  maths_prog_free ( fused );
+  g_free ( row_buf );
+
+  /* the tiles keep their own references */
+  for ( k=0; k<nb_planes; ++k )
+    formula_destroy ( chans[k] );
+
+  return done;
 }
@@ -25,18 +25,91 @@
 #define __RENDER_H__
 
 
+/* Image sampled by the red(), gray(), green(), blue(), alpha() and rgb() functions,
+   buf holds the pixels from (x0,y0) to (x0+width-1,y0+height-1) */
+typedef struct pixel_source_t
+{
+  const guchar  *buf;
+  gint           nb_chan;
+  gint           width;
+  gint           height;
+  gint           row_stride;
+  gint           x0;
+  gint           y0;
+  gdouble        aspect_ratio_w;
+  gdouble        aspect_ratio_h;
+} PIXEL_SOURCE ;
+
+
+/* Channel value of a source at (x,y) coords */
+gdouble source_get_red ( const PIXEL_SOURCE *src, gdouble xoff, gdouble yoff );
+gdouble source_get_gray ( const PIXEL_SOURCE *src, gdouble xoff, gdouble yoff );
+gdouble source_get_green ( const PIXEL_SOURCE *src, gdouble xoff, gdouble yoff );
+gdouble source_get_blue ( const PIXEL_SOURCE *src, gdouble xoff, gdouble yoff );
+gdouble source_get_alpha ( const PIXEL_SOURCE *src, gdouble xoff, gdouble yoff );
+gdouble source_get_chan ( const PIXEL_SOURCE *src, gint chan, gdouble xoff, gdouble yoff );
+
+
 void render_to_gimpdrawable ( const gint32        image_ID,
                               PlugInDrawableVals *dvals,
                               PlugInVals         *vals );
 
 
-void render_to_pixbuf ( GdkPixbuf          *pixbuf,
-                        GdkPixbuf          *original,
-                        PlugInDrawableVals *dvals,
-                        PlugInVals         *vals,
-                        const gdouble      aspect_ratio_w,
-                        const gdouble      aspect_ratio_h,
-                        gboolean           report_errors );
+/* Part of the drawable shown by the preview: the drawable is scaled to
+   (width << level) x (height << level) pixels, and the width x height
+   ones from (x,y) are shown */
+typedef struct render_view_t
+{
+  gint  width;
+  gint  height;
+  gint  level;
+  gint  x;
+  gint  y;
+} RENDER_VIEW ;
+
+
+/* Called once the pixels from (x1,y1) to (x2-1,y2-1) of the preview are
+   rendered, the rendering stops if it returns FALSE */
+typedef gboolean (*RENDER_PROGRESS_FUNC) ( const gint x1, const gint y1, const gint x2, const gint y2, gpointer data );
+
+
+/* Fetches the pixels of the drawable the preview of a view samples, at the
+   scale of its level. It talks to the GIMP, it must run on the main thread.
+   The formulas are not compiled, only looked up: returns NULL if they are
+   known not to read the drawable */
+PIXEL_SOURCE *render_preview_source ( PlugInDrawableVals *dvals,
+                                      PlugInVals         *vals,
+                                      const RENDER_VIEW  *view );
+
+
+/* Frees a source made by render_preview_source() */
+void render_free_preview_source ( PIXEL_SOURCE *src );
+
+
+/* Renders the formulas over a view into 'pixels' (RGB). The view is made of
+   tiles, the channels of a tile are kept until their formula changes, so
+   only the others are evaluated. A coarse grid of pixels is evaluated first,
+   and refined until every pixel is.
+   'src' comes from render_preview_source().
+   Errors are not reported, it may run on a thread of its own.
+   Returns FALSE if a formula is invalid or if the rendering was stopped */
+gboolean render_preview ( PlugInDrawableVals   *dvals,
+                          PlugInVals           *vals,
+                          const RENDER_VIEW    *view,
+                          const PIXEL_SOURCE   *src,
+                          guchar               *pixels,
+                          const gint            row_stride,
+                          RENDER_PROGRESS_FUNC  progress,
+                          gpointer              data );
+
+
+/* Reports the errors of the formulas of the preview, returns FALSE if there is one */
+gboolean render_check_preview ( PlugInDrawableVals *dvals,
+                                PlugInVals         *vals );
+
+
+/* Frees the tiles kept by render_preview() and render_preview_source() */
+void render_free_preview ( void );
 
 
 #endif
@@ -0,0 +1,330 @@
+/*
+ * scheduler.c
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+#include "scheduler.h"
+
+
+/* Jobs of a worker: the ones in [head, tail) are still to be run.
+   The owner takes them at the head, thieves take them at the tail. */
+typedef struct scheduler_queue_t
+{
+  GMutex  lock;
+  gint    head;
+  gint    tail;
+} SCHEDULER_QUEUE ;
+
+
+/* Worker */
+typedef struct scheduler_worker_t
+{
+  SCHEDULER  *sched;
+  gint        id;
+} SCHEDULER_WORKER ;
+
+
+/* Pool of workers */
+struct scheduler_t
+{
+  SCHEDULER_QUEUE     *queues;
+  gint                 nworkers;
+  SCHEDULER_WORKER    *workers;
+  GThread            **threads;
+  GMutex               lock;
+  GCond                start_cond;  /* a run has started, or the pool stops */
+  GCond                idle_cond;   /* every worker thread is done with a run */
+  guint                generation;  /* number of runs started so far */
+  gint                 running;     /* worker threads busy with the current run */
+  gboolean             quit;
+  SCHEDULER_JOB_FUNC   job_func;
+  gpointer             data;
+  volatile gint        done;
+};
+
+
+/*
+ * Takes the next job of a queue, returns -1 if it is empty.
+ */
+static gint
+queue_pop ( SCHEDULER_QUEUE *q )
+{
+  gint job = -1;
+
+  g_mutex_lock ( &q->lock );
+
+  if ( q->head < q->tail )
+    job = q->head++;
+
+  g_mutex_unlock ( &q->lock );
+
+  return job;
+}
+
+
+/*
+ * Steals the second half of the jobs of another worker: the first stolen job
+ * is returned, the others go into the queue of the thief.
+ * Returns -1 if there is nothing left to steal.
+ */
+static gint
+steal ( SCHEDULER  *sched,
+        const gint  thief )
+{
+  SCHEDULER_QUEUE *own = &sched->queues[thief];
+  SCHEDULER_QUEUE *victim;
+  gint i, first, last;
+
+  for ( i=1; i<sched->nworkers; ++i )
+    {
+      victim = &sched->queues[(thief+i) % sched->nworkers];
+
+      g_mutex_lock ( &victim->lock );
+
+      if ( victim->head >= victim->tail )
+        {
+          g_mutex_unlock ( &victim->lock );
+          continue;
+        }
+
+      last = victim->tail;
+      first = last - ( ( last - victim->head + 1 ) >> 1 );
+      victim->tail = first;
+
+      g_mutex_unlock ( &victim->lock );
+
+      g_mutex_lock ( &own->lock );
+      own->head = first + 1;
+      own->tail = last;
+      g_mutex_unlock ( &own->lock );
+
+      return first;
+    }
+
+  return -1;
+}
+
+
+/*
+ * Returns the next job of a worker, -1 once all the jobs are taken.
+ */
+static gint
+next_job ( SCHEDULER  *sched,
+           const gint  worker )
+{
+  gint job;
+
+  if ( ( job = queue_pop ( &sched->queues[worker] ) ) < 0 )
+    job = steal ( sched, worker );
+
+  return job;
+}
+
+
+/*
+ * Main loop of the worker threads: they sleep until a run starts, take jobs
+ * until none is left, then go back to sleep.
+ */
+static gpointer
+worker_main ( gpointer data )
+{
+  SCHEDULER_WORKER *worker = (SCHEDULER_WORKER *) data;
+  SCHEDULER *sched = worker->sched;
+  guint generation = 0;
+  gint job;
+
+  g_mutex_lock ( &sched->lock );
+
+  for ( ;; )
+    {
+      while ( ( !sched->quit ) && ( sched->generation == generation ) )
+        g_cond_wait ( &sched->start_cond, &sched->lock );
+
+      if ( sched->quit )
+        break;
+
+      generation = sched->generation;
+      g_mutex_unlock ( &sched->lock );
+
+      while ( ( job = next_job ( sched, worker->id ) ) >= 0 )
+        {
+          sched->job_func ( worker->id, job, sched->data );
+          g_atomic_int_inc ( &sched->done );
+        }
+
+      g_mutex_lock ( &sched->lock );
+
+      if ( --sched->running == 0 )
+        g_cond_signal ( &sched->idle_cond );
+    }
+
+  g_mutex_unlock ( &sched->lock );
+
+  return NULL;
+}
+
+
+/*
+ * Number of workers.
+ */
+gint
+scheduler_get_n_workers ( void )
+{
+  gint n = (gint) g_get_num_processors ( );
+
+  return ( n < 1 ) ? 1 : n;
+}
+
+
+/*
+ * Starts a pool of workers.
+ */
+SCHEDULER *
+scheduler_new ( gint nworkers )
+{
+  SCHEDULER *sched;
+  gint i;
+
+  if ( nworkers < 1 )
+    nworkers = 1;
+
+  sched = g_new0 ( SCHEDULER, 1 );
+  sched->queues = g_new0 ( SCHEDULER_QUEUE, nworkers );
+  sched->nworkers = nworkers;
+  sched->workers = g_new ( SCHEDULER_WORKER, nworkers );
+  sched->threads = g_new0 ( GThread *, nworkers );
+
+  g_mutex_init ( &sched->lock );
+  g_cond_init ( &sched->start_cond );
+  g_cond_init ( &sched->idle_cond );
+
+  for ( i=0; i<nworkers; ++i )
+    {
+      g_mutex_init ( &sched->queues[i].lock );
+      sched->workers[i].sched = sched;
+      sched->workers[i].id = i;
+    }
+
+  for ( i=1; i<nworkers; ++i )
+    sched->threads[i] = g_thread_new ( "formulas", worker_main, &sched->workers[i] );
+
+  return sched;
+}
+
+
+/*
+ * Runs jobs on a pool, each worker starts with a contiguous block of jobs and
+ * steals from the others once its own block is done.
+ */
+void
+scheduler_run ( SCHEDULER               *sched,
+                const gint               njobs,
+                SCHEDULER_JOB_FUNC       job_func,
+                gpointer                 data,
+                SCHEDULER_PROGRESS_FUNC  progress_func )
+{
+  gdouble fraction, reported;
+  gint i, job;
+
+  if ( njobs <= 0 )
+    return;
+
+  /* the workers are asleep, the queues are published by the lock below */
+  for ( i=0; i<sched->nworkers; ++i )
+    {
+      sched->queues[i].head = (gint) (( (gint64) i * njobs ) / sched->nworkers);
+      sched->queues[i].tail = (gint) (( (gint64) (i+1) * njobs ) / sched->nworkers);
+    }
+
+  g_mutex_lock ( &sched->lock );
+  sched->job_func = job_func;
+  sched->data = data;
+  sched->done = 0;
+  sched->running = sched->nworkers - 1;
+  ++sched->generation;
+  g_cond_broadcast ( &sched->start_cond );
+  g_mutex_unlock ( &sched->lock );
+
+  /* the calling thread is the worker 0, it also reports the progress */
+  reported = 0.0;
+
+  while ( ( job = next_job ( sched, 0 ) ) >= 0 )
+    {
+      job_func ( 0, job, data );
+      g_atomic_int_inc ( &sched->done );
+
+      if ( progress_func != NULL )
+        {
+          fraction = (gdouble) g_atomic_int_get ( &sched->done ) / (gdouble) njobs;
+
+          if ( fraction - reported >= 0.01 )
+            {
+              progress_func ( fraction );
+              reported = fraction;
+            }
+        }
+    }
+
+  g_mutex_lock ( &sched->lock );
+
+  while ( sched->running > 0 )
+    g_cond_wait ( &sched->idle_cond, &sched->lock );
+
+  g_mutex_unlock ( &sched->lock );
+}
+
+
+/*
+ * Stops a pool of workers.
+ */
+void
+scheduler_destroy ( SCHEDULER *sched )
+{
+  gint i;
+
+  if ( sched == NULL )
+    return;
+
+  g_mutex_lock ( &sched->lock );
+  sched->quit = TRUE;
+  g_cond_broadcast ( &sched->start_cond );
+  g_mutex_unlock ( &sched->lock );
+
+  for ( i=1; i<sched->nworkers; ++i )
+    g_thread_join ( sched->threads[i] );
+
+  for ( i=0; i<sched->nworkers; ++i )
+    g_mutex_clear ( &sched->queues[i].lock );
+
+  g_cond_clear ( &sched->idle_cond );
+  g_cond_clear ( &sched->start_cond );
+  g_mutex_clear ( &sched->lock );
+
+  g_free ( sched->threads );
+  g_free ( sched->workers );
+  g_free ( sched->queues );
+  g_free ( sched );
+}
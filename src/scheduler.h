@@ -0,0 +1,55 @@
+/*
+ * scheduler.h
+ *
+ * This file is distributed as a part of the Formulas Rendering Plugin for the GIMP.
+ * Copyright (c) 2005-2010 Nicolas BENOIT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+
+/* Pool of workers */
+typedef struct scheduler_t SCHEDULER;
+
+/* Job callback: runs the job number 'job' on the worker number 'worker' */
+typedef void (*SCHEDULER_JOB_FUNC) ( gint worker, gint job, gpointer data );
+
+/* Progress callback: always called from the calling thread */
+typedef void (*SCHEDULER_PROGRESS_FUNC) ( gdouble fraction );
+
+
+/* Returns the number of workers worth starting on this machine */
+gint scheduler_get_n_workers ( void );
+
+/* Starts a pool of 'nworkers' workers, the calling thread being the worker 0 */
+SCHEDULER *scheduler_new ( gint nworkers );
+
+/* Runs 'njobs' jobs on the workers of a pool and returns once every job is done */
+void scheduler_run ( SCHEDULER               *sched,
+                     const gint               njobs,
+                     SCHEDULER_JOB_FUNC       job_func,
+                     gpointer                 data,
+                     SCHEDULER_PROGRESS_FUNC  progress_func );
+
+/* Stops the workers of a pool */
+void scheduler_destroy ( SCHEDULER *sched );
+
+
+#endif
@@ -25,71 +25,86 @@
 #include "config.h"
 #endif
 
-#include <unistd.h>
-#include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 #include <glib.h>
-#include "error.h"
 #include "tokens_table.h"
 #include "maths_op.h"
 #include "maths_val.h"
 #include "maths_func.h"
-#include "plugin-intl.h"
+
+
+/* Number of hash codes */
+#define TOKENS_TABLE_SIZE 62
+
+
+/* Kinds of tokens */
+enum { TOKENS_NONE, TOKENS_OPERATOR, TOKENS_VALUE, TOKENS_FUNCTION };
+
+
+/* Entry of the table: the token is the index-th of the operators, values or
+   functions */
+typedef struct tokens_table_entry_t
+{
+  guchar  kind;
+  guchar  index;
+} TOKENS_TABLE_ENTRY ;
 
 
 /*
- * Hash function ( produced by gperf version 3.0.3 (using options -c -m 4096) )
+ * Hash function, a perfect hash of the tokens listed in symbols4gperf: no two
+ * of them get the same code, the characters found in none get codes out of
+ * the table.
  */
 static guint
-tokens_table_get_hash_code ( gconstpointer key )
+tokens_table_get_hash_code ( const gchar *str,
+                             const gsize  len )
 {
-  static guchar asso_values[] =
+  static const guchar asso_values[] =
     {
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 49, 51, 51,
-       0, 51, 48, 47, 51, 46, 51, 45, 12, 51,
-      34, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 38, 51, 51,  0, 12,  0,
-       6,  1, 51, 10, 14,  0, 37, 51,  7, 23,
-       4,  7, 21, 15, 15,  2,  0,  9, 21,  3,
-      18,  2, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
-      51, 51, 51, 51, 51, 51
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 14, 62, 62,
+       5, 62, 18,  4, 62, 10, 62, 19, 18, 62,
+       8, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 12, 62, 62,  3, 12, 19,
+      14,  8, 62,  7,  0, 14, 16, 62, 10, 15,
+      16, 13,  8,  1,  6, 19,  2,  5,  2,  3,
+       1,  7, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62, 62, 62, 62, 62,
+      62, 62, 62, 62, 62, 62
     };
 
-  register int hval = strlen( (gchar *) key);
+  guint hval = len;
 
-  switch (hval)
+  switch ( len )
     {
       default:
-        hval += asso_values[*( ((guchar *) key ) + 4)];
+        hval += asso_values[(guchar) str[4]];
       /*FALLTHROUGH*/
       case 4:
       case 3:
-        hval += asso_values[*( ((guchar *) key ) + 2)];
+        hval += asso_values[(guchar) str[2]];
       /*FALLTHROUGH*/
       case 2:
-        hval += asso_values[*( ((guchar *) key ) + 1)];
+        hval += asso_values[(guchar) str[1]];
       /*FALLTHROUGH*/
       case 1:
-        hval += asso_values[*( ((guchar *) key ) + 0)];
+        hval += asso_values[(guchar) str[0]];
         break;
     }
 
@@ -97,39 +112,119 @@ tokens_table_get_hash_code ( gconstpointer key )
 }
 
 
+/* Tokens by hash code, the indexes follow the order of operators[], values[]
+   and functions[] */
+static const TOKENS_TABLE_ENTRY tokens_table[TOKENS_TABLE_SIZE] =
+  {
+    { TOKENS_NONE,      0 },
+    { TOKENS_VALUE,    4 },  /* h */
+    { TOKENS_VALUE,    5 },  /* x */
+    { TOKENS_VALUE,    8 },  /* t */
+    { TOKENS_VALUE,    3 },  /* w */
+    { TOKENS_OPERATOR,  0 },  /* + */
+    { TOKENS_NONE,      0 },
+    { TOKENS_VALUE,    7 },  /* r */
+    { TOKENS_VALUE,    6 },  /* y */
+    { TOKENS_VALUE,    1 },  /* e */
+    { TOKENS_NONE,      0 },
+    { TOKENS_OPERATOR,  1 },  /* - */
+    { TOKENS_NONE,      0 },
+    { TOKENS_OPERATOR,  4 },  /* ^ */
+    { TOKENS_FUNCTION, 21 },  /* atanh( */
+    { TOKENS_OPERATOR,  5 },  /* % */
+    { TOKENS_FUNCTION, 34 },  /* avg( */
+    { TOKENS_VALUE,    2 },  /* j */
+    { TOKENS_FUNCTION, 19 },  /* atan( */
+    { TOKENS_OPERATOR,  2 },  /* * */
+    { TOKENS_OPERATOR,  3 },  /* / */
+    { TOKENS_FUNCTION, 29 },  /* exp( */
+    { TOKENS_FUNCTION, 20 },  /* atan2( */
+    { TOKENS_FUNCTION, 33 },  /* max( */
+    { TOKENS_VALUE,    0 },  /* pi */
+    { TOKENS_FUNCTION, 17 },  /* tan( */
+    { TOKENS_FUNCTION,  1 },  /* gray( */
+    { TOKENS_FUNCTION, 22 },  /* rad( */
+    { TOKENS_NONE,      0 },
+    { TOKENS_FUNCTION,  5 },  /* rgb( */
+    { TOKENS_FUNCTION,  4 },  /* alpha( */
+    { TOKENS_FUNCTION, 18 },  /* tanh( */
+    { TOKENS_FUNCTION,  0 },  /* red( */
+    { TOKENS_FUNCTION, 23 },  /* deg( */
+    { TOKENS_FUNCTION, 26 },  /* log( */
+    { TOKENS_FUNCTION,  6 },  /* rand( */
+    { TOKENS_FUNCTION, 24 },  /* sqrt( */
+    { TOKENS_FUNCTION,  3 },  /* blue( */
+    { TOKENS_FUNCTION,  7 },  /* abs( */
+    { TOKENS_NONE,      0 },
+    { TOKENS_FUNCTION, 27 },  /* log2( */
+    { TOKENS_FUNCTION, 16 },  /* acosh( */
+    { TOKENS_FUNCTION, 12 },  /* asinh( */
+    { TOKENS_FUNCTION,  2 },  /* green( */
+    { TOKENS_FUNCTION, 31 },  /* round( */
+    { TOKENS_FUNCTION, 15 },  /* acos( */
+    { TOKENS_FUNCTION, 11 },  /* asin( */
+    { TOKENS_FUNCTION, 25 },  /* cbrt( */
+    { TOKENS_NONE,      0 },
+    { TOKENS_FUNCTION, 32 },  /* min( */
+    { TOKENS_FUNCTION,  8 },  /* sign( */
+    { TOKENS_FUNCTION, 30 },  /* ceil( */
+    { TOKENS_NONE,      0 },
+    { TOKENS_FUNCTION,  9 },  /* sin( */
+    { TOKENS_FUNCTION, 28 },  /* log10( */
+    { TOKENS_FUNCTION, 13 },  /* cos( */
+    { TOKENS_NONE,      0 },
+    { TOKENS_NONE,      0 },
+    { TOKENS_NONE,      0 },
+    { TOKENS_FUNCTION, 10 },  /* sinh( */
+    { TOKENS_NONE,      0 },
+    { TOKENS_FUNCTION, 14 },  /* cosh( */
+  };
+
+
 /*
- * Creates the hash table.
+ * Looks up a token.
  */
-GHashTable *
-tokens_table_build ( void )
+gpointer
+tokens_table_lookup ( const gchar *str,
+                      const gsize  len )
 {
-  GHashTable *htable;
-  gint i;
-
-  if ((htable = g_hash_table_new(&(tokens_table_get_hash_code), &(g_str_equal))) == NULL)
-    {
-      error("exp_build_table", _("unable to build the table"));
-      return NULL;
-    }
+  const TOKENS_TABLE_ENTRY *entry;
+  const gchar *name;
+  gpointer token;
+  guint code;
 
-  for (i=0; operators[i].name!= NULL; ++i)
-    g_hash_table_insert(htable, operators[i].name, &operators[i] );
+  if ( ( len == 0 ) || ( len > MAX_KEY_LENGTH ) )
+    return NULL;
 
-  for (i=0; values[i].name!= NULL; ++i)
-    g_hash_table_insert(htable, values[i].name, &values[i] );
+  if ( ( code = tokens_table_get_hash_code ( str, len ) ) >= TOKENS_TABLE_SIZE )
+    return NULL;
 
-  for (i=0; functions[i].name!= NULL; ++i)
-    g_hash_table_insert(htable, functions[i].name, &functions[i] );
+  entry = &tokens_table[code];
 
-  return htable;
-}
+  switch ( entry->kind )
+    {
+    case TOKENS_OPERATOR:
+      token = &operators[entry->index];
+      name = operators[entry->index].name;
+      break;
+
+    case TOKENS_VALUE:
+      token = &values[entry->index];
+      name = values[entry->index].name;
+      break;
+
+    case TOKENS_FUNCTION:
+      token = &functions[entry->index];
+      name = functions[entry->index].name;
+      break;
+
+    default:
+      return NULL;
+    }
 
+  /* other strings share the codes of the tokens */
+  if ( ( strncmp ( name, str, len ) != 0 ) || ( name[len] != '\0' ) )
+    return NULL;
 
-/*
- * Destroys the hash table.
- */
-void
-tokens_table_destroy ( GHashTable *htable )
-{
-  g_hash_table_destroy(htable);
+  return token;
 }
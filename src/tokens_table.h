@@ -30,12 +30,10 @@
 #endif
 
 
-/* Creates the hash table */
-GHashTable *tokens_table_build ( void );
-
-
-/* Destroys the hash table */
-void tokens_table_destroy ( GHashTable *htable );
+/* Returns the operator, value or function whose name is the len first
+   characters of str, NULL if there is none. The table is static and
+   read-only, it may be used by several threads */
+gpointer tokens_table_lookup ( const gchar *str, const gsize len );
 
 
 #endif